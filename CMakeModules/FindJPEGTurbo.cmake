@@ -0,0 +1,17 @@
+include(CheckCSourceCompiles)
+
+find_package(JPEG)
+
+if(JPEG_FOUND)
+  # Tiles are compressed from BGR rows, which only libjpeg-turbo reads
+  set(CMAKE_REQUIRED_INCLUDES ${JPEG_INCLUDE_DIR})
+  check_c_source_compiles("
+#include <stdio.h>
+#include <jpeglib.h>
+int main(void) { return JCS_EXT_BGR; }" HAVE_JPEG_EXT_BGR)
+  unset(CMAKE_REQUIRED_INCLUDES)
+  if(NOT HAVE_JPEG_EXT_BGR)
+    message(STATUS "libjpeg is not libjpeg-turbo, no jpeg encoder")
+    set(JPEG_FOUND FALSE)
+  endif()
+endif()
@@ -0,0 +1,504 @@
+/*
+ * Copyright (C) 2016 Libre Space Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "iac.h"
+#include "camera.h"
+#include "demosaic.h"
+#include "utils.h"
+
+/*
+ * Simulated camera.  Frames are either read from a raw BGR file holding
+ * one or more frames, which are served in turn, or rendered from a
+ * deterministic synthetic scene which drifts horizontally from frame to
+ * frame.  Options are given as "sim:key=value,..." with keys width,
+ * height, fps, latency (in milliseconds), file and seed.  Raw frames are
+ * sampled from the scene through an RGGB colour filter array.
+ */
+typedef struct iac_cam_sim_t {
+    size_t width;
+    size_t height;
+    unsigned int fps;
+    unsigned int latency;
+    uint32_t seed;
+    unsigned char *scene;
+    size_t frame_size;
+    size_t pixel_size;
+    int bayer;
+    unsigned int scene_frames;
+    unsigned char *image;
+    unsigned char **buffers;
+    unsigned int buffer_count;
+    unsigned int number;
+    uint64_t deadline;
+} iac_cam_sim_t;
+
+static int iac_cam_sim_open(iac_cam_t *, const char *);
+static int iac_cam_sim_close(iac_cam_t *);
+static int iac_cam_sim_init(iac_cam_t *, const iac_cam_init_params_t *);
+static int iac_cam_sim_acquire(iac_cam_t *, iac_cam_frame_t *);
+static int iac_cam_sim_start(iac_cam_t *);
+static int iac_cam_sim_get(iac_cam_t *, iac_cam_frame_t *);
+static int iac_cam_sim_stop(iac_cam_t *);
+static int iac_cam_sim_options(iac_cam_sim_t *, const char *, char **);
+static int iac_cam_sim_load(iac_cam_sim_t *, const char *);
+static int iac_cam_sim_render(iac_cam_sim_t *);
+static int iac_cam_sim_bayer(iac_cam_sim_t *);
+static void iac_cam_sim_frame(iac_cam_sim_t *,
+                              iac_cam_frame_t *,
+                              unsigned char *);
+static uint32_t iac_cam_sim_hash(uint32_t, uint32_t, uint32_t);
+static unsigned int iac_cam_sim_noise(uint32_t, size_t, size_t, size_t);
+
+const iac_cam_ops_t iac_cam_sim_ops = {
+    "sim",
+    iac_cam_sim_open,
+    iac_cam_sim_close,
+    iac_cam_sim_init,
+    iac_cam_sim_acquire,
+    iac_cam_sim_start,
+    iac_cam_sim_get,
+    iac_cam_sim_stop,
+};
+
+static int iac_cam_sim_options(iac_cam_sim_t *sim,
+                               const char *options,
+                               char **file)
+{
+    char *opts, *opt, *value, *save;
+    int ret = IAC_SUCCESS;
+
+    opts = strdup(options);
+    if (!opts) {
+        perror("Unable to parse camera options");
+        return IAC_FAILURE;
+    }
+
+    for (opt = strtok_r(opts, ",", &save);
+         opt;
+         opt = strtok_r(NULL, ",", &save)) {
+        value = strchr(opt, '=');
+        if (!value) {
+            fprintf(stderr, "Invalid camera option '%s'!\n", opt);
+            ret = IAC_FAILURE;
+            break;
+        }
+        *value++ = '\0';
+        if (!strcmp(opt, "width")) {
+            sim->width = (size_t) atoi(value);
+        }
+        else if (!strcmp(opt, "height")) {
+            sim->height = (size_t) atoi(value);
+        }
+        else if (!strcmp(opt, "fps")) {
+            sim->fps = (unsigned int) atoi(value);
+        }
+        else if (!strcmp(opt, "latency")) {
+            sim->latency = (unsigned int) atoi(value);
+        }
+        else if (!strcmp(opt, "seed")) {
+            sim->seed = (uint32_t) strtoul(value, NULL, 0);
+        }
+        else if (!strcmp(opt, "file")) {
+            free(*file);
+            *file = strdup(value);
+        }
+        else {
+            fprintf(stderr, "Unknown camera option '%s'!\n", opt);
+            ret = IAC_FAILURE;
+            break;
+        }
+    }
+    free(opts);
+
+    return ret;
+}
+
+
+static int iac_cam_sim_open(iac_cam_t *cam, const char *options)
+{
+    iac_cam_sim_t *sim;
+    char *file = NULL;
+    int ret;
+
+    sim = calloc(1, sizeof(*sim));
+    if (!sim) {
+        perror("Unable to allocate camera");
+        return IAC_FAILURE;
+    }
+    sim->width = IAC_CAM_SIM_WIDTH;
+    sim->height = IAC_CAM_SIM_HEIGHT;
+    sim->seed = 1;
+
+    if (options
+        && iac_cam_sim_options(sim, options, &file) == IAC_FAILURE) {
+        free(file);
+        free(sim);
+        return IAC_FAILURE;
+    }
+    if (!sim->width || !sim->height) {
+        fprintf(stderr, "Invalid simulated camera geometry!\n");
+        free(file);
+        free(sim);
+        return IAC_FAILURE;
+    }
+    sim->pixel_size = IAC_IMAGE_CHANNELS;
+    sim->frame_size = sim->width * sim->height * sim->pixel_size;
+
+    if (file)
+        ret = iac_cam_sim_load(sim, file);
+    else
+        ret = iac_cam_sim_render(sim);
+    free(file);
+    if (ret == IAC_FAILURE) {
+        free(sim);
+        return IAC_FAILURE;
+    }
+    cam->priv = sim;
+
+    return IAC_SUCCESS;
+}
+
+
+static int iac_cam_sim_close(iac_cam_t *cam)
+{
+    iac_cam_sim_t *sim = cam->priv;
+
+    free(sim->scene);
+    free(sim->image);
+    free(sim);
+    cam->priv = NULL;
+
+    return IAC_SUCCESS;
+}
+
+
+static int iac_cam_sim_init(iac_cam_t *cam,
+                            const iac_cam_init_params_t *params)
+{
+    iac_cam_sim_t *sim = cam->priv;
+
+    /* Exposure, gain and white balance have no effect on the scene */
+    IAC_VERBOSE("Simulated camera %zux%zu, %u fps, %u ms latency%s\n",
+                sim->width,
+                sim->height,
+                sim->fps,
+                sim->latency,
+                params->bayer ? ", raw Bayer" : "");
+    if (params->bayer && !sim->bayer)
+        return iac_cam_sim_bayer(sim);
+
+    return IAC_SUCCESS;
+}
+
+
+/* Sample each frame of the scene into a raw frame in place of it */
+static int iac_cam_sim_bayer(iac_cam_sim_t *sim)
+{
+    unsigned char *raw;
+    size_t size = sim->width * sim->height;
+    unsigned int i, frames = sim->scene_frames ? sim->scene_frames : 1;
+
+    raw = malloc(frames * size);
+    if (!raw) {
+        perror("Unable to allocate camera scene");
+        return IAC_FAILURE;
+    }
+    for (i = 0; i < frames; i++)
+        iac_demosaic_sample(raw + i * size,
+                            sim->scene + i * sim->frame_size,
+                            sim->width,
+                            sim->height,
+                            IAC_BAYER_RGGB);
+    free(sim->scene);
+    sim->scene = raw;
+    sim->bayer = IAC_BAYER_RGGB;
+    sim->pixel_size = 1;
+    sim->frame_size = size;
+
+    return IAC_SUCCESS;
+}
+
+
+/*
+ * Read raw frames from file.  The file must hold a whole number of frames
+ * of the configured geometry.
+ */
+static int iac_cam_sim_load(iac_cam_sim_t *sim, const char *file)
+{
+    struct stat st;
+    ssize_t count;
+    size_t offset = 0;
+    int fd;
+
+    fd = open(file, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror("Unable to open camera file");
+        if (fd >= 0)
+            close(fd);
+        return IAC_FAILURE;
+    }
+    if (!st.st_size || (size_t) st.st_size % sim->frame_size) {
+        fprintf(stderr,
+                "Camera file size is not a multiple of %zux%zu frames!\n",
+                sim->width,
+                sim->height);
+        close(fd);
+        return IAC_FAILURE;
+    }
+    sim->scene_frames = (unsigned int) ((size_t) st.st_size
+                                        / sim->frame_size);
+
+    sim->scene = malloc((size_t) st.st_size);
+    if (!sim->scene) {
+        perror("Unable to allocate camera file");
+        close(fd);
+        return IAC_FAILURE;
+    }
+    while (offset < (size_t) st.st_size) {
+        count = read(fd, sim->scene + offset, (size_t) st.st_size - offset);
+        if (count <= 0) {
+            perror("Unable to read camera file");
+            free(sim->scene);
+            sim->scene = NULL;
+            close(fd);
+            return IAC_FAILURE;
+        }
+        offset += (size_t) count;
+    }
+    close(fd);
+
+    return IAC_SUCCESS;
+}
+
+
+static uint32_t iac_cam_sim_hash(uint32_t seed, uint32_t x, uint32_t y)
+{
+    uint32_t h = seed ^ (x * 0x9e3779b1u) ^ (y * 0x85ebca77u);
+
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    h ^= h >> 12;
+    h *= 0x297a2d39u;
+    h ^= h >> 15;
+
+    return h;
+}
+
+
+/*
+ * Value noise in [0, 255], interpolating a hashed lattice with the given
+ * cell size.
+ */
+static unsigned int iac_cam_sim_noise(uint32_t seed,
+                                      size_t x,
+                                      size_t y,
+                                      size_t cell)
+{
+    uint32_t cx = (uint32_t) (x / cell), cy = (uint32_t) (y / cell);
+    uint32_t fx = (uint32_t) (x % cell), fy = (uint32_t) (y % cell);
+    uint32_t c = (uint32_t) cell;
+    uint32_t a, b, top, bottom;
+
+    a = iac_cam_sim_hash(seed, cx, cy) & 0xff;
+    b = iac_cam_sim_hash(seed, cx + 1, cy) & 0xff;
+    top = (a * (c - fx) + b * fx) / c;
+    a = iac_cam_sim_hash(seed, cx, cy + 1) & 0xff;
+    b = iac_cam_sim_hash(seed, cx + 1, cy + 1) & 0xff;
+    bottom = (a * (c - fx) + b * fx) / c;
+
+    return (top * (c - fy) + bottom * fy) / c;
+}
+
+
+/*
+ * Render a synthetic earth observation scene: a band of black space with
+ * a few stars above the horizon, and below it a blue gradient with cloud
+ * texture, so that tiles range from uniform to detailed.
+ */
+static int iac_cam_sim_render(iac_cam_sim_t *sim)
+{
+    unsigned char *p;
+    size_t x, y, horizon = sim->height / 5;
+    unsigned int cloud, shade;
+
+    sim->scene_frames = 0;
+    sim->scene = malloc(sim->frame_size);
+    if (!sim->scene) {
+        perror("Unable to allocate camera scene");
+        return IAC_FAILURE;
+    }
+
+    p = sim->scene;
+    for (y = 0; y < sim->height; y++) {
+        for (x = 0; x < sim->width; x++, p += IAC_IMAGE_CHANNELS) {
+            if (y < horizon) {
+                /* Space */
+                shade = iac_cam_sim_hash(sim->seed,
+                                         (uint32_t) x,
+                                         (uint32_t) y) % 4099 ? 0 : 255;
+                p[0] = p[1] = p[2] = (unsigned char) shade;
+                continue;
+            }
+
+            /* Earth */
+            cloud = (2 * iac_cam_sim_noise(sim->seed, x, y, 64)
+                     + iac_cam_sim_noise(sim->seed + 1, x, y, 16)) / 3;
+            cloud = cloud > 128 ? (cloud - 128) * 2 : 0;
+            shade = (unsigned int) (64 + 96 * (y - horizon)
+                                    / (sim->height - horizon));
+            p[0] = (unsigned char) (shade + (255 - shade) * cloud / 255);
+            p[1] = (unsigned char) (shade / 2 + (255 - shade / 2)
+                                    * cloud / 255);
+            p[2] = (unsigned char) (shade / 4 + (255 - shade / 4)
+                                    * cloud / 255);
+        }
+    }
+
+    return IAC_SUCCESS;
+}
+
+
+/*
+ * Produce next frame.  Frames from file are served in place, synthetic
+ * frames are copied shifted into the given buffer, by whole cells of the
+ * colour filter array for raw frames.
+ */
+static void iac_cam_sim_frame(iac_cam_sim_t *sim,
+                              iac_cam_frame_t *frame,
+                              unsigned char *buf)
+{
+    size_t y, shift, stride = sim->width * sim->pixel_size;
+    const unsigned char *src;
+    unsigned int i;
+
+    if (sim->scene_frames) {
+        frame->data = sim->scene
+            + (sim->number % sim->scene_frames) * sim->frame_size;
+    }
+    else {
+        shift = (sim->number * (sim->width / 64 + 1)) % sim->width;
+        if (sim->bayer)
+            shift &= ~(size_t) 1;
+        shift *= sim->pixel_size;
+        for (y = 0, src = sim->scene; y < sim->height; y++, src += stride) {
+            memcpy(buf, src + shift, stride - shift);
+            memcpy(buf + stride - shift, src, shift);
+            buf += stride;
+        }
+        frame->data = buf - sim->frame_size;
+    }
+    frame->size = sim->frame_size;
+    frame->width = sim->width;
+    frame->height = sim->height;
+    frame->number = sim->number++;
+    frame->bayer = sim->bayer;
+    for (i = 0; i < IAC_IMAGE_CHANNELS; i++)
+        frame->gains[i] = 1.0;
+
+}
+
+
+static int iac_cam_sim_acquire(iac_cam_t *cam, iac_cam_frame_t *frame)
+{
+    iac_cam_sim_t *sim = cam->priv;
+
+    if (!sim->scene_frames && !sim->image) {
+        sim->image = malloc(sim->frame_size);
+        if (!sim->image) {
+            perror("Unable to allocate frame");
+            return IAC_FAILURE;
+        }
+    }
+    if (sim->latency)
+        usleep(sim->latency * 1000);
+    iac_cam_sim_frame(sim, frame, sim->image);
+
+    return IAC_SUCCESS;
+}
+
+
+static int iac_cam_sim_start(iac_cam_t *cam)
+{
+    iac_cam_sim_t *sim = cam->priv;
+    unsigned int i;
+
+    /* Frames from file need no buffers of their own */
+    sim->buffer_count = sim->scene_frames ? 0 : cam->size;
+    sim->buffers = calloc(cam->size, sizeof(unsigned char *));
+    if (!sim->buffers) {
+        perror("Unable to allocate frame buffers");
+        return IAC_FAILURE;
+    }
+    for (i = 0; i < sim->buffer_count; i++) {
+        sim->buffers[i] = malloc(sim->frame_size);
+        if (!sim->buffers[i]) {
+            perror("Unable to allocate frame buffers");
+            iac_cam_sim_stop(cam);
+            return IAC_FAILURE;
+        }
+    }
+    sim->deadline = iac_time_usec() + sim->latency * 1000;
+
+    return IAC_SUCCESS;
+}
+
+
+static int iac_cam_sim_get(iac_cam_t *cam, iac_cam_frame_t *frame)
+{
+    iac_cam_sim_t *sim = cam->priv;
+    uint64_t now;
+
+    /* Pace frames at the configured rate */
+    now = iac_time_usec();
+    if (sim->deadline > now)
+        usleep((useconds_t) (sim->deadline - now));
+    else
+        sim->deadline = now;
+    if (sim->fps)
+        sim->deadline += 1000000 / sim->fps;
+    else
+        sim->deadline += sim->latency * 1000;
+
+    iac_cam_sim_frame(sim, frame, sim->buffers[frame->slot]);
+
+    return IAC_SUCCESS;
+}
+
+
+static int iac_cam_sim_stop(iac_cam_t *cam)
+{
+    iac_cam_sim_t *sim = cam->priv;
+    unsigned int i;
+
+    if (sim->buffers) {
+        for (i = 0; i < sim->buffer_count; i++)
+            free(sim->buffers[i]);
+    }
+    free(sim->buffers);
+    sim->buffers = NULL;
+    sim->buffer_count = 0;
+
+    return IAC_SUCCESS;
+}
@@ -0,0 +1,337 @@
+/*
+ * Copyright (C) 2016 Libre Space Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <m3api/xiApi.h>
+#include "iac.h"
+#include "camera.h"
+
+typedef struct iac_cam_ximea_t {
+    HANDLE handle;
+    XI_IMG image;
+    XI_IMG *images;
+    int bayer;
+} iac_cam_ximea_t;
+
+static int iac_cam_ximea_open(iac_cam_t *, const char *);
+static int iac_cam_ximea_close(iac_cam_t *);
+static int iac_cam_ximea_init(iac_cam_t *, const iac_cam_init_params_t *);
+static int iac_cam_ximea_acquire(iac_cam_t *, iac_cam_frame_t *);
+static int iac_cam_ximea_start(iac_cam_t *);
+static int iac_cam_ximea_get(iac_cam_t *, iac_cam_frame_t *);
+static int iac_cam_ximea_stop(iac_cam_t *);
+static int iac_cam_ximea_bayer(iac_cam_ximea_t *);
+static void iac_cam_ximea_frame(iac_cam_ximea_t *,
+                                iac_cam_frame_t *,
+                                const XI_IMG *);
+
+const iac_cam_ops_t iac_cam_ximea_ops = {
+    "ximea",
+    iac_cam_ximea_open,
+    iac_cam_ximea_close,
+    iac_cam_ximea_init,
+    iac_cam_ximea_acquire,
+    iac_cam_ximea_start,
+    iac_cam_ximea_get,
+    iac_cam_ximea_stop,
+};
+
+static int iac_cam_ximea_open(iac_cam_t *cam, const char *options)
+{
+    iac_cam_ximea_t *ximea;
+
+    ximea = calloc(1, sizeof(*ximea));
+    if (!ximea) {
+        perror("Unable to allocate camera");
+        return IAC_FAILURE;
+    }
+
+    /* Open camera */
+    if (xiOpenDevice(IAC_CAM_DEVICE, &ximea->handle) != XI_OK) {
+        fprintf(stderr, "Unable to open camera!\n");
+        free(ximea);
+        return IAC_FAILURE;
+    }
+    cam->priv = ximea;
+
+    return IAC_SUCCESS;
+}
+
+
+static int iac_cam_ximea_close(iac_cam_t *cam)
+{
+    iac_cam_ximea_t *ximea = cam->priv;
+    int ret = IAC_SUCCESS;
+
+    /* Close camera */
+    if (xiCloseDevice(ximea->handle) != XI_OK) {
+        fprintf(stderr, "Unable to close camera!\n");
+        ret = IAC_FAILURE;
+    }
+    free(ximea);
+    cam->priv = NULL;
+
+    return ret;
+}
+
+
+static int iac_cam_ximea_init(iac_cam_t *cam,
+                              const iac_cam_init_params_t *params)
+{
+    iac_cam_ximea_t *ximea = cam->priv;
+    HANDLE handle = ximea->handle;
+
+    if (params->buffers) {
+        /*
+         * Stream frames from buffers of the API, handed out in place.
+         * The API takes a buffer back into its queue once the next
+         * image is taken, so only one frame is handed out at a time.
+         * Keep one buffer more so that the camera always has one to
+         * fill, and deliver the most recent frame.
+         */
+        if (xiSetParamInt(handle,
+                          XI_PRM_BUFFER_POLICY,
+                          XI_BP_UNSAFE) != XI_OK) {
+            fprintf(stderr, "Unable to set unsafe buffer policy!\n");
+            return IAC_FAILURE;
+        }
+        if (xiSetParamInt(handle,
+                          XI_PRM_BUFFERS_QUEUE_SIZE,
+                          (int) params->buffers + 1) != XI_OK) {
+            fprintf(stderr, "Unable to set buffers queue size!\n");
+            return IAC_FAILURE;
+        }
+        if (xiSetParamInt(handle, XI_PRM_RECENT_FRAME, 1) != XI_OK) {
+            fprintf(stderr, "Unable to set recent frame!\n");
+            return IAC_FAILURE;
+        }
+    }
+    else {
+        /* Use safe buffer */
+        if (xiSetParamInt(handle,
+                          XI_PRM_BUFFER_POLICY,
+                          XI_BP_SAFE) != XI_OK) {
+            fprintf(stderr, "Unable to set safe buffer policy!\n");
+            return IAC_FAILURE;
+        }
+    }
+
+    /* Set exposure */
+    if (params->exposure) {
+        if (xiSetParamInt(handle,
+                          XI_PRM_EXPOSURE,
+                          params->exposure) != XI_OK) {
+            fprintf(stderr, "Unable to set exposure!\n");
+            return IAC_FAILURE;
+        }
+    }
+
+    /* Set gain */
+    if (params->gain) {
+        if (xiSetParamFloat(handle,
+                            XI_PRM_GAIN,
+                            (float) params->gain) != XI_OK) {
+            fprintf(stderr, "Unable to set gain!\n");
+            return IAC_FAILURE;
+        }
+    }
+
+    /* Set white balance */
+    if (params->auto_wb) {
+        if (xiSetParamInt(handle,
+                          XI_PRM_AUTO_WB,
+                          params->auto_wb) != XI_OK) {
+            fprintf(stderr, "Unable to set auto white balance!\n");
+            return IAC_FAILURE;
+        }
+    }
+
+    /* Set image format, raw frames being interpolated by the caller */
+    if (xiSetParamInt(handle,
+                      XI_PRM_IMAGE_DATA_FORMAT,
+                      params->bayer ?
+                      IAC_CAM_RAW_FORMAT : IAC_CAM_FORMAT) != XI_OK) {
+        fprintf(stderr, "Unable to set image format!\n");
+        return IAC_FAILURE;
+    }
+    ximea->bayer = IAC_BAYER_NONE;
+    if (params->bayer)
+        return iac_cam_ximea_bayer(ximea);
+
+    return IAC_SUCCESS;
+}
+
+
+/* Find colour filter array of the sensor */
+static int iac_cam_ximea_bayer(iac_cam_ximea_t *ximea)
+{
+    int cfa;
+
+    if (xiGetParamInt(ximea->handle,
+                      XI_PRM_COLOR_FILTER_ARRAY,
+                      &cfa) != XI_OK) {
+        fprintf(stderr, "Unable to get colour filter array!\n");
+        return IAC_FAILURE;
+    }
+    switch (cfa) {
+    case XI_CFA_BAYER_RGGB:
+        ximea->bayer = IAC_BAYER_RGGB;
+        break;
+    case XI_CFA_BAYER_GRBG:
+        ximea->bayer = IAC_BAYER_GRBG;
+        break;
+    case XI_CFA_BAYER_GBRG:
+        ximea->bayer = IAC_BAYER_GBRG;
+        break;
+    case XI_CFA_BAYER_BGGR:
+        ximea->bayer = IAC_BAYER_BGGR;
+        break;
+    default:
+        fprintf(stderr, "Camera has no Bayer colour filter array!\n");
+        return IAC_FAILURE;
+    }
+
+    return IAC_SUCCESS;
+}
+
+
+/*
+ * Describe image as frame.  White balance coefficients of raw images,
+ * measured when automatic white balance is on, are left to the caller.
+ */
+static void iac_cam_ximea_frame(iac_cam_ximea_t *ximea,
+                                iac_cam_frame_t *frame,
+                                const XI_IMG *image)
+{
+    float kb = 1, kg = 1, kr = 1;
+
+    frame->data = (const unsigned char *) image->bp;
+    frame->size = image->bp_size;
+    frame->width = image->width;
+    frame->height = image->height;
+    frame->number = (unsigned int) image->nframe;
+    frame->bayer = ximea->bayer;
+    if (ximea->bayer) {
+        xiGetParamFloat(ximea->handle, XI_PRM_WB_KB, &kb);
+        xiGetParamFloat(ximea->handle, XI_PRM_WB_KG, &kg);
+        xiGetParamFloat(ximea->handle, XI_PRM_WB_KR, &kr);
+    }
+    frame->gains[0] = kb;
+    frame->gains[1] = kg;
+    frame->gains[2] = kr;
+
+}
+
+
+static int iac_cam_ximea_acquire(iac_cam_t *cam, iac_cam_frame_t *frame)
+{
+    iac_cam_ximea_t *ximea = cam->priv;
+
+    /* Start acquiring */
+    if (xiStartAcquisition(ximea->handle) != XI_OK) {
+        fprintf(stderr, "Unable to start acquisition!\n");
+        return IAC_FAILURE;
+    }
+
+    /* Get image */
+    memset(&ximea->image, 0, sizeof(XI_IMG));
+    ximea->image.size = sizeof(XI_IMG);
+    if (xiGetImage(ximea->handle,
+                   IAC_CAM_ACQUIRE_TIMEOUT,
+                   &ximea->image) != XI_OK) {
+        fprintf(stderr, "Unable to get image!\n");
+        return IAC_FAILURE;
+    }
+
+    /* Stop acquiring */
+    if (xiStopAcquisition(ximea->handle) != XI_OK) {
+        fprintf(stderr, "Unable to stop acquisition!\n");
+        return IAC_FAILURE;
+    }
+    iac_cam_ximea_frame(ximea, frame, &ximea->image);
+
+    return IAC_SUCCESS;
+}
+
+
+static int iac_cam_ximea_start(iac_cam_t *cam)
+{
+    iac_cam_ximea_t *ximea = cam->priv;
+
+    ximea->images = calloc(cam->size, sizeof(XI_IMG));
+    if (!ximea->images) {
+        perror("Unable to allocate frame descriptors");
+        return IAC_FAILURE;
+    }
+
+    /* Start acquiring, until stream is stopped */
+    if (xiStartAcquisition(ximea->handle) != XI_OK) {
+        fprintf(stderr, "Unable to start acquisition!\n");
+        free(ximea->images);
+        ximea->images = NULL;
+        return IAC_FAILURE;
+    }
+
+    return IAC_SUCCESS;
+}
+
+
+static int iac_cam_ximea_get(iac_cam_t *cam, iac_cam_frame_t *frame)
+{
+    iac_cam_ximea_t *ximea = cam->priv;
+    XI_IMG *image = &ximea->images[frame->slot];
+    unsigned int i;
+
+    /* Taking an image gives the buffer of the frame out back to the API */
+    for (i = 0; i < cam->size; i++) {
+        if (cam->busy[i]) {
+            fprintf(stderr, "Frame in slot %u is still in use!\n", i);
+            return IAC_FAILURE;
+        }
+    }
+
+    /* Get image in buffer of the API */
+    memset(image, 0, sizeof(XI_IMG));
+    image->size = sizeof(XI_IMG);
+    if (xiGetImage(ximea->handle, IAC_CAM_ACQUIRE_TIMEOUT, image) != XI_OK) {
+        fprintf(stderr, "Unable to get image!\n");
+        return IAC_FAILURE;
+    }
+    iac_cam_ximea_frame(ximea, frame, image);
+
+    return IAC_SUCCESS;
+}
+
+
+static int iac_cam_ximea_stop(iac_cam_t *cam)
+{
+    iac_cam_ximea_t *ximea = cam->priv;
+    int ret = IAC_SUCCESS;
+
+    /* Stop acquiring */
+    if (xiStopAcquisition(ximea->handle) != XI_OK) {
+        fprintf(stderr, "Unable to stop acquisition!\n");
+        ret = IAC_FAILURE;
+    }
+    free(ximea->images);
+    ximea->images = NULL;
+
+    return ret;
+}
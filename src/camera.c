@@ -15,108 +15,168 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+
 #include <stdio.h>
-#include <m3api/xiApi.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include "iac.h"
 #include "camera.h"
+#include "trace.h"
+
+/* Available backends, first one is the default */
+static const iac_cam_ops_t *iac_cam_backends[] = {
+#ifdef IAC_HAVE_XIAPI
+    &iac_cam_ximea_ops,
+#endif
+    &iac_cam_sim_ops,
+    NULL
+};
 
-int iac_cam_open(HANDLE *handle)
+/*
+ * Open camera backend given by spec "name[:options]".  If spec is NULL,
+ * the default backend is opened.
+ */
+int iac_cam_open(iac_cam_t *cam, const char *spec)
 {
+    const iac_cam_ops_t **ops;
+    const char *options = NULL;
+    size_t len = 0;
+
+    memset(cam, 0, sizeof(*cam));
+    if (spec) {
+        options = strchr(spec, ':');
+        len = options ? (size_t) (options - spec) : strlen(spec);
+        if (options)
+            options++;
+    }
 
-    /* Open camera */
-    if (xiOpenDevice(IAC_CAM_DEVICE, handle) != XI_OK) {
-        fprintf(stderr, "Unable to open camera!\n");
+    for (ops = iac_cam_backends; *ops; ops++) {
+        if (!spec || (strlen((*ops)->name) == len &&
+                      !strncmp((*ops)->name, spec, len)))
+            break;
+    }
+    if (!*ops) {
+        fprintf(stderr, "Unknown camera '%s'!\n", spec);
         return IAC_FAILURE;
     }
+    cam->ops = *ops;
 
-    return IAC_SUCCESS;
+    return cam->ops->open(cam, options);
 }
 
 
-int iac_cam_close(const HANDLE *handle)
+int iac_cam_close(iac_cam_t *cam)
 {
 
-    /* Close camera */
-    if (xiCloseDevice(*handle) != XI_OK) {
-        fprintf(stderr, "Unable to close camera!\n");
-        return IAC_FAILURE;
-    }
+    return cam->ops->close(cam);
 
-    return IAC_SUCCESS;
 }
 
 
-int iac_cam_init(const HANDLE *handle, const iac_cam_init_params_t *params)
+int iac_cam_init(iac_cam_t *cam, const iac_cam_init_params_t *params)
 {
 
-    /* Use safe buffer */
-    if (xiSetParamInt(*handle, XI_PRM_BUFFER_POLICY, XI_BP_SAFE) != XI_OK) {
-        fprintf(stderr, "Unable to set safe buffer policy!\n");
-        return IAC_FAILURE;
-    }
+    return cam->ops->init(cam, params);
 
-    /* Set exposure */
-    if (params->exposure) {
-        if (xiSetParamInt(*handle,
-                          XI_PRM_EXPOSURE,
-                          params->exposure) != XI_OK) {
-            fprintf(stderr, "Unable to set exposure!\n");
-            return IAC_FAILURE;
-        }
-    }
+}
 
-    /* Set gain */
-    if (params->gain) {
-        if (xiSetParamFloat(*handle,
-                            XI_PRM_GAIN,
-                            (float) params->gain) != XI_OK) {
-            fprintf(stderr, "Unable to set gain!\n");
-            return IAC_FAILURE;
-        }
-    }
 
-    /* Set white balance */
-    if (params->auto_wb) {
-        if (xiSetParamInt(*handle,
-                          XI_PRM_AUTO_WB,
-                          params->auto_wb) != XI_OK) {
-            fprintf(stderr, "Unable to set auto white balance!\n");
-            return IAC_FAILURE;
-        }
-    }
+int iac_cam_acquire(iac_cam_t *cam, iac_cam_frame_t *frame)
+{
+    int ret;
 
-    /* Set image format */
-    if (xiSetParamInt(*handle,
-                      XI_PRM_IMAGE_DATA_FORMAT,
-                      IAC_CAM_FORMAT) != XI_OK) {
-        fprintf(stderr, "Unable to set image format!\n");
-        return IAC_FAILURE;
+    memset(frame, 0, sizeof(*frame));
+    IAC_TRACE_ENTER("cam_acquire");
+    ret = cam->ops->acquire(cam, frame);
+    IAC_TRACE_LEAVE("cam_acquire");
+
+    return ret;
+}
+
+
+int iac_cam_stream_start(iac_cam_t *cam, const unsigned int size)
+{
+
+    cam->size = size;
+    cam->next = 0;
+    cam->frames = calloc(size, sizeof(iac_cam_frame_t));
+    cam->busy = calloc(size, sizeof(int));
+    if (!cam->frames || !cam->busy) {
+        perror("Unable to allocate frame ring");
+        goto fail;
     }
 
+    /* Start acquiring, until stream is stopped */
+    if (cam->ops->start(cam) != IAC_SUCCESS)
+        goto fail;
+
     return IAC_SUCCESS;
+
+fail:
+    free(cam->frames);
+    free(cam->busy);
+    cam->frames = NULL;
+    cam->busy = NULL;
+    return IAC_FAILURE;
 }
 
 
-int iac_cam_acquire(const HANDLE *handle, XI_IMG *image)
+/*
+ * Get next frame by reference into a free slot of the ring.  The frame
+ * stays valid until it is put back to the ring.  Backends handing out
+ * frames in buffers of their API may allow only one frame out at once.
+ */
+iac_cam_frame_t *iac_cam_stream_get(iac_cam_t *cam)
 {
-
-    /* Start acquiring */
-    if (xiStartAcquisition(*handle) != XI_OK) {
-        fprintf(stderr, "Unable to start acquisition!\n");
-        return IAC_FAILURE;
+    iac_cam_frame_t *frame;
+    unsigned int i;
+    int ret;
+
+    /* Find free frame slot */
+    for (i = 0; i < cam->size; i++)
+        if (!cam->busy[(cam->next + i) % cam->size])
+            break;
+    if (i == cam->size) {
+        fprintf(stderr, "No free frame in ring!\n");
+        return NULL;
     }
+    i = (cam->next + i) % cam->size;
+    frame = &cam->frames[i];
 
     /* Get image */
-    if (xiGetImage(*handle, IAC_CAM_ACQUIRE_TIMEOUT, image) != XI_OK) {
-        fprintf(stderr, "Unable to get image!\n");
-        return IAC_FAILURE;
-    }
+    memset(frame, 0, sizeof(*frame));
+    frame->slot = i;
+    IAC_TRACE_BEGIN_ARG("cam_get", i);
+    ret = cam->ops->get(cam, frame);
+    IAC_TRACE_LEAVE("cam_get");
+    if (ret != IAC_SUCCESS)
+        return NULL;
+    cam->busy[i] = 1;
+    cam->next = (i + 1) % cam->size;
+
+    return frame;
+}
+
+
+void iac_cam_stream_put(iac_cam_t *cam, const iac_cam_frame_t *frame)
+{
+
+    cam->busy[frame->slot] = 0;
+
+}
+
+
+int iac_cam_stream_stop(iac_cam_t *cam)
+{
+    int ret;
 
     /* Stop acquiring */
-    if (xiStopAcquisition(*handle) != XI_OK) {
-        fprintf(stderr, "Unable to stop acquisition!\n");
-        return IAC_FAILURE;
-    }
+    ret = cam->ops->stop(cam);
+    free(cam->frames);
+    free(cam->busy);
+    cam->frames = NULL;
+    cam->busy = NULL;
 
-    return IAC_SUCCESS;
+    return ret;
 }
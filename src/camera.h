@@ -15,6 +15,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+
 #ifndef __CAMERA_H
 #define __CAMERA_H
 
@@ -22,11 +23,53 @@ typedef struct iac_cam_init_params_t {
     int exposure;
     double gain;
     int auto_wb;
+    unsigned int buffers;
+    int bayer;
 } iac_cam_init_params_t;
 
-int iac_cam_open(HANDLE *);
-int iac_cam_close(const HANDLE *);
-int iac_cam_init(const HANDLE *, const iac_cam_init_params_t *);
-int iac_cam_acquire(const HANDLE *, XI_IMG *);
+typedef struct iac_cam_frame_t {
+    const unsigned char *data;
+    size_t size;
+    size_t width;
+    size_t height;
+    unsigned int number;
+    unsigned int slot;
+    int bayer;
+    double gains[IAC_IMAGE_CHANNELS];
+} iac_cam_frame_t;
+
+typedef struct iac_cam_t {
+    const struct iac_cam_ops_t *ops;
+    void *priv;
+    iac_cam_frame_t *frames;
+    int *busy;
+    unsigned int size;
+    unsigned int next;
+} iac_cam_t;
+
+typedef struct iac_cam_ops_t {
+    const char *name;
+    int (*open)(iac_cam_t *, const char *);
+    int (*close)(iac_cam_t *);
+    int (*init)(iac_cam_t *, const iac_cam_init_params_t *);
+    int (*acquire)(iac_cam_t *, iac_cam_frame_t *);
+    int (*start)(iac_cam_t *);
+    int (*get)(iac_cam_t *, iac_cam_frame_t *);
+    int (*stop)(iac_cam_t *);
+} iac_cam_ops_t;
+
+#ifdef IAC_HAVE_XIAPI
+extern const iac_cam_ops_t iac_cam_ximea_ops;
+#endif
+extern const iac_cam_ops_t iac_cam_sim_ops;
+
+int iac_cam_open(iac_cam_t *, const char *);
+int iac_cam_close(iac_cam_t *);
+int iac_cam_init(iac_cam_t *, const iac_cam_init_params_t *);
+int iac_cam_acquire(iac_cam_t *, iac_cam_frame_t *);
+int iac_cam_stream_start(iac_cam_t *, const unsigned int);
+iac_cam_frame_t *iac_cam_stream_get(iac_cam_t *);
+void iac_cam_stream_put(iac_cam_t *, const iac_cam_frame_t *);
+int iac_cam_stream_stop(iac_cam_t *);
 
 #endif
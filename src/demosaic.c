@@ -0,0 +1,304 @@
+/*
+ * Copyright (C) 2016 Libre Space Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+#include "iac.h"
+#include "demosaic.h"
+
+/*
+ * Bilinear interpolation of raw Bayer frames into BGR.  Green at red and
+ * blue sites is the mean of its four neighbours, or, edge aware, of the
+ * two along the smoother direction.  Red and blue are the mean of their
+ * two or four nearest sites.  Means of four pixels are taken as means of
+ * pairs, rounded up as NEON does, so that both kernels agree to the bit.
+ * White balance gains are applied as the pixel is written, in fixed
+ * point with IAC_DEMOSAIC_GAIN_SHIFT fractional bits, saturating.
+ * The frame is mirrored at its edges, which keeps the colour of sites.
+ */
+#define AVG(a, b)                       (((unsigned int) (a) + (b) + 1) >> 1)
+
+/* Row of the raw frame with the rows above and below it */
+typedef struct iac_demosaic_row_t {
+    const unsigned char *up;
+    const unsigned char *row;
+    const unsigned char *down;
+    unsigned int channel;
+    size_t parity;
+    int edge;
+    uint8_t gains[IAC_IMAGE_CHANNELS];
+} iac_demosaic_row_t;
+
+static unsigned char iac_demosaic_gain(const unsigned int, const uint8_t);
+static void iac_demosaic_pixel(unsigned char *,
+                               const iac_demosaic_row_t *,
+                               const size_t,
+                               const size_t,
+                               const size_t);
+#ifdef __ARM_NEON
+static size_t iac_demosaic_neon(unsigned char *,
+                                const iac_demosaic_row_t *,
+                                size_t,
+                                const size_t);
+#endif
+static void iac_demosaic_row(unsigned char *,
+                             const iac_demosaic_row_t *,
+                             const size_t);
+
+static unsigned char iac_demosaic_gain(const unsigned int value,
+                                       const uint8_t gain)
+{
+    unsigned int scaled;
+
+    scaled = (value * gain + (1u << (IAC_DEMOSAIC_GAIN_SHIFT - 1)))
+        >> IAC_DEMOSAIC_GAIN_SHIFT;
+
+    return (unsigned char) (scaled > 255 ? 255 : scaled);
+}
+
+
+/* Interpolate pixel `x' of a row from its neighbours `l' and `r' */
+static void iac_demosaic_pixel(unsigned char *dst,
+                               const iac_demosaic_row_t *row,
+                               const size_t x,
+                               const size_t l,
+                               const size_t r)
+{
+    unsigned int px[IAC_IMAGE_CHANNELS];
+    unsigned int h, v, dh, dv, k = row->channel;
+
+    h = AVG(row->row[l], row->row[r]);
+    v = AVG(row->up[x], row->down[x]);
+    if ((x & 1) == row->parity) {
+        /* Red or blue site */
+        px[k] = row->row[x];
+        px[1] = AVG(h, v);
+        if (row->edge) {
+            dh = (unsigned int) abs(row->row[l] - row->row[r]);
+            dv = (unsigned int) abs(row->up[x] - row->down[x]);
+            if (dh < dv)
+                px[1] = h;
+            else if (dv < dh)
+                px[1] = v;
+        }
+        px[2 - k] = AVG(AVG(row->up[l], row->up[r]),
+                        AVG(row->down[l], row->down[r]));
+    }
+    else {
+        /* Green site */
+        px[k] = h;
+        px[1] = row->row[x];
+        px[2 - k] = v;
+    }
+
+    dst += x * IAC_IMAGE_CHANNELS;
+    dst[0] = iac_demosaic_gain(px[0], row->gains[0]);
+    dst[1] = iac_demosaic_gain(px[1], row->gains[1]);
+    dst[2] = iac_demosaic_gain(px[2], row->gains[2]);
+
+}
+
+
+#ifdef __ARM_NEON
+/*
+ * Interpolate 32 pixels at a time from an even `x', with even and odd
+ * sites deinterleaved in lanes 0 and 1, as long as the pixels right of
+ * them are in the row.  Returns the first pixel left.
+ */
+static size_t iac_demosaic_neon(unsigned char *dst,
+                                const iac_demosaic_row_t *row,
+                                size_t x,
+                                const size_t width)
+{
+    uint8x16x2_t ul, u, ur, cl, c, cr, dl, d, dr;
+    uint8x16_t left[2], right[2], h, v, cross, dh, dv;
+    uint8x16x2_t px[IAC_IMAGE_CHANNELS], zip[IAC_IMAGE_CHANNELS];
+    uint8x16x3_t out;
+    uint8x8_t gains[IAC_IMAGE_CHANNELS];
+    unsigned int k = row->channel, i, s = (unsigned int) row->parity;
+    unsigned int t = 1 - s;
+
+    for (i = 0; i < IAC_IMAGE_CHANNELS; i++)
+        gains[i] = vdup_n_u8(row->gains[i]);
+
+    for (; x + 33 <= width; x += 32) {
+        ul = vld2q_u8(row->up + x - 1);
+        u = vld2q_u8(row->up + x);
+        ur = vld2q_u8(row->up + x + 1);
+        cl = vld2q_u8(row->row + x - 1);
+        c = vld2q_u8(row->row + x);
+        cr = vld2q_u8(row->row + x + 1);
+        dl = vld2q_u8(row->down + x - 1);
+        d = vld2q_u8(row->down + x);
+        dr = vld2q_u8(row->down + x + 1);
+
+        /* Red or blue sites in lane s */
+        left[0] = cl.val[0];
+        right[0] = c.val[1];
+        left[1] = c.val[0];
+        right[1] = cr.val[1];
+        h = vrhaddq_u8(left[s], right[s]);
+        v = vrhaddq_u8(u.val[s], d.val[s]);
+        cross = vrhaddq_u8(h, v);
+        if (row->edge) {
+            dh = vabdq_u8(left[s], right[s]);
+            dv = vabdq_u8(u.val[s], d.val[s]);
+            cross = vbslq_u8(vcltq_u8(dh, dv), h, cross);
+            cross = vbslq_u8(vcltq_u8(dv, dh), v, cross);
+        }
+        px[k].val[s] = c.val[s];
+        px[1].val[s] = cross;
+        if (s)
+            px[2 - k].val[s] = vrhaddq_u8(vrhaddq_u8(u.val[0], ur.val[1]),
+                                          vrhaddq_u8(d.val[0], dr.val[1]));
+        else
+            px[2 - k].val[s] = vrhaddq_u8(vrhaddq_u8(ul.val[0], u.val[1]),
+                                          vrhaddq_u8(dl.val[0], d.val[1]));
+
+        /* Green sites in lane t */
+        px[k].val[t] = vrhaddq_u8(left[t], right[t]);
+        px[1].val[t] = c.val[t];
+        px[2 - k].val[t] = vrhaddq_u8(u.val[t], d.val[t]);
+
+        for (i = 0; i < IAC_IMAGE_CHANNELS; i++) {
+            px[i].val[0] = vcombine_u8(
+                vqrshrn_n_u16(vmull_u8(vget_low_u8(px[i].val[0]), gains[i]),
+                              IAC_DEMOSAIC_GAIN_SHIFT),
+                vqrshrn_n_u16(vmull_u8(vget_high_u8(px[i].val[0]), gains[i]),
+                              IAC_DEMOSAIC_GAIN_SHIFT));
+            px[i].val[1] = vcombine_u8(
+                vqrshrn_n_u16(vmull_u8(vget_low_u8(px[i].val[1]), gains[i]),
+                              IAC_DEMOSAIC_GAIN_SHIFT),
+                vqrshrn_n_u16(vmull_u8(vget_high_u8(px[i].val[1]), gains[i]),
+                              IAC_DEMOSAIC_GAIN_SHIFT));
+            zip[i] = vzipq_u8(px[i].val[0], px[i].val[1]);
+        }
+        for (i = 0; i < 2; i++) {
+            out.val[0] = zip[0].val[i];
+            out.val[1] = zip[1].val[i];
+            out.val[2] = zip[2].val[i];
+            vst3q_u8(dst + (x + 16 * i) * IAC_IMAGE_CHANNELS, out);
+        }
+    }
+
+    return x;
+}
+#endif
+
+
+static void iac_demosaic_row(unsigned char *dst,
+                             const iac_demosaic_row_t *row,
+                             const size_t width)
+{
+    size_t x = 1;
+
+    iac_demosaic_pixel(dst, row, 0, 1, 1);
+#ifdef __ARM_NEON
+    if (width > 2) {
+        iac_demosaic_pixel(dst, row, 1, 0, 2);
+        x = iac_demosaic_neon(dst, row, 2, width);
+    }
+#endif
+    for (; x + 1 < width; x++)
+        iac_demosaic_pixel(dst, row, x, x - 1, x + 1);
+    iac_demosaic_pixel(dst, row, width - 1, width - 2, width - 2);
+
+}
+
+
+/*
+ * Interpolate raw frame `src' of `width' by `height' pixels into BGR
+ * frame `dst', applying white balance gains, which saturate at
+ * 255 >> IAC_DEMOSAIC_GAIN_SHIFT.
+ */
+int iac_demosaic(unsigned char *dst,
+                 const unsigned char *src,
+                 const size_t width,
+                 const size_t height,
+                 const iac_demosaic_params_t *params)
+{
+    iac_demosaic_row_t row;
+    unsigned int rx, ry, i;
+    double gain;
+    size_t y;
+
+    if (params->pattern < IAC_BAYER_RGGB || params->pattern > IAC_BAYER_BGGR
+        || width < 2 || height < 2) {
+        fprintf(stderr, "Unable to demosaic %zux%zu frame!\n", width, height);
+        return IAC_FAILURE;
+    }
+
+    /* Red site of each 2x2 cell */
+    rx = (unsigned int) (params->pattern - IAC_BAYER_RGGB) & 1;
+    ry = (unsigned int) (params->pattern - IAC_BAYER_RGGB) >> 1;
+
+    memset(&row, 0, sizeof(row));
+    row.edge = params->method == IAC_DEMOSAIC_EDGE;
+    for (i = 0; i < IAC_IMAGE_CHANNELS; i++) {
+        gain = params->gains[i] * (1 << IAC_DEMOSAIC_GAIN_SHIFT) + 0.5;
+        row.gains[i] = (uint8_t) (gain < 0 ? 0 : gain > 255 ? 255 : gain);
+    }
+
+    for (y = 0; y < height; y++) {
+        row.up = src + (y ? y - 1 : 1) * width;
+        row.row = src + y * width;
+        row.down = src + (y + 1 < height ? y + 1 : height - 2) * width;
+        if ((y & 1) == ry) {
+            row.channel = 2;
+            row.parity = rx;
+        }
+        else {
+            row.channel = 0;
+            row.parity = 1 - rx;
+        }
+        iac_demosaic_row(dst + y * width * IAC_IMAGE_CHANNELS, &row, width);
+    }
+
+    return IAC_SUCCESS;
+}
+
+
+/* Sample BGR frame `src' through a colour filter array, as a sensor does */
+void iac_demosaic_sample(unsigned char *dst,
+                         const unsigned char *src,
+                         const size_t width,
+                         const size_t height,
+                         const int pattern)
+{
+    size_t x, y, rx, ry;
+    unsigned int channel;
+
+    rx = (size_t) (pattern - IAC_BAYER_RGGB) & 1;
+    ry = (size_t) (pattern - IAC_BAYER_RGGB) >> 1;
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            if ((x & 1) == rx && (y & 1) == ry)
+                channel = 2;
+            else if ((x & 1) != rx && (y & 1) != ry)
+                channel = 0;
+            else
+                channel = 1;
+            *dst++ = src[(y * width + x) * IAC_IMAGE_CHANNELS + channel];
+        }
+    }
+
+}
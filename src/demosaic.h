@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2016 Libre Space Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DEMOSAIC_H
+#define __DEMOSAIC_H
+
+/*
+ * Colour filter array of a raw frame and white balance gains of the
+ * channels of the BGR frame interpolated from it.
+ */
+typedef struct iac_demosaic_params_t {
+    int pattern;
+    int method;
+    double gains[IAC_IMAGE_CHANNELS];
+} iac_demosaic_params_t;
+
+int iac_demosaic(unsigned char *,
+                 const unsigned char *,
+                 const size_t,
+                 const size_t,
+                 const iac_demosaic_params_t *);
+void iac_demosaic_sample(unsigned char *,
+                         const unsigned char *,
+                         const size_t,
+                         const size_t,
+                         const int);
+
+#endif
@@ -25,13 +25,27 @@
 #include <arpa/inet.h>
 #include <linux/spi/spidev.h>
 #include <linux/limits.h>
-#include <m3api/xiApi.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <wand/magick_wand.h>
 #include "iac.h"
 #include "camera.h"
+#include "demosaic.h"
 #include "image.h"
 #include "spi.h"
 #include "obc.h"
+#include "pipeline.h"
+#include "rate.h"
+#include "journal.h"
+#include "spool.h"
+#include "writer.h"
+#include "trace.h"
+#include "utils.h"
+#ifdef IAC_HAVE_JPEG
+#include "jpeg.h"
+#endif
 
 #define IAC_VERSION                     "0.2.0"
 
@@ -46,16 +60,206 @@ typedef struct config_t {
     int auto_wb;
     char *spi_device;
     int verbose;
+    unsigned int jobs;
+    int encoder;
+    unsigned int batch;
+    unsigned int block_delay;
+    iac_obc_ack_params_t ack;
+    unsigned int window;
+    int checksum;
+    unsigned int frames;
+    unsigned int buffers;
+    unsigned int interval;
+    char *camera;
+    char *trace;
+    int order;
+    unsigned int uniform;
+    int uniform_action;
+    size_t tile_budget;
+    size_t frame_budget;
+    char *journal;
+    int resume;
+    int spool;
+    char *send;
+    char *tiles;
+    char *retain;
+    unsigned int request_wait;
+    char *daemon;
+    unsigned int rows;
+    unsigned int cols;
+    size_t tile_width;
+    size_t tile_height;
+    int auto_grid;
+    int bands;
+    int bayer;
+    int demosaic;
+    double wb[IAC_IMAGE_CHANNELS];
 } config_t;
 
+typedef struct tiles_t {
+    iac_image_view_t *views;
+    const config_t *config;
+    const unsigned int *order;
+    iac_image_view_t thumb;
+    const size_t *budget;
+    const double *weight;
+    const iac_image_frame_t *frame;
+    const iac_image_grid_t *grid;
+    unsigned int *bands;
+} tiles_t;
+
+/* Tiles of a frame in transfer order, of which some are encoded */
+typedef struct plan_t {
+    iac_image_grid_t grid;
+    unsigned int tiles[IAC_IMAGE_TILES_MAX + 2];
+    unsigned int count;
+    unsigned int encode[IAC_IMAGE_TILES_MAX + 1];
+    unsigned int encoded;
+    size_t budget[IAC_IMAGE_TILES_MAX + 1];
+    double weight[IAC_IMAGE_TILES_MAX + 1];
+    unsigned int first;
+    size_t acked;
+    unsigned char *stored;
+    size_t stored_size;
+    uint8_t manifest[IAC_TILE_MANIFEST_HEADER
+                     + IAC_IMAGE_TILES_MAX * IAC_TILE_MANIFEST_ENTRY];
+    size_t manifest_size;
+    iac_image_frame_t thumb;
+} plan_t;
+
+/* Spool of the frame being sent, retained to serve requests for blocks */
+typedef struct retain_t {
+    iac_spool_t spool;
+    unsigned int frame;
+    int numbered;
+    int open;
+} retain_t;
+
 int verbose = 0;
+static iac_rate_t rate;
+static iac_journal_t journal;
+static retain_t retain;
+
+/* SPI device kept open across frames by the daemon */
+static int spi = -1;
 static int usage(const char *, const char *);
 static config_t parse_args(int, char **);
-static HANDLE get_cam_image(XI_IMG *, const config_t *);
-static MagickWand ***tile_cam_image(const XI_IMG *, const config_t *);
-static MagickWand ***tile_file_image(const config_t *);
-static int transfer_tiles(MagickWand ***, const config_t *);
-static int write_tiles(MagickWand ***, const config_t *);
+static int get_cam_image(iac_cam_t *, iac_cam_frame_t *, const config_t *);
+static int open_spi(const config_t *);
+static int close_spi(const int);
+static int read_command(const int, char *, const size_t);
+static int capture_frame(iac_cam_t *,
+                         const unsigned int,
+                         char *,
+                         const size_t,
+                         const config_t *);
+static int serve_daemon(const config_t *);
+static int stream_cam_images(const config_t *);
+static int resume_tiles(const config_t *, int *);
+static unsigned int parse_tiles(const char *,
+                                unsigned int *,
+                                const unsigned int);
+static int send_spool(const config_t *);
+static int packets_checksum(const unsigned int, const config_t *);
+static iac_image_view_t *grid_views(const iac_image_frame_t *,
+                                    iac_image_grid_t *,
+                                    const config_t *);
+static int demosaic_cam_image(iac_image_frame_t *,
+                              const iac_cam_frame_t *,
+                              const config_t *);
+static iac_image_view_t *tile_cam_image(iac_image_frame_t *,
+                                        const iac_cam_frame_t *,
+                                        iac_image_grid_t *,
+                                        const config_t *);
+static iac_image_view_t *tile_file_image(iac_image_frame_t *,
+                                         iac_image_grid_t *,
+                                         const config_t *);
+static unsigned char *encode_view(const tiles_t *,
+                                  const iac_image_view_t *,
+                                  const int,
+                                  size_t *);
+static unsigned char *encode_budget(tiles_t *,
+                                    const unsigned int,
+                                    const iac_image_view_t *,
+                                    const double,
+                                    const size_t,
+                                    size_t *);
+static int band_tiles(tiles_t *,
+                      const iac_image_frame_t *,
+                      const iac_image_grid_t *);
+static unsigned char *encode_tile(void *, const unsigned int, size_t *);
+static void release_tile(void *, unsigned char *);
+static int transfer_packets(const int,
+                            const iac_obc_packets_t *,
+                            size_t *,
+                            const size_t,
+                            iac_obc_ack_t *,
+                            const config_t *);
+static int transfer_window(const int,
+                           const iac_obc_packets_t *,
+                           const uint16_t,
+                           size_t *,
+                           const size_t,
+                           iac_obc_ack_t *,
+                           const config_t *);
+static int plan_tiles(plan_t *,
+                      tiles_t *,
+                      const iac_image_frame_t *,
+                      const iac_image_grid_t *,
+                      const config_t *);
+static int plan_encoded(const plan_t *, const unsigned int);
+static int plan_resume(plan_t *, const iac_image_frame_t *, const config_t *);
+static int packetize_tile(const plan_t *,
+                          iac_pipeline_t *,
+                          iac_obc_packets_t *,
+                          const unsigned int);
+static int reserve_blocks(size_t **, size_t *, const size_t);
+static int transfer_blocks(const int,
+                           const iac_obc_packets_t *,
+                           const unsigned int,
+                           size_t *,
+                           const size_t,
+                           iac_obc_ack_t *,
+                           const config_t *);
+static int transfer_tile(const int,
+                         const iac_obc_packets_t *,
+                         const unsigned int,
+                         const size_t,
+                         size_t **,
+                         size_t *,
+                         iac_obc_ack_t *,
+                         const config_t *);
+static int retain_begin(const config_t *);
+static int retain_end(void);
+static int serve_request(const int,
+                         const iac_obc_request_t *,
+                         iac_obc_packets_t *,
+                         size_t **,
+                         size_t *,
+                         const config_t *);
+static int serve_requests(const int,
+                          iac_obc_packets_t *,
+                          size_t **,
+                          size_t *,
+                          const config_t *);
+static int transfer_tiles(const iac_image_frame_t *,
+                          iac_image_view_t *,
+                          const iac_image_grid_t *,
+                          const config_t *);
+static int write_tile_file(iac_writer_t *,
+                           const config_t *,
+                           const unsigned int,
+                           const unsigned int,
+                           unsigned char *,
+                           const size_t);
+static int write_tiles(const iac_image_frame_t *,
+                       iac_image_view_t *,
+                       const iac_image_grid_t *,
+                       const config_t *);
+static int process_tiles(const iac_image_frame_t *,
+                         iac_image_view_t *,
+                         const iac_image_grid_t *,
+                         const config_t *);
 
 static int usage(const char *name, const char *version)
 {
@@ -68,14 +272,104 @@ static int usage(const char *name, const char *version)
             "      --height=SIZE             Height of raw image file\n"
             "  -o, --output=DIRECTORY        Write tiles to directory\n"
             "      --prefix=NAME             Filename prefix for output tiles\n"
+            "      --spool                   Write tiles of a frame to a single spool\n"
+            "                                file instead of a file per tile\n"
+            "      --send=FILE               Send tiles from spool file\n"
+            "      --tiles=LIST              Tiles to send from spool, as a list of\n"
+            "                                tiles and ranges (default: all)\n"
+            "      --camera=NAME[:OPTIONS]   Camera backend, ximea or sim with options\n"
+            "                                width, height, fps, latency, file, seed\n"
             "  -e, --exposure=EXPOSURE       Set camera exposure time in microseconds\n"
             "  -g, --gain=GAIN               Set camera gain in dB\n"
             "  -w                            Enable camera automatic white balance\n"
+            "      --frames=N                Stream N frames from camera (default: 1)\n"
+            "      --buffers=N               Camera frame buffers when streaming\n"
+            "                                (default: %u)\n"
+            "      --interval=MSEC           Time between streamed frames\n"
+            "                                in milliseconds (default: 0)\n"
             "  -D, --spi-dev=DEVICE          SPI device to use (default: %s)\n"
+            "                                or sim[:OPTIONS] for a simulated OBC\n"
+            "  -j, --jobs=N                  Number of tile encoder threads\n"
+            "                                (default: number of CPUs)\n"
+            "      --encoder=ENCODER         Tile encoder, magick or jpeg\n"
+            "                                (default: magick)\n"
+            "      --batch=N                 Blocks per SPI message, up to %u\n"
+            "                                (default: 1)\n"
+            "      --block-delay=USEC        Delay between blocks of an SPI message\n"
+            "                                in microseconds (default: 0)\n"
+            "      --ack-min=USEC            First OBC acknowledgement backoff\n"
+            "                                in microseconds (default: %u)\n"
+            "      --ack-max=USEC            Maximum OBC acknowledgement backoff\n"
+            "                                in microseconds (default: %u)\n"
+            "      --block-retries=N         Give up after N retries of a block\n"
+            "                                (default: unlimited)\n"
+            "      --frame-retries=N         Give up after N retries in a frame\n"
+            "                                (default: unlimited)\n"
+            "      --block-timeout=MSEC      Give up on a block after MSEC\n"
+            "                                milliseconds (default: %u)\n"
+            "      --frame-timeout=MSEC      Give up on a frame after MSEC\n"
+            "                                milliseconds (default: unlimited)\n"
+            "      --window=N                Stream up to N blocks before polling the\n"
+            "                                OBC for missing ones, up to %u\n"
+            "                                (default: 0, wait for every block)\n"
+            "      --checksum=CHECKSUM       Block checksum, lrc, crc16 or crc32c\n"
+            "                                (default: crc16)\n",
+            version, name, IAC_CAM_BUFFERS, IAC_SPI_DEFAULT_DEVICE,
+            IAC_SPI_BATCH_MAX, IAC_OBC_ACK_MIN_USLEEP, IAC_OBC_ACK_MAX_USLEEP,
+            IAC_OBC_ACK_BLOCK_TIMEOUT, IAC_OBC_WINDOW_MAX);
+    fprintf(stderr,
+            "      --grid=ROWSxCOLS          Cut frames into a grid of tiles, up to\n"
+            "                                %u tiles (default: %ux%u)\n"
+            "      --tile-size=WxH|auto      Cut frames into tiles of WxH pixels, or\n"
+            "                                of a size chosen per frame to fill\n"
+            "                                whole blocks once encoded\n"
+            "      --bands                   Tile raw input a band of tiles at a time,\n"
+            "                                keeping about two bands of the frame in\n"
+            "                                memory, in raster order only\n"
+            "      --bayer=METHOD            Capture raw Bayer frames and interpolate\n"
+            "                                them, bilinear or edge for bilinear\n"
+            "                                along the smoother direction\n"
+            "      --wb=RED,GREEN,BLUE       White balance gains of raw Bayer frames,\n"
+            "                                up to %.2f (default: from camera)\n",
+            IAC_IMAGE_TILES_MAX, IAC_IMAGE_DIVS, IAC_IMAGE_DIVS,
+            255.0 / (1 << IAC_DEMOSAIC_GAIN_SHIFT));
+    fprintf(stderr,
+            "      --order=ORDER             Tile transfer order, raster or priority\n"
+            "                                for a thumbnail first and then tiles by\n"
+            "                                detail (default: raster)\n"
+            "      --uniform=VARIANCE        Send tiles with variance below VARIANCE\n"
+            "                                in every channel as uniform, and lead\n"
+            "                                with a manifest of tiles (default: 0,\n"
+            "                                off)\n"
+            "      --uniform-action=ACTION   Send uniform tiles as a descriptor with\n"
+            "                                their fill colour or skip them, descriptor\n"
+            "                                or skip (default: descriptor)\n"
+            "      --budget=BYTES            Choose quality of each tile to fit in\n"
+            "                                BYTES (default: 0, fixed quality)\n"
+            "      --frame-budget=BYTES      Choose quality of each tile to fit the\n"
+            "                                encoded tiles of a frame in BYTES,\n"
+            "                                shared by their detail (default: 0)\n"
+            "      --journal=DIRECTORY       Journal transfers in directory, saving\n"
+            "                                each frame and its encoded tiles\n"
+            "      --resume                  Resume transfer of a frame interrupted\n"
+            "                                at the tile and block where it stopped\n"
+            "      --retain=DIRECTORY        Keep spools of the last %u frames sent in\n"
+            "                                directory and serve OBC requests for\n"
+            "                                their blocks after each frame\n"
+            "      --request-wait=MSEC       Wait for OBC requests up to MSEC\n"
+            "                                milliseconds (default: %u)\n"
+            "      --daemon=SOCKET           Keep camera streaming and SPI device\n"
+            "                                open and capture on commands read\n"
+            "                                from Unix socket, capture, ping or\n"
+            "                                quit\n"
+            "      --trace=FILE              Dump trace of hot paths at exit, as CSV\n"
+            "                                if FILE ends in .csv or as Chrome\n"
+            "                                trace JSON otherwise\n"
             "  -v                            Verbose output\n"
             "  --help                        Display help and exit\n"
             "  --version                     Output version and exit\n"
-            "\n", version, name, IAC_SPI_DEFAULT_DEVICE);
+            "\n",
+            IAC_RETAIN_FRAMES, IAC_OBC_REQUEST_WAIT);
 
     return IAC_SUCCESS;
 }
@@ -97,16 +391,61 @@ static config_t parse_args(int argc, char **argv)
         { "spi-device", required_argument, 0, 'D' },
         { "help", no_argument, 0, 0 },
         { "version", no_argument, 0, 0 },
+        { "jobs", required_argument, 0, 'j' },
+        { "encoder", required_argument, 0, 0 },
+        { "batch", required_argument, 0, 0 },
+        { "block-delay", required_argument, 0, 0 },
+        { "ack-min", required_argument, 0, 0 },
+        { "ack-max", required_argument, 0, 0 },
+        { "block-retries", required_argument, 0, 0 },
+        { "frame-retries", required_argument, 0, 0 },
+        { "block-timeout", required_argument, 0, 0 },
+        { "frame-timeout", required_argument, 0, 0 },
+        { "window", required_argument, 0, 0 },
+        { "checksum", required_argument, 0, 0 },
+        { "frames", required_argument, 0, 0 },
+        { "buffers", required_argument, 0, 0 },
+        { "interval", required_argument, 0, 0 },
+        { "camera", required_argument, 0, 0 },
+        { "trace", required_argument, 0, 0 },
+        { "order", required_argument, 0, 0 },
+        { "uniform", required_argument, 0, 0 },
+        { "uniform-action", required_argument, 0, 0 },
+        { "budget", required_argument, 0, 0 },
+        { "frame-budget", required_argument, 0, 0 },
+        { "journal", required_argument, 0, 0 },
+        { "resume", no_argument, 0, 0 },
+        { "spool", no_argument, 0, 0 },
+        { "send", required_argument, 0, 0 },
+        { "tiles", required_argument, 0, 0 },
+        { "retain", required_argument, 0, 0 },
+        { "request-wait", required_argument, 0, 0 },
+        { "daemon", required_argument, 0, 0 },
+        { "grid", required_argument, 0, 0 },
+        { "tile-size", required_argument, 0, 0 },
+        { "bands", no_argument, 0, 0 },
+        { "bayer", required_argument, 0, 0 },
+        { "wb", required_argument, 0, 0 },
         { 0, 0, 0, 0 }
     };
     int long_index = 0;
 
     memset(&config, 0, sizeof(config));
+    config.batch = 1;
+    config.frames = 1;
+    config.buffers = IAC_CAM_BUFFERS;
+    config.ack.min_usleep = IAC_OBC_ACK_MIN_USLEEP;
+    config.ack.max_usleep = IAC_OBC_ACK_MAX_USLEEP;
+    config.ack.block_timeout = IAC_OBC_ACK_BLOCK_TIMEOUT;
+    config.request_wait = IAC_OBC_REQUEST_WAIT;
+    config.checksum = IAC_OBC_CHECKSUM_CRC16;
+    config.rows = IAC_IMAGE_DIVS;
+    config.cols = IAC_IMAGE_DIVS;
 
     /* Parse command line options */
     while ((opt = getopt_long(argc,
                               argv,
-                              "i:o:e:g:D:wv",
+                              "i:o:e:g:D:j:wv",
                               long_options,
                               &long_index)) != -1) {
         switch (opt) {
@@ -127,6 +466,163 @@ static config_t parse_args(int argc, char **argv)
                         IAC_VERSION);
                 exit(EXIT_SUCCESS);
                 break;
+            case 12:
+                if (!strcmp(optarg, "magick")) {
+                    config.encoder = IAC_ENCODER_MAGICK;
+                }
+                else if (!strcmp(optarg, "jpeg")) {
+#ifdef IAC_HAVE_JPEG
+                    config.encoder = IAC_ENCODER_JPEG;
+#else
+                    fprintf(stderr, "JPEG encoder is not supported!\n");
+                    exit(EXIT_FAILURE);
+#endif
+                }
+                else {
+                    exit(usage(argv[0], IAC_VERSION));
+                }
+                break;
+            case 13:
+                config.batch = (unsigned int) atoi(optarg);
+                break;
+            case 14:
+                config.block_delay = (unsigned int) atoi(optarg);
+                break;
+            case 15:
+                config.ack.min_usleep = (unsigned int) atoi(optarg);
+                break;
+            case 16:
+                config.ack.max_usleep = (unsigned int) atoi(optarg);
+                break;
+            case 17:
+                config.ack.block_retries = (unsigned int) atoi(optarg);
+                break;
+            case 18:
+                config.ack.frame_retries = (unsigned int) atoi(optarg);
+                break;
+            case 19:
+                config.ack.block_timeout = (unsigned int) atoi(optarg);
+                break;
+            case 20:
+                config.ack.frame_timeout = (unsigned int) atoi(optarg);
+                break;
+            case 21:
+                config.window = (unsigned int) atoi(optarg);
+                break;
+            case 22:
+                if (!strcmp(optarg, "lrc"))
+                    config.checksum = IAC_OBC_CHECKSUM_LRC;
+                else if (!strcmp(optarg, "crc16"))
+                    config.checksum = IAC_OBC_CHECKSUM_CRC16;
+                else if (!strcmp(optarg, "crc32c"))
+                    config.checksum = IAC_OBC_CHECKSUM_CRC32C;
+                else
+                    exit(usage(argv[0], IAC_VERSION));
+                break;
+            case 23:
+                config.frames = (unsigned int) atoi(optarg);
+                break;
+            case 24:
+                config.buffers = (unsigned int) atoi(optarg);
+                break;
+            case 25:
+                config.interval = (unsigned int) atoi(optarg);
+                break;
+            case 26:
+                config.camera = optarg;
+                break;
+            case 27:
+#ifdef IAC_HAVE_TRACE
+                config.trace = optarg;
+#else
+                fprintf(stderr, "Tracing is not supported!\n");
+                exit(EXIT_FAILURE);
+#endif
+                break;
+            case 28:
+                if (!strcmp(optarg, "raster"))
+                    config.order = IAC_ORDER_RASTER;
+                else if (!strcmp(optarg, "priority"))
+                    config.order = IAC_ORDER_PRIORITY;
+                else
+                    exit(usage(argv[0], IAC_VERSION));
+                break;
+            case 29:
+                config.uniform = (unsigned int) atoi(optarg);
+                break;
+            case 30:
+                if (!strcmp(optarg, "descriptor"))
+                    config.uniform_action = IAC_UNIFORM_DESCRIPTOR;
+                else if (!strcmp(optarg, "skip"))
+                    config.uniform_action = IAC_UNIFORM_SKIP;
+                else
+                    exit(usage(argv[0], IAC_VERSION));
+                break;
+            case 31:
+                config.tile_budget = (size_t) atoi(optarg);
+                break;
+            case 32:
+                config.frame_budget = (size_t) atoi(optarg);
+                break;
+            case 33:
+                config.journal = optarg;
+                break;
+            case 34:
+                config.resume = 1;
+                break;
+            case 35:
+                config.spool = 1;
+                break;
+            case 36:
+                config.send = optarg;
+                break;
+            case 37:
+                config.tiles = optarg;
+                break;
+            case 38:
+                config.retain = optarg;
+                break;
+            case 39:
+                config.request_wait = (unsigned int) atoi(optarg);
+                break;
+            case 40:
+                config.daemon = optarg;
+                break;
+            case 41:
+                if (sscanf(optarg, "%ux%u", &config.rows, &config.cols) != 2)
+                    exit(usage(argv[0], IAC_VERSION));
+                break;
+            case 42:
+                if (!strcmp(optarg, "auto"))
+                    config.auto_grid = 1;
+                else if (sscanf(optarg,
+                                "%zux%zu",
+                                &config.tile_width,
+                                &config.tile_height) != 2
+                         || !config.tile_width || !config.tile_height)
+                    exit(usage(argv[0], IAC_VERSION));
+                break;
+            case 43:
+                config.bands = 1;
+                break;
+            case 44:
+                config.bayer = 1;
+                if (!strcmp(optarg, "bilinear"))
+                    config.demosaic = IAC_DEMOSAIC_BILINEAR;
+                else if (!strcmp(optarg, "edge"))
+                    config.demosaic = IAC_DEMOSAIC_EDGE;
+                else
+                    exit(usage(argv[0], IAC_VERSION));
+                break;
+            case 45:
+                /* Gains are kept in the channel order of BGR frames */
+                if (sscanf(optarg,
+                           "%lf,%lf,%lf",
+                           &config.wb[2],
+                           &config.wb[1],
+                           &config.wb[0]) != 3)
+                    exit(usage(argv[0], IAC_VERSION));
+                break;
             default:
                 exit(usage(argv[0], IAC_VERSION));
             }
@@ -152,6 +648,9 @@ static config_t parse_args(int argc, char **argv)
         case 'v':
             config.verbose = 1;
             break;
+        case 'j':
+            config.jobs = (unsigned int) atoi(optarg);
+            break;
         default:
             exit(usage(argv[0], IAC_VERSION));
         }
@@ -168,246 +667,2066 @@ static config_t parse_args(int argc, char **argv)
         exit(EXIT_FAILURE);
     }
 
+    if (!config.batch || config.batch > IAC_SPI_BATCH_MAX) {
+        fprintf(stderr, "Batch must be between 1 and %u!\n", IAC_SPI_BATCH_MAX);
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.block_delay > UINT16_MAX) {
+        fprintf(stderr, "Block delay must not exceed %u!\n", UINT16_MAX);
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.input && config.frames > 1) {
+        fprintf(stderr, "Only camera frames can be streamed!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!config.frames || !config.buffers) {
+        fprintf(stderr, "Frames and buffers must be positive!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!config.ack.min_usleep
+        || config.ack.min_usleep > config.ack.max_usleep) {
+        fprintf(stderr,
+                "OBC acknowledgement backoff must be positive, with minimum "
+                "up to maximum!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.window > IAC_OBC_WINDOW_MAX) {
+        fprintf(stderr, "Window must not exceed %u!\n", IAC_OBC_WINDOW_MAX);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Dimensions bounded first, so that their product cannot wrap */
+    if (!config.rows || !config.cols
+        || config.rows > IAC_IMAGE_TILES_MAX
+        || config.cols > IAC_IMAGE_TILES_MAX
+        || config.rows * config.cols > IAC_IMAGE_TILES_MAX) {
+        fprintf(stderr,
+                "Grid must have between 1 and %u tiles!\n",
+                IAC_IMAGE_TILES_MAX);
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.bands && !config.input) {
+        fprintf(stderr, "Only raw input frames can be tiled in bands!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.bands
+        && (config.order != IAC_ORDER_RASTER
+            || config.uniform
+            || config.frame_budget
+            || config.auto_grid
+            || config.journal)) {
+        fprintf(stderr,
+                "Bands need tiles in raster order without uniform tiles, "
+                "frame budget, automatic tile size or journal!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.bayer && config.input) {
+        fprintf(stderr, "Only camera frames can be captured raw!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.wb[1]
+        && (!config.bayer
+            || config.wb[0] <= 0
+            || config.wb[1] <= 0
+            || config.wb[2] <= 0
+            || config.wb[0] > 255.0 / (1 << IAC_DEMOSAIC_GAIN_SHIFT)
+            || config.wb[1] > 255.0 / (1 << IAC_DEMOSAIC_GAIN_SHIFT)
+            || config.wb[2] > 255.0 / (1 << IAC_DEMOSAIC_GAIN_SHIFT))) {
+        fprintf(stderr,
+                "White balance gains must be positive up to %.2f, for raw "
+                "Bayer frames!\n",
+                255.0 / (1 << IAC_DEMOSAIC_GAIN_SHIFT));
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.spool && !config.output) {
+        fprintf(stderr, "Only output tiles can be spooled!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.tiles && !config.send) {
+        fprintf(stderr, "Tiles can only be selected from a spool!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.retain && (config.output || config.send)) {
+        fprintf(stderr, "Only transferred frames can be retained!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.daemon
+        && (config.input || config.send || config.frames > 1)) {
+        fprintf(stderr, "Daemon only captures single camera frames!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.resume && (!config.journal || config.output)) {
+        fprintf(stderr, "Only journaled transfers can be resumed!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Defaults */
+    if (!config.jobs) {
+        config.jobs = (unsigned int) sysconf(_SC_NPROCESSORS_ONLN);
+        if (!config.jobs)
+            config.jobs = 1;
+    }
+
     return config;
 }
 
 
-static HANDLE get_cam_image(XI_IMG *image, const config_t *config)
+static int get_cam_image(iac_cam_t *cam,
+                         iac_cam_frame_t *image,
+                         const config_t *config)
 {
-    HANDLE handle;
     iac_cam_init_params_t init_params = {
         config->exposure,
         config->gain,
         config->auto_wb,
+        0,
+        config->bayer,
     };
 
     /* Open camera */
-    if (iac_cam_open(&handle) == IAC_FAILURE)
-        exit(EXIT_FAILURE);
+    if (iac_cam_open(cam, config->camera) == IAC_FAILURE)
+        return IAC_FAILURE;
 
     /* Initialize camera */
-    if (iac_cam_init(&handle, &init_params) == IAC_FAILURE) {
+    if (iac_cam_init(cam, &init_params) == IAC_FAILURE) {
         fprintf(stderr, "Unable to initialize camera!\n");
-        iac_cam_close(&handle);
-        exit(EXIT_FAILURE);
+        iac_cam_close(cam);
+        return IAC_FAILURE;
     }
 
     /* Acquire image from camera */
-    memset(image, 0, sizeof(XI_IMG));
-    image->size = sizeof(XI_IMG);
-
-    if (iac_cam_acquire(&handle, image) == IAC_FAILURE) {
+    if (iac_cam_acquire(cam, image) == IAC_FAILURE) {
         fprintf(stderr, "Unable to acquire image!\n");
-        iac_cam_close(&handle);
-        exit(EXIT_FAILURE);
+        iac_cam_close(cam);
+        return IAC_FAILURE;
     }
 
-    return handle;
+    return IAC_SUCCESS;
 }
 
 
-static MagickWand ***tile_cam_image(const XI_IMG *image, const config_t *config)
+/* Open SPI device, unless the daemon keeps it open */
+static int open_spi(const config_t *config)
 {
-    MagickWand *wand;
-    MagickWand ***wands;
-    iac_image_read_params_t params = {
-        image->width,
-        image->height,
-        IAC_IMAGE_FORMAT,
-        IAC_IMAGE_DEPTH,
+    const char *device = config->spi_device ?
+        config->spi_device : IAC_SPI_DEFAULT_DEVICE;
+    iac_spi_init_params_t params = {
+        IAC_SPI_MODE,
+        IAC_SPI_BITS,
+        IAC_SPI_MAX_HZ,
     };
 
-    /* Read camera image into wand */
-    iac_image_init();
-    wand = iac_image_read_blob(&params,
-                               (const unsigned char *) image->bp,
-                               (const size_t) image->bp_size);
-    wands = iac_image_tiles(wand, IAC_IMAGE_DIVS);
+    if (spi != -1)
+        return spi;
 
-    return wands;
+    IAC_VERBOSE("Initializing SPI device %s...\n", device);
+    return iac_spi_init(device, &params);
 }
 
 
-static MagickWand ***tile_file_image(const config_t *config)
+static int close_spi(const int fd)
 {
-    MagickWand *wand;
-    MagickWand ***wands;
-    iac_image_read_params_t params = {
-        config->width,
-        config->height,
-        IAC_IMAGE_FORMAT,
-        IAC_IMAGE_DEPTH,
-    };
 
-    /* Read file image into wand */
-    iac_image_init();
-    wand = iac_image_read_file(&params, config->input);
-    wands = iac_image_tiles(wand, IAC_IMAGE_DIVS);
+    if (fd == spi)
+        return IAC_SUCCESS;
+    return iac_spi_close(fd);
+}
+
+
+/* Read a command line from the client, without its line ending */
+static int read_command(const int fd, char *line, const size_t size)
+{
+    size_t n = 0;
+    ssize_t ret;
+    char c;
+
+    for (;;) {
+        ret = recv(fd, &c, 1, 0);
+        if (ret <= 0) {
+            if (ret == -1)
+                perror("Unable to read command");
+            return IAC_FAILURE;
+        }
+        if (c == '\n')
+            break;
+        if (c != '\r' && n < size - 1)
+            line[n++] = c;
+    }
+    line[n] = '\0';
 
-    return wands;
+    return IAC_SUCCESS;
 }
 
 
-static int write_tiles(MagickWand ***wands, const config_t *config)
+/*
+ * Take the most recent frame of the camera stream and transfer or write
+ * its tiles, describing the result and latency from the command in
+ * `reply'.
+ */
+static int capture_frame(iac_cam_t *cam,
+                         const unsigned int n,
+                         char *reply,
+                         const size_t size,
+                         const config_t *config)
 {
-    int i, j;
-    char filename[PATH_MAX];
+    iac_cam_frame_t *image;
+    iac_image_frame_t frame;
+    iac_image_grid_t grid;
+    iac_image_view_t *views;
+    config_t frame_config = *config;
+    char prefix[PATH_MAX];
+    uint64_t start, acquired, done;
+    int ret = IAC_SUCCESS;
 
-    /* Write tiles to files */
-    for (i = 0; i < IAC_IMAGE_DIVS; i++) {
-        for (j = 0; j < IAC_IMAGE_DIVS; j++) {
-            /* Set image format of files */
-            if (MagickSetImageFormat(wands[i][j],
-                                     IAC_IMAGE_BLOB_FORMAT) == MagickFalse) {
-                iac_image_exception(wands[i][j]);
-                return IAC_FAILURE;
+    start = iac_time_usec();
+    IAC_VERBOSE("Acquiring frame %u...\n", n);
+    image = iac_cam_stream_get(cam);
+    if (!image) {
+        snprintf(reply, size, "error frame=%u acquire\n", n);
+        return IAC_FAILURE;
+    }
+    acquired = iac_time_usec();
+
+    /* Each frame writes tiles with its own prefix */
+    if (config->output) {
+        snprintf(prefix, PATH_MAX, "%s-%u", config->prefix, n);
+        frame_config.prefix = prefix;
+    }
+    IAC_TRACE_BEGIN_ARG("frame", n);
+    views = tile_cam_image(&frame, image, &grid, config);
+    if (!views
+        || process_tiles(&frame,
+                         views,
+                         &grid,
+                         &frame_config) == IAC_FAILURE)
+        ret = IAC_FAILURE;
+    free(views);
+    iac_image_frame_free(&frame);
+    iac_cam_stream_put(cam, image);
+    IAC_TRACE_LEAVE("frame");
+    done = iac_time_usec();
+
+    snprintf(reply,
+             size,
+             "%s frame=%u acquire_ms=%.3f total_ms=%.3f\n",
+             ret == IAC_SUCCESS ? "ok" : "error",
+             n,
+             (double) (acquired - start) / 1000,
+             (double) (done - start) / 1000);
+    IAC_VERBOSE("Frame %u acquired in %.3f ms, done in %.3f ms...\n",
+                n,
+                (double) (acquired - start) / 1000,
+                (double) (done - start) / 1000);
+
+    return ret;
+}
+
+
+/*
+ * Serve commands from clients of a Unix socket, one per line, keeping
+ * the camera streaming and the SPI device open between frames.  A
+ * capture command is answered once the frame is transferred, or
+ * written, with the latency of acquisition and of the whole command.
+ */
+static int serve_daemon(const config_t *config)
+{
+    iac_cam_t cam;
+    iac_cam_init_params_t init_params = {
+        config->exposure,
+        config->gain,
+        config->auto_wb,
+        config->buffers,
+        config->bayer,
+    };
+    struct sockaddr_un addr;
+    char line[IAC_DAEMON_COMMAND_MAX];
+    char reply[IAC_DAEMON_COMMAND_MAX];
+    unsigned int n = 0;
+    int server, client, quit = 0, ret = IAC_SUCCESS;
+
+    if (strlen(config->daemon) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Daemon socket path is too long!\n");
+        return IAC_FAILURE;
+    }
+
+    /* Open camera, streaming until the daemon quits, and SPI device */
+    if (iac_cam_open(&cam, config->camera) == IAC_FAILURE)
+        return IAC_FAILURE;
+    if (iac_cam_init(&cam, &init_params) == IAC_FAILURE
+        || iac_cam_stream_start(&cam, config->buffers) == IAC_FAILURE) {
+        fprintf(stderr, "Unable to initialize camera!\n");
+        iac_cam_close(&cam);
+        return IAC_FAILURE;
+    }
+    if (!config->output) {
+        spi = open_spi(config);
+        if (spi == -1)
+            goto fail;
+    }
+
+    server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server == -1) {
+        perror("Unable to create daemon socket");
+        goto fail;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, config->daemon);
+    unlink(config->daemon);
+    if (bind(server, (struct sockaddr *) &addr, sizeof(addr)) == -1
+        || listen(server, 1) == -1) {
+        perror("Unable to listen on daemon socket");
+        close(server);
+        goto fail;
+    }
+
+    IAC_VERBOSE("Waiting for commands on %s...\n", config->daemon);
+    while (!quit) {
+        client = accept(server, NULL, NULL);
+        if (client == -1) {
+            perror("Unable to accept daemon client");
+            ret = IAC_FAILURE;
+            break;
+        }
+        while (!quit
+               && read_command(client, line, sizeof(line)) == IAC_SUCCESS) {
+            if (!strcmp(line, "capture")) {
+                capture_frame(&cam, n++, reply, sizeof(reply), config);
             }
-            snprintf(filename,
-                     PATH_MAX,
-                     "%s/%s-%u-%u.%s",
-                     config->output,
-                     config->prefix,
-                     i,
-                     j,
-                     IAC_IMAGE_BLOB_FORMAT);
-            if (MagickWriteImage(wands[i][j], filename) == MagickFalse) {
-                iac_image_exception(wands[i][j]);
-                return IAC_FAILURE;
+            else if (!strcmp(line, "ping")) {
+                snprintf(reply, sizeof(reply), "ok\n");
+            }
+            else if (!strcmp(line, "quit")) {
+                snprintf(reply, sizeof(reply), "ok\n");
+                quit = 1;
+            }
+            else {
+                snprintf(reply, sizeof(reply), "error unknown command\n");
+            }
+            if (send(client, reply, strlen(reply), MSG_NOSIGNAL) == -1) {
+                perror("Unable to answer daemon client");
+                break;
             }
         }
+        close(client);
     }
+    close(server);
+    unlink(config->daemon);
 
-    return IAC_SUCCESS;
+    if (spi != -1 && iac_spi_close(spi) == IAC_FAILURE)
+        ret = IAC_FAILURE;
+    spi = -1;
+    if (iac_cam_stream_stop(&cam) == IAC_FAILURE)
+        ret = IAC_FAILURE;
+    if (iac_cam_close(&cam) == IAC_FAILURE)
+        ret = IAC_FAILURE;
+
+    return ret;
+
+fail:
+    if (spi != -1)
+        iac_spi_close(spi);
+    spi = -1;
+    iac_cam_stream_stop(&cam);
+    iac_cam_close(&cam);
+
+    return IAC_FAILURE;
 }
 
 
-static int transfer_tiles(MagickWand ***wands, const config_t *config)
+/*
+ * Keep acquisition running and tile each frame in place in the buffers
+ * of the camera, or interpolated from them when raw, returning the
+ * buffer once its tiles are consumed.
+ */
+static int stream_cam_images(const config_t *config)
 {
-    char *device = IAC_SPI_DEFAULT_DEVICE;
-    iac_spi_init_params_t params = {
-        IAC_SPI_MODE,
-        IAC_SPI_BITS,
-        IAC_SPI_MAX_HZ,
+    iac_cam_t cam;
+    iac_cam_init_params_t init_params = {
+        config->exposure,
+        config->gain,
+        config->auto_wb,
+        config->buffers,
+        config->bayer,
     };
-    int fd;
-    int i, j;
-    iac_obc_block_t block;
-    iac_obc_packet_t packet;
-    size_t size, mod;
-    size_t k, blocks;
-    uint16_t blocks_data;
-    uint8_t resp;
-    unsigned char *blob;
+    iac_cam_frame_t *image;
+    iac_image_frame_t frame;
+    iac_image_grid_t grid;
+    iac_image_view_t *views;
+    config_t frame_config = *config;
+    char prefix[PATH_MAX];
+    unsigned int n;
+    int ret = IAC_SUCCESS;
 
-    /* Initialize SPI */
-    IAC_VERBOSE("Initializing SPI device %s...\n", IAC_SPI_DEFAULT_DEVICE);
-    fd = iac_spi_init(device, &params);
-    if (fd == -1)
+    /* Open camera */
+    if (iac_cam_open(&cam, config->camera) == IAC_FAILURE)
         return IAC_FAILURE;
 
-    /* Write tiles to SPI */
-    for (i = 0; i < IAC_IMAGE_DIVS; i++) {
-        for (j = 0; j < IAC_IMAGE_DIVS; j++) {
-            IAC_VERBOSE("Getting tile blob at position %u, %u...\n", j, i);
-            blob = iac_image_get_blob(wands[i][j], &size);
-            if (blob == NULL)
-                return IAC_FAILURE;
+    /* Initialize camera for streaming */
+    if (iac_cam_init(&cam, &init_params) == IAC_FAILURE
+        || iac_cam_stream_start(&cam, config->buffers) == IAC_FAILURE) {
+        fprintf(stderr, "Unable to initialize camera!\n");
+        iac_cam_close(&cam);
+        return IAC_FAILURE;
+    }
 
-            mod = size % IAC_OBC_BLOCK_SIZE;
-            block.tile = (uint8_t) (j + i * IAC_IMAGE_DIVS);
-            blocks = ((size - 1) / IAC_OBC_BLOCK_SIZE) + 1;
-
-            IAC_VERBOSE("Number of blocks for tile %u, %u is %u...\n",
-                        j,
-                        i,
-                        (unsigned int) blocks);
-            for (k = 0; k <= blocks; k++) {
-                IAC_VERBOSE("Preparing buffer for block %u...\n", (unsigned int) k);
-                block.index = (uint16_t) k;
-                switch (k) {
-                case 0:
-                    /* Transfer number of tile blocks */
-                    blocks_data = htons((uint16_t) blocks);
-                    block.data = (uint8_t *) &blocks_data;
-                    block.data_size = sizeof(blocks_data);
-                    break;
-                case 1:
-                    /* First block of tile */
-                    block.data = blob;
-                default:
-                    /* Transfer tile block */
-                    if (k == blocks && mod)
-                        block.data_size = mod;
-                    else
-                        block.data_size = IAC_OBC_BLOCK_SIZE;
-                    break;
-                }
-                do {
-                    usleep(IAC_OBC_BLOCK_USLEEP);
-                    /* Pack tile block */
-                    packet = iac_obc_packet(&block);
-                    /* Transfer packets */
-                    IAC_VERBOSE("Transferring block %u...\n", (unsigned int) k);
-                    if (iac_spi_transfer(fd,
-                                         packet.buf,
-                                         (uint32_t) packet.size) == IAC_FAILURE)
-                        return IAC_FAILURE;
-                    resp = packet.buf[0];
-                    IAC_VERBOSE("Response from OBC is 0x%02x...\n", resp);
-                    free(packet.buf);
-                } while (resp != IAC_OBC_BLOCK_ACK);
-                /* Next block */
-                block.data += IAC_OBC_BLOCK_SIZE;
-            }
+    for (n = 0; n < config->frames && ret == IAC_SUCCESS; n++) {
+        if (n && config->interval)
+            usleep(config->interval * 1000);
+
+        IAC_VERBOSE("Acquiring frame %u...\n", n);
+        image = iac_cam_stream_get(&cam);
+        if (!image) {
+            ret = IAC_FAILURE;
+            break;
+        }
 
-            MagickRelinquishMemory(blob);
+        /* Each frame writes tiles with its own prefix */
+        if (config->output) {
+            snprintf(prefix, PATH_MAX, "%s-%u", config->prefix, n);
+            frame_config.prefix = prefix;
         }
+        IAC_TRACE_BEGIN_ARG("frame", n);
+        views = tile_cam_image(&frame, image, &grid, config);
+        if (!views
+            || process_tiles(&frame,
+                             views,
+                             &grid,
+                             &frame_config) == IAC_FAILURE)
+            ret = IAC_FAILURE;
+        free(views);
+        iac_image_frame_free(&frame);
+        iac_cam_stream_put(&cam, image);
+        IAC_TRACE_LEAVE("frame");
     }
-    close(fd);
 
-    return IAC_SUCCESS;
+    if (iac_cam_stream_stop(&cam) == IAC_FAILURE)
+        ret = IAC_FAILURE;
+    if (iac_cam_close(&cam) == IAC_FAILURE)
+        ret = IAC_FAILURE;
+
+    return ret;
 }
 
 
-int main(int argc, char **argv)
+/* Parse comma separated list of tiles and ranges of tiles */
+static unsigned int parse_tiles(const char *list,
+                                unsigned int *tiles,
+                                const unsigned int max)
 {
-    HANDLE handle;
-    XI_IMG image;
-    config_t config;
-    MagickWand ***wands;
+    const char *p = list;
+    char *end;
+    unsigned long first, last;
+    unsigned int count = 0;
 
-    config = parse_args(argc, argv);
-    verbose = config.verbose;
+    while (*p) {
+        first = strtoul(p, &end, 10);
+        if (end == p)
+            return 0;
+        last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtoul(p, &end, 10);
+            if (end == p)
+                return 0;
+        }
+        if (last < first || last > UINT16_MAX)
+            return 0;
+        for (; first <= last; first++) {
+            if (count == max)
+                return 0;
+            tiles[count++] = (unsigned int) first;
+        }
+        if (*end == ',')
+            end++;
+        else if (*end)
+            return 0;
+        p = end;
+    }
 
-    if (!config.input) {
-        handle = get_cam_image(&image, &config);
-        wands = tile_cam_image(&image, &config);
+    return count;
+}
+
+
+/* Send tiles straight from the mapped spool, without encoding */
+static int send_spool(const config_t *config)
+{
+    unsigned int tiles[IAC_SPOOL_TILES], count, k, grid = 0;
+    const iac_spool_header_t *header;
+    iac_spool_t spool;
+    iac_obc_packets_t packets;
+    iac_obc_ack_t ack;
+    const uint8_t *blob;
+    size_t *pending = NULL;
+    size_t pending_size = 0, size;
+    int fd, checksum;
+
+    if (iac_spool_map(&spool, config->send) == IAC_FAILURE)
+        return IAC_FAILURE;
+    header = iac_spool_index(&spool);
+    if (config->tiles) {
+        count = parse_tiles(config->tiles, tiles, IAC_SPOOL_TILES);
+        if (!count) {
+            fprintf(stderr, "Invalid list of tiles %s!\n", config->tiles);
+            iac_spool_unmap(&spool);
+            return IAC_FAILURE;
+        }
     }
     else {
-        wands = tile_file_image(&config);
+        count = header->count;
+        for (k = 0; k < count; k++)
+            tiles[k] = header->index[k].tile;
     }
 
-    if (!config.output) {
-        if (transfer_tiles(wands, &config) == IAC_FAILURE) {
-            fprintf(stderr, "Failed to transfer tiles!\n");
-            return EXIT_FAILURE;
-        }
+    /* Grid tile ids of the spool decide whether they go wide */
+    for (k = 0; k < count; k++)
+        if (tiles[k] < IAC_OBC_TILE_MANIFEST && tiles[k] >= grid)
+            grid = tiles[k] + 1;
+    checksum = packets_checksum(grid, config);
+    if (checksum == -1) {
+        iac_spool_unmap(&spool);
+        return IAC_FAILURE;
     }
-    else {
-        if (write_tiles(wands, &config) == IAC_FAILURE) {
-            fprintf(stderr, "Failed to write tiles!\n");
-            return EXIT_FAILURE;
+
+    fd = open_spi(config);
+    if (fd == -1) {
+        iac_spool_unmap(&spool);
+        return IAC_FAILURE;
+    }
+    iac_obc_packets_init(&packets, checksum);
+
+    iac_obc_ack_init(&ack, &config->ack);
+    for (k = 0; k < count; k++) {
+        blob = iac_spool_tile(&spool, tiles[k], &size);
+        if (!blob) {
+            fprintf(stderr, "Tile %u is missing from spool!\n", tiles[k]);
+            goto fail;
         }
+        if (iac_obc_tile_packets(&packets,
+                                 (uint16_t) tiles[k],
+                                 blob,
+                                 size) == IAC_FAILURE
+            || transfer_tile(fd,
+                             &packets,
+                             tiles[k],
+                             0,
+                             &pending,
+                             &pending_size,
+                             &ack,
+                             config) == IAC_FAILURE)
+            goto fail;
+    }
+    iac_obc_packets_free(&packets);
+    free(pending);
+    close_spi(fd);
+    iac_spool_unmap(&spool);
+
+    return IAC_SUCCESS;
+
+fail:
+    iac_obc_packets_free(&packets);
+    free(pending);
+    close_spi(fd);
+    iac_spool_unmap(&spool);
+
+    return IAC_FAILURE;
+}
+
+
+/* Finish transfer of the frame saved in the journal, if interrupted */
+static int resume_tiles(const config_t *config, int *resumed)
+{
+    iac_image_frame_t frame;
+    iac_image_grid_t grid;
+    iac_image_view_t *views;
+    int ret;
+
+    *resumed = 0;
+    if (iac_journal_frame(&journal, &frame) == IAC_FAILURE) {
+        IAC_VERBOSE("No interrupted frame to resume...\n");
+        return IAC_SUCCESS;
+    }
+
+    /* Frame is cut as it was, whatever the grid options now */
+    iac_journal_grid(&journal, &grid);
+    views = iac_image_grid_views(&frame, &grid);
+    if (!views) {
+        iac_image_frame_free(&frame);
+        return IAC_FAILURE;
+    }
+    ret = process_tiles(&frame, views, &grid, config);
+    free(views);
+    iac_image_frame_free(&frame);
+    *resumed = 1;
+
+    return ret;
+}
+
+
+/*
+ * Packet checksum for a grid of `tiles', with wide tile ids once they no
+ * longer fit a byte.  Wide packets are told apart by their checksum, so
+ * they need a CRC.
+ */
+static int packets_checksum(const unsigned int tiles, const config_t *config)
+{
+
+    if (tiles <= IAC_OBC_TILES_NARROW)
+        return config->checksum;
+    if (config->checksum == IAC_OBC_CHECKSUM_LRC) {
+        fprintf(stderr,
+                "More than %u tiles need a CRC checksum!\n",
+                IAC_OBC_TILES_NARROW);
+        return -1;
     }
 
-    iac_image_tiles_destroy(wands, IAC_IMAGE_DIVS);
+    return config->checksum | IAC_OBC_WIDE;
+}
+
+
+/*
+ * Choose the grid of the frame, as rows and columns, tiles of a given
+ * size or tiles sized for the frame to fill whole blocks, and describe
+ * its tiles.
+ */
+static iac_image_view_t *grid_views(const iac_image_frame_t *frame,
+                                    iac_image_grid_t *grid,
+                                    const config_t *config)
+{
+    int ret;
+
+    if (config->auto_grid)
+        ret = iac_rate_grid(&rate,
+                            frame,
+                            IAC_IMAGE_BLOB_QUALITY,
+                            config->rows * config->cols,
+                            grid);
+    else if (config->tile_width)
+        ret = iac_image_grid_tiles(grid,
+                                   frame,
+                                   config->tile_width,
+                                   config->tile_height);
+    else
+        ret = iac_image_grid(grid, frame, config->rows, config->cols);
+    if (ret == IAC_FAILURE)
+        return NULL;
+    IAC_VERBOSE("Cutting frame into %ux%u tiles of %zux%zu pixels...\n",
+                grid->rows,
+                grid->cols,
+                grid->width,
+                grid->height);
+
+    return iac_image_grid_views(frame, grid);
+}
+
+
+/*
+ * Interpolate raw camera image into a frame of its own, with the white
+ * balance gains given or else those of the camera.
+ */
+static int demosaic_cam_image(iac_image_frame_t *frame,
+                              const iac_cam_frame_t *image,
+                              const config_t *config)
+{
+    iac_demosaic_params_t params;
+    uint64_t start;
+    int ret;
+
+    params.pattern = image->bayer;
+    params.method = config->demosaic;
+    memcpy(params.gains,
+           config->wb[1] ? config->wb : image->gains,
+           sizeof(params.gains));
+
+    frame->buf = malloc(frame->stride * frame->height);
+    if (!frame->buf) {
+        perror("Unable to allocate frame");
+        return IAC_FAILURE;
+    }
+    IAC_TRACE_ENTER("demosaic");
+    start = iac_time_usec();
+    ret = iac_demosaic(frame->buf,
+                       image->data,
+                       image->width,
+                       image->height,
+                       &params);
+    IAC_TRACE_LEAVE("demosaic");
+    if (ret == IAC_FAILURE) {
+        iac_image_frame_free(frame);
+        return IAC_FAILURE;
+    }
+    IAC_VERBOSE("Demosaiced %zux%zu frame in %.3f ms...\n",
+                image->width,
+                image->height,
+                (double) (iac_time_usec() - start) / 1000);
+    frame->data = frame->buf;
+
+    return IAC_SUCCESS;
+}
+
+
+static iac_image_view_t *tile_cam_image(iac_image_frame_t *frame,
+                                        const iac_cam_frame_t *image,
+                                        iac_image_grid_t *grid,
+                                        const config_t *config)
+{
+
+    /* Tile camera image in place, unless raw */
+    memset(frame, 0, sizeof(*frame));
+    frame->data = image->data;
+    frame->width = image->width;
+    frame->height = image->height;
+    frame->stride = image->width * IAC_IMAGE_CHANNELS;
+    if (image->bayer
+        && demosaic_cam_image(frame, image, config) == IAC_FAILURE)
+        return NULL;
+
+    return grid_views(frame, grid, config);
+}
+
+
+static iac_image_view_t *tile_file_image(iac_image_frame_t *frame,
+                                         iac_image_grid_t *grid,
+                                         const config_t *config)
+{
+    iac_image_read_params_t params = {
+        config->width,
+        config->height,
+        IAC_IMAGE_FORMAT,
+        IAC_IMAGE_DEPTH,
+    };
+
+    /* Read file image into frame */
+    if (iac_image_frame_file(frame, &params, config->input) == IAC_FAILURE)
+        return NULL;
+
+    return grid_views(frame, grid, config);
+}
+
+
+static unsigned char *encode_view(const tiles_t *tiles,
+                                  const iac_image_view_t *view,
+                                  const int quality,
+                                  size_t *size)
+{
+
+#ifdef IAC_HAVE_JPEG
+    if (tiles->config->encoder == IAC_ENCODER_JPEG)
+        return iac_jpeg_encode(view, quality, size);
+#endif
+
+    return iac_image_view_get_blob(view, quality, size);
+}
+
+
+/*
+ * Encode tile at the quality predicted to land just under its budget.
+ * When the prediction misses, the tile is encoded once more, lower if
+ * it is over budget or higher if it is well under.
+ */
+static unsigned char *encode_budget(tiles_t *tiles,
+                                    const unsigned int tile,
+                                    const iac_image_view_t *view,
+                                    const double weight,
+                                    const size_t budget,
+                                    size_t *size)
+{
+    unsigned char *blob, *retry;
+    size_t retry_size;
+    double scale;
+    int quality, corrected;
+
+    quality = iac_rate_quality(&rate, weight, budget);
+    blob = encode_view(tiles, view, quality, size);
+    if (!blob)
+        return NULL;
+    scale = iac_rate_observe(&rate, weight, quality, *size);
+
+    corrected = iac_rate_correct(&rate,
+                                 weight,
+                                 scale,
+                                 quality,
+                                 *size,
+                                 budget);
+    if (corrected) {
+        retry = encode_view(tiles, view, corrected, &retry_size);
+        if (retry) {
+            iac_rate_observe(&rate, weight, corrected, retry_size);
+            /* Keep a higher quality retry only if it fits */
+            if (corrected < quality || retry_size <= budget) {
+                release_tile(tiles, blob);
+                blob = retry;
+                *size = retry_size;
+                quality = corrected;
+            }
+            else
+                release_tile(tiles, retry);
+        }
+    }
+    iac_rate_result(&rate, *size, budget, corrected != 0);
+    IAC_VERBOSE("Encoded tile %u at quality %d in %zu of %zu bytes...\n",
+                tile,
+                quality,
+                *size,
+                budget);
+
+    return blob;
+}
+
+
+/*
+ * Count encoded tiles of each band of the frame when tiling it in bands,
+ * to release each band as soon as its last tile is encoded.
+ */
+static int band_tiles(tiles_t *tiles,
+                      const iac_image_frame_t *frame,
+                      const iac_image_grid_t *grid)
+{
+
+    tiles->frame = frame;
+    tiles->grid = grid;
+    if (!tiles->config->bands)
+        return IAC_SUCCESS;
+    tiles->bands = calloc(grid->rows, sizeof(*tiles->bands));
+    if (!tiles->bands) {
+        perror("Unable to allocate bands");
+        return IAC_FAILURE;
+    }
+
+    return IAC_SUCCESS;
+}
+
+
+/* Encode tile at given position of the transfer order */
+static unsigned char *encode_tile(void *data,
+                                  const unsigned int position,
+                                  size_t *size)
+{
+    tiles_t *tiles = data;
+    unsigned int tile = tiles->order ? tiles->order[position] : position;
+    const iac_image_view_t *view;
+    unsigned char *blob;
+    size_t budget;
+
+    view = tile == IAC_OBC_TILE_THUMBNAIL ?
+        &tiles->thumb : &tiles->views[tile];
+    budget = tiles->budget ?
+        tiles->budget[position] : tiles->config->tile_budget;
+    IAC_TRACE_BEGIN_ARG("encode", tile);
+    if (budget)
+        blob = encode_budget(tiles,
+                             tile,
+                             view,
+                             tiles->weight ?
+                             tiles->weight[position] : iac_rate_weight(view),
+                             budget,
+                             size);
+    else
+        blob = encode_view(tiles, view, IAC_IMAGE_BLOB_QUALITY, size);
+    IAC_TRACE_LEAVE("encode");
+
+    if (tiles->bands
+        && tile != IAC_OBC_TILE_THUMBNAIL
+        && __atomic_add_fetch(&tiles->bands[tile / tiles->grid->cols],
+                              1,
+                              __ATOMIC_ACQ_REL) == tiles->grid->cols)
+        iac_image_band_done(tiles->frame,
+                            tiles->grid,
+                            tile / tiles->grid->cols);
+
+    return blob;
+}
+
+
+static void release_tile(void *data, unsigned char *blob)
+{
+
+#ifdef IAC_HAVE_JPEG
+    if (((tiles_t *) data)->config->encoder == IAC_ENCODER_JPEG) {
+        iac_jpeg_free(blob);
+        return;
+    }
+#endif
+
+    MagickRelinquishMemory(blob);
+
+}
+
+
+/* Hand tile over to the writer for a file of its own */
+static int write_tile_file(iac_writer_t *writer,
+                           const config_t *config,
+                           const unsigned int i,
+                           const unsigned int j,
+                           unsigned char *blob,
+                           const size_t size)
+{
+    char filename[PATH_MAX];
+
+    snprintf(filename,
+             PATH_MAX,
+             "%s-%u-%u.%s",
+             config->prefix,
+             i,
+             j,
+             IAC_IMAGE_BLOB_FORMAT);
+
+    return iac_writer_file(writer, filename, blob, size);
+}
+
+
+/*
+ * Encode tiles on the pipeline workers and write them to a spool, or
+ * hand them over to the writer to be written and synced as files while
+ * later tiles are encoded.
+ */
+static int write_tiles(const iac_image_frame_t *frame,
+                       iac_image_view_t *views,
+                       const iac_image_grid_t *grid,
+                       const config_t *config)
+{
+    unsigned int i, j, tile;
+    char filename[PATH_MAX];
+    tiles_t tiles = { views, config };
+    iac_pipeline_params_t pipeline_params = {
+        iac_image_grid_count(grid),
+        config->jobs,
+        IAC_PIPELINE_DEPTH,
+        encode_tile,
+        release_tile,
+        &tiles,
+    };
+    iac_pipeline_t pipeline;
+    iac_writer_t writer;
+    iac_spool_t spool;
+    unsigned char *blob;
+    size_t size;
+    int ret;
+
+    if (band_tiles(&tiles, frame, grid) == IAC_FAILURE)
+        return IAC_FAILURE;
+    if (config->spool) {
+        snprintf(filename,
+                 PATH_MAX,
+                 "%s/%s.spool",
+                 config->output,
+                 config->prefix);
+        ret = iac_spool_create(&spool, filename, 0);
+    }
+    else {
+        ret = iac_writer_open(&writer, config->output, release_tile, &tiles);
+    }
+    if (ret == IAC_FAILURE) {
+        free(tiles.bands);
+        return IAC_FAILURE;
+    }
+    if (iac_pipeline_start(&pipeline, &pipeline_params) == IAC_FAILURE)
+        goto fail_output;
+
+    /* Write tiles to files or spool */
+    for (i = 0; i < grid->rows; i++) {
+        for (j = 0; j < grid->cols; j++) {
+            tile = j + i * grid->cols;
+            blob = iac_pipeline_get(&pipeline, &size);
+            if (!blob)
+                goto fail;
+
+            IAC_TRACE_BEGIN_ARG("write", tile);
+            if (config->spool) {
+                ret = iac_spool_append(&spool, tile, blob, size);
+                iac_pipeline_put(&pipeline);
+            }
+            else {
+                iac_pipeline_take(&pipeline);
+                ret = write_tile_file(&writer, config, i, j, blob, size);
+            }
+            IAC_TRACE_LEAVE("write");
+            if (ret == IAC_FAILURE)
+                goto fail;
+        }
+    }
+    iac_pipeline_stop(&pipeline);
+
+    if (config->spool) {
+        ret = iac_spool_close(&spool);
+    }
+    else {
+        ret = iac_writer_sync(&writer);
+        IAC_VERBOSE("Wrote %u tile files, %zu bytes in %.3f ms "
+                    "(%.1f MB/s) with %s...\n",
+                    writer.stats.files,
+                    writer.stats.bytes,
+                    (double) writer.stats.usec / 1000,
+                    (double) writer.stats.bytes
+                    / (double) (writer.stats.usec + 1),
+                    writer.uring ? "io_uring" : "pwrite");
+        iac_writer_close(&writer);
+    }
+    free(tiles.bands);
+
+    return ret;
+
+fail:
+    iac_pipeline_stop(&pipeline);
+fail_output:
+    if (config->spool)
+        iac_spool_close(&spool);
+    else
+        iac_writer_close(&writer);
+    free(tiles.bands);
+
+    return IAC_FAILURE;
+}
+
+
+/*
+ * Send the `count' pending tile packets in batches.  Every packet that
+ * is not acknowledged in its own transfer is queued again, ahead of
+ * packets not yet sent.  The oldest unacknowledged block paces polling
+ * of the OBC.
+ */
+static int transfer_packets(const int fd,
+                            const iac_obc_packets_t *packets,
+                            size_t *pending,
+                            const size_t count,
+                            iac_obc_ack_t *ack,
+                            const config_t *config)
+{
+    uint8_t tx[IAC_SPI_BATCH_MAX * IAC_OBC_PACKET_SIZE_MAX];
+    uint8_t rx[IAC_SPI_BATCH_MAX * IAC_OBC_PACKET_SIZE_MAX];
+    size_t n, kept, front;
+    unsigned int i, m;
+    uint8_t resp;
+
+    front = packets->count;
+    for (n = count; n > 0; n = kept + n - m) {
+        if (pending[0] != front) {
+            front = pending[0];
+            iac_obc_ack_start(ack);
+        }
+        IAC_TRACE_ENTER("ack_wait");
+        iac_obc_ack_wait(ack);
+        IAC_TRACE_LEAVE("ack_wait");
+
+        m = n < config->batch ? (unsigned int) n : config->batch;
+        for (i = 0; i < m; i++)
+            memcpy(tx + i * packets->size,
+                   iac_obc_packets_at(packets, pending[i]),
+                   packets->size);
+
+        IAC_VERBOSE("Transferring %u blocks from block %u...\n",
+                    m,
+                    (unsigned int) pending[0]);
+        if (iac_spi_transfer_batch(fd,
+                                   tx,
+                                   rx,
+                                   (uint32_t) packets->size,
+                                   m,
+                                   (uint16_t) config->block_delay)
+            == IAC_FAILURE)
+            return IAC_FAILURE;
+
+        /* Requeue blocks that were not acknowledged */
+        for (i = 0, kept = 0; i < m; i++) {
+            resp = rx[i * packets->size];
+            IAC_VERBOSE("Response from OBC for block %u is 0x%02x...\n",
+                        (unsigned int) pending[i],
+                        resp);
+            if (resp != IAC_OBC_BLOCK_ACK)
+                pending[kept++] = pending[i];
+        }
+        if (iac_obc_ack_result(ack,
+                               rx[0] == IAC_OBC_BLOCK_ACK) == IAC_FAILURE)
+            return IAC_FAILURE;
+        memmove(pending + kept, pending + m, (n - m) * sizeof(*pending));
+
+        /* Blocks before the oldest pending one are all acknowledged */
+        iac_journal_acked(&journal,
+                          kept + n - m ? pending[0] : packets->count);
+    }
+
+    return IAC_SUCCESS;
+}
+
+
+/*
+ * Stream windows of missing blocks, each followed by a poll block, and
+ * read back which blocks of the window the OBC received.  Only blocks
+ * missing from the bitmap are sent again.
+ */
+static int transfer_window(const int fd,
+                           const iac_obc_packets_t *packets,
+                           const uint16_t tile,
+                           size_t *pending,
+                           const size_t count,
+                           iac_obc_ack_t *ack,
+                           const config_t *config)
+{
+    uint8_t tx[IAC_SPI_BATCH_MAX * IAC_OBC_PACKET_SIZE_MAX];
+    uint8_t rx[IAC_SPI_BATCH_MAX * IAC_OBC_PACKET_SIZE_MAX];
+    uint8_t poll[IAC_OBC_PACKET_SIZE_MAX];
+    uint8_t buf[IAC_OBC_STATUS_SIZE_MAX];
+    iac_obc_status_t status;
+    size_t k, n, w, kept, base, front, status_size;
+    unsigned int i, m;
+
+    status_size = iac_obc_status_size(packets->checksum);
+    front = packets->count;
+    for (n = count; n > 0; n = kept + n - w) {
+        /* Window of missing blocks from the oldest one */
+        base = pending[0];
+        for (w = 0; w < n && pending[w] < base + config->window; w++)
+            ;
+        iac_obc_poll_encode(tile,
+                            (uint16_t) base,
+                            (uint16_t) (pending[w - 1] - base + 1),
+                            packets->checksum,
+                            poll);
+        if (base != front) {
+            front = base;
+            iac_obc_ack_start(ack);
+        }
+
+        /* Stream window followed by poll */
+        IAC_VERBOSE("Transferring window of %u blocks from block %u...\n",
+                    (unsigned int) w,
+                    (unsigned int) base);
+        for (k = 0; k <= w; k += m) {
+            m = w + 1 - k < config->batch ?
+                (unsigned int) (w + 1 - k) : config->batch;
+            for (i = 0; i < m; i++)
+                memcpy(tx + i * packets->size,
+                       k + i < w ?
+                       iac_obc_packets_at(packets, pending[k + i]) : poll,
+                       packets->size);
+            if (iac_spi_transfer_batch(fd,
+                                       tx,
+                                       rx,
+                                       (uint32_t) packets->size,
+                                       m,
+                                       (uint16_t) config->block_delay)
+                == IAC_FAILURE)
+                return IAC_FAILURE;
+        }
+
+        /* Read received bitmap once the OBC has processed the window */
+        for (;;) {
+            IAC_TRACE_ENTER("ack_wait");
+            iac_obc_ack_wait(ack);
+            IAC_TRACE_LEAVE("ack_wait");
+            memset(buf, 0, status_size);
+            if (iac_spi_transfer(fd,
+                                 buf,
+                                 (uint32_t) status_size) == IAC_FAILURE)
+                return IAC_FAILURE;
+            if (iac_obc_status_decode(&status,
+                                      buf,
+                                      packets->checksum) == IAC_SUCCESS
+                && status.tile == tile
+                && status.base == base)
+                break;
+            IAC_VERBOSE("No status from OBC for window...\n");
+            if (iac_obc_ack_result(ack, 0) == IAC_FAILURE)
+                return IAC_FAILURE;
+
+            /* Poll again in case the poll block was lost */
+            if (iac_spi_transfer_batch(fd,
+                                       poll,
+                                       rx,
+                                       (uint32_t) packets->size,
+                                       1,
+                                       0) == IAC_FAILURE)
+                return IAC_FAILURE;
+        }
+
+        /* Keep blocks missing from bitmap */
+        for (k = 0, kept = 0; k < w; k++)
+            if (!iac_obc_status_acked(&status, pending[k] - base))
+                pending[kept++] = pending[k];
+        IAC_VERBOSE("OBC is missing %u of %u blocks...\n",
+                    (unsigned int) kept,
+                    (unsigned int) w);
+        if (iac_obc_ack_result(ack, kept < w) == IAC_FAILURE)
+            return IAC_FAILURE;
+        memmove(pending + kept, pending + w, (n - w) * sizeof(*pending));
+        iac_journal_acked(&journal,
+                          kept + n - w ? pending[0] : packets->count);
+    }
+
+    return IAC_SUCCESS;
+}
+
+
+/*
+ * Plan downlink of a frame.  With a uniform threshold a manifest leads,
+ * holding the rows, columns and tile size of the grid and then for each
+ * grid tile in raster order whether it is encoded, sent as a uniform
+ * tile or skipped, and its mean colour, for the ground to rebuild the
+ * frame.  In priority order a thumbnail of the whole frame
+ * follows and then grid tiles by descending detail, so that a pass cut
+ * short still gives an overview and the most informative tiles.
+ */
+static int plan_tiles(plan_t *plan,
+                      tiles_t *tiles,
+                      const iac_image_frame_t *frame,
+                      const iac_image_grid_t *geometry,
+                      const config_t *config)
+{
+    const unsigned int count = iac_image_grid_count(geometry);
+    iac_image_stats_t stats;
+    unsigned int k, c, tile, *grid;
+    uint32_t variance;
+    uint16_t header[4];
+    uint8_t *entry;
+
+    memset(plan, 0, sizeof(*plan));
+    plan->grid = *geometry;
+    if (config->uniform) {
+        plan->tiles[plan->count++] = IAC_OBC_TILE_MANIFEST;
+        header[0] = htons((uint16_t) geometry->rows);
+        header[1] = htons((uint16_t) geometry->cols);
+        header[2] = htons((uint16_t) geometry->width);
+        header[3] = htons((uint16_t) geometry->height);
+        memcpy(plan->manifest, header, IAC_TILE_MANIFEST_HEADER);
+        plan->manifest_size = IAC_TILE_MANIFEST_HEADER
+            + count * IAC_TILE_MANIFEST_ENTRY;
+    }
+
+    grid = plan->tiles + plan->count;
+    if (config->order == IAC_ORDER_PRIORITY) {
+        IAC_VERBOSE("Ordering tiles by detail...\n");
+        if (iac_image_thumbnail(&plan->thumb,
+                                frame,
+                                geometry->rows > geometry->cols ?
+                                geometry->rows : geometry->cols)
+            == IAC_FAILURE)
+            return IAC_FAILURE;
+        tiles->thumb.data = plan->thumb.data;
+        tiles->thumb.width = plan->thumb.width;
+        tiles->thumb.height = plan->thumb.height;
+        tiles->thumb.stride = plan->thumb.stride;
+        plan->tiles[plan->count++] = IAC_OBC_TILE_THUMBNAIL;
+        grid++;
+        if (iac_image_views_rank(tiles->views,
+                                 count,
+                                 grid) == IAC_FAILURE) {
+            iac_image_frame_free(&plan->thumb);
+            return IAC_FAILURE;
+        }
+    }
+    else {
+        for (k = 0; k < count; k++)
+            grid[k] = k;
+    }
+
+    /* Replace or drop tiles of low variance, keeping the rest in order */
+    for (k = 0; k < count; k++) {
+        tile = grid[k];
+        if (config->uniform) {
+            entry = plan->manifest + IAC_TILE_MANIFEST_HEADER
+                + tile * IAC_TILE_MANIFEST_ENTRY;
+            iac_image_view_stats(&tiles->views[tile], &stats);
+            variance = 0;
+            for (c = 0; c < IAC_IMAGE_CHANNELS; c++)
+                if (stats.variance[c] > variance)
+                    variance = stats.variance[c];
+            if (variance >= config->uniform)
+                entry[0] = IAC_TILE_ENCODED;
+            else if (config->uniform_action == IAC_UNIFORM_SKIP)
+                entry[0] = IAC_TILE_SKIPPED;
+            else
+                entry[0] = IAC_TILE_UNIFORM;
+            memcpy(entry + 1, stats.mean, IAC_IMAGE_CHANNELS);
+            if (entry[0] != IAC_TILE_ENCODED)
+                IAC_VERBOSE("Tile %u is uniform with variance %u...\n",
+                            tile,
+                            (unsigned int) variance);
+            if (entry[0] == IAC_TILE_SKIPPED)
+                continue;
+        }
+        plan->tiles[plan->count++] = tile;
+    }
+
+    /* Only the thumbnail and encoded tiles go through the pipeline */
+    for (k = 0; k < plan->count; k++) {
+        tile = plan->tiles[k];
+        if (plan_encoded(plan, tile))
+            plan->encode[plan->encoded++] = tile;
+    }
+    tiles->order = plan->encode;
+
+    /* Budget encoded tiles by their predicted size */
+    if (config->tile_budget || config->frame_budget) {
+        for (k = 0; k < plan->encoded; k++) {
+            tile = plan->encode[k];
+            plan->weight[k] = iac_rate_weight(tile == IAC_OBC_TILE_THUMBNAIL ?
+                                              &tiles->thumb :
+                                              &tiles->views[tile]);
+            plan->budget[k] = config->tile_budget;
+        }
+        if (config->frame_budget)
+            iac_rate_share(plan->weight,
+                           plan->encoded,
+                           config->frame_budget,
+                           plan->budget);
+        tiles->budget = plan->budget;
+        tiles->weight = plan->weight;
+    }
+
+    return IAC_SUCCESS;
+}
+
+
+static int plan_encoded(const plan_t *plan, const unsigned int tile)
+{
+
+    if (tile == IAC_OBC_TILE_THUMBNAIL)
+        return 1;
+    if (tile == IAC_OBC_TILE_MANIFEST)
+        return 0;
+
+    return plan->manifest[IAC_TILE_MANIFEST_HEADER
+                          + tile * IAC_TILE_MANIFEST_ENTRY]
+        == IAC_TILE_ENCODED;
+}
+
+
+/*
+ * Resume transfer of the frame from the journal, at the first tile not
+ * fully acknowledged, or record the frame in the journal to send it from
+ * the start.  A tile partly sent is resumed only from its stored blob.
+ */
+static int plan_resume(plan_t *plan,
+                       const iac_image_frame_t *frame,
+                       const config_t *config)
+{
+    const iac_journal_tile_t *entry;
+    unsigned int k, j, n, done;
+
+    if (!config->resume
+        || iac_journal_match(&journal,
+                             &plan->grid,
+                             plan->tiles,
+                             plan->count) == IAC_FAILURE) {
+        if (config->resume)
+            fprintf(stderr, "Journal does not match tiles of frame!\n");
+        return iac_journal_begin(&journal,
+                                 frame,
+                                 &plan->grid,
+                                 plan->tiles,
+                                 plan->count);
+    }
+
+    plan->first = journal.state->position;
+    if (plan->first < plan->count) {
+        entry = &journal.state->tiles[plan->first];
+        if (entry->blocks && entry->acked >= entry->blocks)
+            plan->first++;
+        else if (entry->acked) {
+            plan->acked = entry->acked;
+            if (plan_encoded(plan, plan->tiles[plan->first])) {
+                plan->stored = iac_journal_load(&journal,
+                                                plan->first,
+                                                &plan->stored_size);
+                if (!plan->stored)
+                    plan->acked = 0;
+            }
+        }
+    }
+    IAC_VERBOSE("Resuming frame %u at tile %u of %u, block %u...\n",
+                journal.state->frame,
+                plan->first,
+                plan->count,
+                (unsigned int) plan->acked);
+
+    /* Encode neither tiles already sent nor the stored one */
+    done = plan->first + (plan->stored ? 1 : 0);
+    for (k = 0, n = 0; k < plan->encoded; k++) {
+        for (j = 0; j < done && plan->tiles[j] != plan->encode[k]; j++)
+            ;
+        if (j < done)
+            continue;
+        plan->encode[n] = plan->encode[k];
+        plan->budget[n] = plan->budget[k];
+        plan->weight[n] = plan->weight[k];
+        n++;
+    }
+    plan->encoded = n;
+
+    return IAC_SUCCESS;
+}
+
+
+/* Pack all blocks of the next tile of the plan at once */
+static int packetize_tile(const plan_t *plan,
+                          iac_pipeline_t *pipeline,
+                          iac_obc_packets_t *packets,
+                          const unsigned int position)
+{
+    const unsigned int tile = plan->tiles[position];
+    const uint8_t *entry;
+    unsigned char *blob;
+    size_t size;
+    int ret;
+
+    /* Tile stored by an interrupted transfer */
+    if (position == plan->first && plan->stored) {
+        if (retain.open
+            && iac_spool_append(&retain.spool,
+                                tile,
+                                plan->stored,
+                                plan->stored_size) == IAC_FAILURE)
+            return IAC_FAILURE;
+        return iac_obc_tile_packets(packets,
+                                    (uint16_t) tile,
+                                    plan->stored,
+                                    plan->stored_size);
+    }
+
+    if (tile == IAC_OBC_TILE_MANIFEST) {
+        if (retain.open
+            && iac_spool_append(&retain.spool,
+                                tile,
+                                plan->manifest,
+                                plan->manifest_size) == IAC_FAILURE)
+            return IAC_FAILURE;
+        return iac_obc_tile_packets(packets,
+                                    (uint16_t) tile,
+                                    plan->manifest,
+                                    plan->manifest_size);
+    }
+    if (tile != IAC_OBC_TILE_THUMBNAIL) {
+        entry = plan->manifest + IAC_TILE_MANIFEST_HEADER
+            + tile * IAC_TILE_MANIFEST_ENTRY;
+        if (entry[0] == IAC_TILE_UNIFORM)
+            return iac_obc_uniform_packets(packets,
+                                           (uint16_t) tile,
+                                           entry + 1);
+    }
+
+    IAC_VERBOSE("Getting blob of tile %u...\n", tile);
+    IAC_TRACE_BEGIN_ARG("pipeline_wait", tile);
+    blob = iac_pipeline_get(pipeline, &size);
+    IAC_TRACE_LEAVE("pipeline_wait");
+    if (blob == NULL)
+        return IAC_FAILURE;
+    if (journal.state
+        && iac_journal_store(&journal, position, blob, size) == IAC_FAILURE)
+        return IAC_FAILURE;
+    if (retain.open
+        && iac_spool_append(&retain.spool, tile, blob, size) == IAC_FAILURE)
+        return IAC_FAILURE;
+
+    IAC_TRACE_BEGIN_ARG("packetize", tile);
+    ret = iac_obc_tile_packets(packets, (uint16_t) tile, blob, size);
+    IAC_TRACE_LEAVE("packetize");
+    if (ret == IAC_FAILURE)
+        return IAC_FAILURE;
+    iac_pipeline_put(pipeline);
+
+    return IAC_SUCCESS;
+}
+
+
+/* Grow block queue to hold `capacity' blocks, reusing it across tiles */
+static int reserve_blocks(size_t **pending,
+                          size_t *pending_size,
+                          const size_t capacity)
+{
+    size_t *tmp;
+
+    if (capacity > *pending_size) {
+        tmp = realloc(*pending, capacity * sizeof(*tmp));
+        if (!tmp) {
+            perror("Unable to allocate block queue");
+            return IAC_FAILURE;
+        }
+        *pending = tmp;
+        *pending_size = capacity;
+    }
+
+    return IAC_SUCCESS;
+}
+
+
+/* Send the queued blocks of a tile */
+static int transfer_blocks(const int fd,
+                           const iac_obc_packets_t *packets,
+                           const unsigned int tile,
+                           size_t *pending,
+                           const size_t count,
+                           iac_obc_ack_t *ack,
+                           const config_t *config)
+{
+    int ret;
+
+    IAC_TRACE_BEGIN_ARG("transfer", tile);
+    if (config->window)
+        ret = transfer_window(fd,
+                              packets,
+                              (uint16_t) tile,
+                              pending,
+                              count,
+                              ack,
+                              config);
+    else
+        ret = transfer_packets(fd, packets, pending, count, ack, config);
+    IAC_TRACE_LEAVE("transfer");
+
+    return ret;
+}
+
+
+/* Send packets of a tile from block `first' on */
+static int transfer_tile(const int fd,
+                         const iac_obc_packets_t *packets,
+                         const unsigned int tile,
+                         const size_t first,
+                         size_t **pending,
+                         size_t *pending_size,
+                         iac_obc_ack_t *ack,
+                         const config_t *config)
+{
+    size_t k;
+
+    IAC_VERBOSE("Number of blocks for tile %u is %u...\n",
+                tile,
+                (unsigned int) (packets->count - 1));
+    if (reserve_blocks(pending,
+                       pending_size,
+                       packets->capacity) == IAC_FAILURE)
+        return IAC_FAILURE;
+    for (k = first; k < packets->count; k++)
+        (*pending)[k - first] = k;
+
+    return transfer_blocks(fd,
+                           packets,
+                           tile,
+                           *pending,
+                           packets->count - first,
+                           ack,
+                           config);
+}
+
+
+/*
+ * Number the frame and start its spool in the retain directory.  Frames
+ * are numbered on from the last one retained by an earlier run, and the
+ * spool of the frame IAC_RETAIN_FRAMES before is removed.
+ */
+static int retain_begin(const config_t *config)
+{
+    char filename[PATH_MAX];
+    struct dirent *entry;
+    unsigned int frame;
+    DIR *dir;
+
+    if (!retain.numbered) {
+        dir = opendir(config->retain);
+        if (!dir) {
+            perror("Unable to open retain directory");
+            return IAC_FAILURE;
+        }
+        while ((entry = readdir(dir)))
+            if (sscanf(entry->d_name, "frame-%u.spool", &frame) == 1
+                && (!retain.numbered || frame > retain.frame)) {
+                retain.frame = frame;
+                retain.numbered = 1;
+            }
+        closedir(dir);
+        if (!retain.numbered) {
+            retain.frame = 0;
+            retain.numbered = 1;
+        }
+        else {
+            retain.frame++;
+        }
+    }
+    else {
+        retain.frame++;
+    }
+
+    if (retain.frame >= IAC_RETAIN_FRAMES) {
+        snprintf(filename,
+                 PATH_MAX,
+                 "%s/frame-%u.spool",
+                 config->retain,
+                 retain.frame - IAC_RETAIN_FRAMES);
+        unlink(filename);
+    }
+    snprintf(filename,
+             PATH_MAX,
+             "%s/frame-%u.spool",
+             config->retain,
+             retain.frame);
+    if (iac_spool_create(&retain.spool,
+                         filename,
+                         retain.frame) == IAC_FAILURE)
+        return IAC_FAILURE;
+    retain.open = 1;
+
+    return IAC_SUCCESS;
+}
+
+
+static int retain_end(void)
+{
+
+    if (!retain.open)
+        return IAC_SUCCESS;
+    retain.open = 0;
+    return iac_spool_close(&retain.spool);
+}
+
+
+/*
+ * Send again the requested blocks of a tile of a retained frame.  The
+ * tile is packed from its blob in the frame spool or, if uniform, from
+ * the manifest, without encoding it again.
+ */
+static int serve_request(const int fd,
+                         const iac_obc_request_t *request,
+                         iac_obc_packets_t *packets,
+                         size_t **pending,
+                         size_t *pending_size,
+                         const config_t *config)
+{
+    char filename[PATH_MAX];
+    unsigned int frame, k;
+    const uint8_t *blob, *entry = NULL;
+    uint16_t header[2];
+    iac_spool_t spool;
+    iac_obc_ack_t ack;
+    size_t size, n, b, last;
+    int ret;
+
+    /* Frame numbers wrap around on the link */
+    frame = retain.frame - (uint16_t) (retain.frame - request->frame);
+    IAC_VERBOSE("Request for %u ranges of tile %u of frame %u...\n",
+                request->count,
+                request->tile,
+                frame);
+    snprintf(filename,
+             PATH_MAX,
+             "%s/frame-%u.spool",
+             config->retain,
+             frame);
+    if (iac_spool_map(&spool, filename) == IAC_FAILURE) {
+        fprintf(stderr, "Frame %u is not retained!\n", frame);
+        return IAC_SUCCESS;
+    }
+
+    /* Uniform tiles of the grid are only found in the manifest */
+    blob = iac_spool_tile(&spool, IAC_OBC_TILE_MANIFEST, &size);
+    if (blob && size >= IAC_TILE_MANIFEST_HEADER) {
+        memcpy(header, blob, sizeof(header));
+        if (request->tile < (unsigned int) ntohs(header[0]) * ntohs(header[1])
+            && size >= IAC_TILE_MANIFEST_HEADER
+            + (request->tile + 1u) * IAC_TILE_MANIFEST_ENTRY)
+            entry = blob + IAC_TILE_MANIFEST_HEADER
+                + request->tile * IAC_TILE_MANIFEST_ENTRY;
+    }
+    if (entry && entry[0] == IAC_TILE_UNIFORM) {
+        ret = iac_obc_uniform_packets(packets, request->tile, entry + 1);
+    }
+    else {
+        blob = iac_spool_tile(&spool, request->tile, &size);
+        if (!blob) {
+            fprintf(stderr,
+                    "Tile %u of frame %u is not retained!\n",
+                    request->tile,
+                    frame);
+            iac_spool_unmap(&spool);
+            return IAC_SUCCESS;
+        }
+        ret = iac_obc_tile_packets(packets, request->tile, blob, size);
+    }
+    iac_spool_unmap(&spool);
+    if (ret == IAC_FAILURE
+        || reserve_blocks(pending,
+                          pending_size,
+                          packets->capacity) == IAC_FAILURE)
+        return IAC_FAILURE;
+
+    /* Queue requested blocks in order, once each */
+    for (b = 0, n = 0; b < packets->count; b++) {
+        for (k = 0; k < request->count; k++) {
+            last = (size_t) request->ranges[k].base
+                + request->ranges[k].count;
+            if (b >= request->ranges[k].base && b < last)
+                break;
+        }
+        if (k < request->count)
+            (*pending)[n++] = b;
+    }
+    IAC_VERBOSE("Sending %u of %u blocks of tile %u again...\n",
+                (unsigned int) n,
+                (unsigned int) packets->count,
+                request->tile);
+
+    iac_obc_ack_init(&ack, &config->ack);
+    return transfer_blocks(fd,
+                           packets,
+                           request->tile,
+                           *pending,
+                           n,
+                           &ack,
+                           config);
+}
+
+
+/*
+ * Poll the OBC for requests for blocks of retained frames and serve
+ * them, until the OBC has none left or does not answer in time.
+ */
+static int serve_requests(const int fd,
+                          iac_obc_packets_t *packets,
+                          size_t **pending,
+                          size_t *pending_size,
+                          const config_t *config)
+{
+    uint8_t poll[IAC_OBC_PACKET_SIZE_MAX];
+    uint8_t rx[IAC_OBC_PACKET_SIZE_MAX];
+    uint8_t buf[IAC_OBC_STATUS_SIZE_MAX];
+    iac_obc_ack_params_t params = config->ack;
+    iac_obc_request_t request;
+    iac_obc_ack_t ack;
+    size_t status_size;
+    uint64_t start, deadline;
+    unsigned int served;
+
+    /* Waiting is bounded by the deadline only */
+    params.block_retries = 0;
+    params.frame_retries = 0;
+    params.block_timeout = 0;
+    params.frame_timeout = 0;
+    status_size = iac_obc_status_size(packets->checksum);
+    iac_obc_request_poll_encode((uint16_t) retain.frame,
+                                packets->checksum,
+                                poll);
+
+    /*
+     * Serving is bounded by a number of requests and by the frame
+     * timeout, so that an OBC which keeps asking does not hold up the
+     * next frame.
+     */
+    start = iac_time_usec();
+    for (served = 0; ; served++) {
+        if (served == IAC_OBC_REQUESTS_MAX) {
+            fprintf(stderr,
+                    "Served %u requests of OBC, ignoring more!\n",
+                    served);
+            return IAC_SUCCESS;
+        }
+        if (config->ack.frame_timeout
+            && iac_time_usec() - start
+            > config->ack.frame_timeout * 1000ULL) {
+            fprintf(stderr,
+                    "Served %u requests of OBC within %u ms, ignoring "
+                    "more!\n",
+                    served,
+                    config->ack.frame_timeout);
+            return IAC_SUCCESS;
+        }
+
+        iac_obc_ack_init(&ack, &params);
+        iac_obc_ack_start(&ack);
+        deadline = iac_time_usec() + config->request_wait * 1000ULL;
+        if (iac_spi_transfer_batch(fd,
+                                   poll,
+                                   rx,
+                                   (uint32_t) packets->size,
+                                   1,
+                                   0) == IAC_FAILURE)
+            return IAC_FAILURE;
+
+        for (;;) {
+            IAC_TRACE_ENTER("ack_wait");
+            iac_obc_ack_wait(&ack);
+            IAC_TRACE_LEAVE("ack_wait");
+            memset(buf, 0, status_size);
+            if (iac_spi_transfer(fd,
+                                 buf,
+                                 (uint32_t) status_size) == IAC_FAILURE)
+                return IAC_FAILURE;
+            if (iac_obc_request_decode(&request,
+                                       buf,
+                                       packets->checksum) == IAC_SUCCESS)
+                break;
+            if (iac_time_usec() > deadline) {
+                IAC_VERBOSE("No request from OBC...\n");
+                return IAC_SUCCESS;
+            }
+            iac_obc_ack_result(&ack, 0);
+
+            /* Poll again in case the poll block was lost */
+            if (iac_spi_transfer_batch(fd,
+                                       poll,
+                                       rx,
+                                       (uint32_t) packets->size,
+                                       1,
+                                       0) == IAC_FAILURE)
+                return IAC_FAILURE;
+        }
+
+        if (!request.count)
+            return IAC_SUCCESS;
+        IAC_TRACE_BEGIN_ARG("request", request.tile);
+        if (serve_request(fd,
+                          &request,
+                          packets,
+                          pending,
+                          pending_size,
+                          config) == IAC_FAILURE) {
+            IAC_TRACE_LEAVE("request");
+            return IAC_FAILURE;
+        }
+        IAC_TRACE_LEAVE("request");
+    }
+}
+
+
+static int transfer_tiles(const iac_image_frame_t *frame,
+                          iac_image_view_t *views,
+                          const iac_image_grid_t *grid,
+                          const config_t *config)
+{
+    tiles_t tiles = { views, config, NULL, { NULL, 0, 0, 0 } };
+    iac_pipeline_params_t pipeline_params = {
+        iac_image_grid_count(grid),
+        config->jobs,
+        IAC_PIPELINE_DEPTH,
+        encode_tile,
+        release_tile,
+        &tiles,
+    };
+    int fd, checksum;
+    unsigned int k, tile;
+    plan_t plan;
+    iac_pipeline_t pipeline;
+    iac_obc_packets_t packets;
+    iac_obc_ack_t ack;
+    size_t *pending = NULL;
+    size_t pending_size = 0, first;
+
+    checksum = packets_checksum(iac_image_grid_count(grid), config);
+    if (checksum == -1
+        || band_tiles(&tiles, frame, grid) == IAC_FAILURE)
+        return IAC_FAILURE;
+    if (plan_tiles(&plan, &tiles, frame, grid, config) == IAC_FAILURE) {
+        free(tiles.bands);
+        return IAC_FAILURE;
+    }
+    if (journal.state
+        && plan_resume(&plan, frame, config) == IAC_FAILURE)
+        goto fail_plan;
+    pipeline_params.tiles = plan.encoded;
+    if (config->retain && retain_begin(config) == IAC_FAILURE)
+        goto fail_plan;
+
+    /* Initialize SPI */
+    fd = open_spi(config);
+    if (fd == -1)
+        goto fail_plan;
+
+    iac_obc_packets_init(&packets, checksum);
+
+    /* Encode tiles ahead of the link */
+    IAC_VERBOSE("Starting %u tile encoder threads...\n", config->jobs);
+    if (iac_pipeline_start(&pipeline, &pipeline_params) == IAC_FAILURE) {
+        close_spi(fd);
+        goto fail_plan;
+    }
+
+    /* Write tiles to SPI in order */
+    iac_obc_ack_init(&ack, &config->ack);
+    for (k = plan.first; k < plan.count; k++) {
+        tile = plan.tiles[k];
+        if (packetize_tile(&plan, &pipeline, &packets, k) == IAC_FAILURE)
+            goto fail;
+
+        first = k == plan.first ? plan.acked : 0;
+        iac_journal_start(&journal, k, packets.count, first);
+        if (transfer_tile(fd,
+                          &packets,
+                          tile,
+                          first,
+                          &pending,
+                          &pending_size,
+                          &ack,
+                          config) == IAC_FAILURE)
+            goto fail;
+    }
+    iac_journal_end(&journal);
+    if (config->retain
+        && (retain_end() == IAC_FAILURE
+            || serve_requests(fd,
+                              &packets,
+                              &pending,
+                              &pending_size,
+                              config) == IAC_FAILURE))
+        goto fail;
+    iac_pipeline_stop(&pipeline);
+    iac_obc_packets_free(&packets);
+    free(pending);
+    close_spi(fd);
+    iac_image_frame_free(&plan.thumb);
+    free(plan.stored);
+    free(tiles.bands);
+
+    return IAC_SUCCESS;
+
+fail:
+    iac_pipeline_stop(&pipeline);
+    iac_obc_packets_free(&packets);
+    free(pending);
+    close_spi(fd);
+fail_plan:
+    retain_end();
+    iac_image_frame_free(&plan.thumb);
+    free(plan.stored);
+    free(tiles.bands);
+
+    return IAC_FAILURE;
+}
+
+
+static int process_tiles(const iac_image_frame_t *frame,
+                         iac_image_view_t *views,
+                         const iac_image_grid_t *grid,
+                         const config_t *config)
+{
+    iac_rate_stats_t stats = rate.stats;
+
+    if (!config->output) {
+        if (transfer_tiles(frame, views, grid, config) == IAC_FAILURE) {
+            fprintf(stderr, "Failed to transfer tiles!\n");
+            return IAC_FAILURE;
+        }
+    }
+    else {
+        if (write_tiles(frame, views, grid, config) == IAC_FAILURE) {
+            fprintf(stderr, "Failed to write tiles!\n");
+            return IAC_FAILURE;
+        }
+    }
+
+    if (config->tile_budget || config->frame_budget)
+        IAC_VERBOSE("Encoded %lu tiles in %zu of %zu budgeted bytes, "
+                    "%lu encoded twice, %lu over budget...\n",
+                    rate.stats.tiles - stats.tiles,
+                    rate.stats.bytes - stats.bytes,
+                    rate.stats.budget - stats.budget,
+                    rate.stats.reencodes - stats.reencodes,
+                    rate.stats.overruns - stats.overruns);
+
+    return IAC_SUCCESS;
+}
+
+
+int main(int argc, char **argv)
+{
+    iac_cam_t cam;
+    iac_cam_frame_t image;
+    config_t config;
+    iac_image_frame_t frame;
+    iac_image_grid_t grid;
+    iac_image_view_t *views;
+    int resumed;
+
+    config = parse_args(argc, argv);
+    verbose = config.verbose;
+    if (config.trace && iac_trace_start(config.trace) == IAC_FAILURE)
+        return EXIT_FAILURE;
+    iac_image_init();
+    iac_rate_init(&rate, IAC_RATE_QUALITY_MIN, IAC_IMAGE_BLOB_QUALITY);
+    if (config.journal
+        && iac_journal_open(&journal, config.journal) == IAC_FAILURE)
+        return EXIT_FAILURE;
+
+    if (config.send) {
+        if (send_spool(&config) == IAC_FAILURE) {
+            fprintf(stderr, "Failed to send spool!\n");
+            return EXIT_FAILURE;
+        }
+        iac_journal_close(&journal);
+        iac_rate_destroy(&rate);
+        iac_image_term();
+        return EXIT_SUCCESS;
+    }
+
+    /* Only the frame saved in the journal is resumed */
+    if (config.resume) {
+        if (resume_tiles(&config, &resumed) == IAC_FAILURE)
+            return EXIT_FAILURE;
+        config.resume = 0;
+        if (resumed && config.frames <= 1) {
+            iac_journal_close(&journal);
+            iac_rate_destroy(&rate);
+            iac_image_term();
+            return EXIT_SUCCESS;
+        }
+    }
+
+    if (config.daemon) {
+        if (serve_daemon(&config) == IAC_FAILURE)
+            return EXIT_FAILURE;
+        iac_journal_close(&journal);
+        iac_rate_destroy(&rate);
+        iac_image_term();
+        return EXIT_SUCCESS;
+    }
+
+    if (config.frames > 1) {
+        if (stream_cam_images(&config) == IAC_FAILURE)
+            return EXIT_FAILURE;
+        iac_journal_close(&journal);
+        iac_rate_destroy(&rate);
+        iac_image_term();
+        return EXIT_SUCCESS;
+    }
+
+    if (!config.input) {
+        if (get_cam_image(&cam, &image, &config) == IAC_FAILURE)
+            return EXIT_FAILURE;
+        views = tile_cam_image(&frame, &image, &grid, &config);
+    }
+    else {
+        views = tile_file_image(&frame, &grid, &config);
+    }
+    if (!views) {
+        fprintf(stderr, "Failed to tile image!\n");
+        return EXIT_FAILURE;
+    }
+
+    if (process_tiles(&frame, views, &grid, &config) == IAC_FAILURE)
+        return EXIT_FAILURE;
+
+    free(views);
+    iac_image_frame_free(&frame);
 
     /* Terminate image */
+    iac_journal_close(&journal);
+    iac_rate_destroy(&rate);
     iac_image_term();
 
     if (!config.input) {
         /* Close camera */
-        if (iac_cam_close(&handle) == IAC_FAILURE) {
+        if (iac_cam_close(&cam) == IAC_FAILURE) {
             fprintf(stderr, "Unable to close camera!\n");
             return EXIT_FAILURE;
         }
@@ -23,18 +23,66 @@
 
 #define IAC_CAM_DEVICE                  0
 #define IAC_CAM_FORMAT                  XI_RGB24
+#define IAC_CAM_RAW_FORMAT              XI_RAW8
 #define IAC_CAM_ACQUIRE_TIMEOUT         5000
+#define IAC_CAM_BUFFERS                 4
+#define IAC_CAM_SIM_WIDTH               2592
+#define IAC_CAM_SIM_HEIGHT              1944
 #define IAC_IMAGE_FORMAT                "BGR"
 #define IAC_IMAGE_DEPTH                 8
+#define IAC_IMAGE_CHANNELS              3
 #define IAC_IMAGE_DIVS                  10
+#define IAC_IMAGE_TILES_MAX             1024
+#define IAC_IMAGE_GRID_CELL             16
+#define IAC_IMAGE_DETAIL_STEP           4
+#define IAC_IMAGE_STATS_CHUNK           16384
+#define IAC_BAYER_NONE                  0
+#define IAC_BAYER_RGGB                  1
+#define IAC_BAYER_GRBG                  2
+#define IAC_BAYER_GBRG                  3
+#define IAC_BAYER_BGGR                  4
+#define IAC_DEMOSAIC_BILINEAR           0
+#define IAC_DEMOSAIC_EDGE               1
+#define IAC_DEMOSAIC_GAIN_SHIFT         6
 #define IAC_IMAGE_BLOB_FORMAT           "JPG"
+#define IAC_IMAGE_BLOB_QUALITY          92
+#define IAC_RATE_QUALITY_MIN            10
+#define IAC_RATE_MARGIN                 95
+#define IAC_RATE_SLACK                  80
+#define IAC_ENCODER_MAGICK              0
+#define IAC_ENCODER_JPEG                1
+#define IAC_ORDER_RASTER                0
+#define IAC_ORDER_PRIORITY              1
+#define IAC_UNIFORM_DESCRIPTOR          0
+#define IAC_UNIFORM_SKIP                1
+#define IAC_TILE_ENCODED                0
+#define IAC_TILE_UNIFORM                1
+#define IAC_TILE_SKIPPED                2
+#define IAC_TILE_MANIFEST_HEADER        8
+#define IAC_TILE_MANIFEST_ENTRY         4
 #define IAC_SPI_MODE                    SPI_MODE_0
 #define IAC_SPI_BITS                    8
 #define IAC_SPI_MAX_HZ                  500000
+#define IAC_SPI_BATCH_MAX               25
+#define IAC_SPI_SIM_DEVICE              "sim"
 #define IAC_OBC_BLOCK_ACK               0x55
+#define IAC_OBC_REQUEST                 0x52
+#define IAC_OBC_REQUEST_WAIT            1000
+#define IAC_OBC_REQUESTS_MAX            64
 #define IAC_OBC_BLOCK_SIZE              155
 #define IAC_OBC_BLOCK_PADDING           0
 #define IAC_OBC_BLOCK_USLEEP            10000
+#define IAC_OBC_TILE_THUMBNAIL          0xffff
+#define IAC_OBC_TILE_MANIFEST           0xfffe
+#define IAC_OBC_WINDOW_MAX              256
+#define IAC_OBC_ACK_MIN_USLEEP          100
+#define IAC_OBC_ACK_MAX_USLEEP          IAC_OBC_BLOCK_USLEEP
+#define IAC_OBC_ACK_BLOCK_TIMEOUT       5000
+#define IAC_DAEMON_COMMAND_MAX          256
+#define IAC_RETAIN_FRAMES               8
+#define IAC_PIPELINE_DEPTH              8
+#define IAC_WRITER_DEPTH                16
+#define IAC_TRACE_EVENTS                65536
 
 /* Default values */
 #define IAC_SPI_DEFAULT_DEVICE          "/dev/spidev1.0"
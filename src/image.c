@@ -16,11 +16,25 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <wand/magick_wand.h>
 #include "iac.h"
 #include "image.h"
+#include "trace.h"
+
+typedef struct iac_image_rank_t {
+    uint64_t detail;
+    unsigned int index;
+} iac_image_rank_t;
 
 static MagickWand *iac_image_new(const iac_image_read_params_t *);
+static int iac_image_rank_compare(const void *, const void *);
 
 void iac_image_exception(const MagickWand *wand)
 {
@@ -91,6 +105,7 @@ MagickWand *iac_image_read_blob(const iac_image_read_params_t *params,
                                 const size_t data_size)
 {
     MagickWand *wand;
+    MagickBooleanType status;
 
     /* Create new wand */
     wand = iac_image_new(params);
@@ -98,7 +113,10 @@ MagickWand *iac_image_read_blob(const iac_image_read_params_t *params,
         return NULL;
 
     /* Read blob into wand */
-    if (MagickReadImageBlob(wand, data, data_size) == MagickFalse) {
+    IAC_TRACE_ENTER("image_read");
+    status = MagickReadImageBlob(wand, data, data_size);
+    IAC_TRACE_LEAVE("image_read");
+    if (status == MagickFalse) {
         iac_image_exception(wand);
         iac_image_destroy(wand);
         return NULL;
@@ -145,6 +163,8 @@ MagickWand ***iac_image_tiles(MagickWand *wand, const unsigned int divs)
     size_t height;
     unsigned int i, j;
 
+    IAC_TRACE_ENTER("image_crop");
+
     /* Calculate width and height of tile */
     width = MagickGetImageWidth(wand);
     width = width / divs + (width % divs ? 1 : 0);
@@ -177,10 +197,12 @@ MagickWand ***iac_image_tiles(MagickWand *wand, const unsigned int divs)
                     free(wands[i]);
                 }
                 free(wands);
+                IAC_TRACE_LEAVE("image_crop");
                 return NULL;
             }
         }
     }
+    IAC_TRACE_LEAVE("image_crop");
 
     return wands;
 }
@@ -212,7 +234,9 @@ unsigned char *iac_image_get_blob(MagickWand *wand, size_t *data_size)
     }
 
     /* Get image blob from wand */
+    IAC_TRACE_ENTER("image_encode");
     blob = MagickGetImageBlob(wand, data_size);
+    IAC_TRACE_LEAVE("image_encode");
     if (blob == NULL) {
         iac_image_exception(wand);
         return NULL;
@@ -220,3 +244,500 @@ unsigned char *iac_image_get_blob(MagickWand *wand, size_t *data_size)
 
     return blob;
 }
+
+
+/*
+ * Map raw image file as the frame, for its pages to be tiled and encoded
+ * straight from the page cache.  The whole file is prefetched at once,
+ * as tiles are read in bands across the frame rather than in file order.
+ */
+int iac_image_frame_file(iac_image_frame_t *frame,
+                         const iac_image_read_params_t *params,
+                         const char *filename)
+{
+    struct stat st;
+    size_t size;
+    void *map;
+    int fd;
+
+    memset(frame, 0, sizeof(*frame));
+    frame->width = params->width;
+    frame->height = params->height;
+    frame->stride = params->width * IAC_IMAGE_CHANNELS * params->depth / 8;
+    size = frame->stride * frame->height;
+
+    fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        perror("Unable to open image file");
+        return IAC_FAILURE;
+    }
+    if (fstat(fd, &st) == -1) {
+        perror("Unable to stat image file");
+        close(fd);
+        return IAC_FAILURE;
+    }
+    if (!size || (size_t) st.st_size != size) {
+        fprintf(stderr,
+                "Image file is %zu bytes instead of %zu for %zux%zu!\n",
+                (size_t) st.st_size,
+                size,
+                params->width,
+                params->height);
+        close(fd);
+        return IAC_FAILURE;
+    }
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Unable to map image file");
+        return IAC_FAILURE;
+    }
+    madvise(map, size, MADV_WILLNEED);
+    frame->map = map;
+    frame->map_size = size;
+    frame->data = map;
+
+    return IAC_SUCCESS;
+}
+
+
+void iac_image_frame_free(iac_image_frame_t *frame)
+{
+
+    if (frame->map)
+        munmap(frame->map, frame->map_size);
+    frame->map = NULL;
+    free(frame->buf);
+    frame->buf = NULL;
+    frame->data = NULL;
+
+}
+
+
+/* Grid of `rows' by `cols' tiles covering the frame */
+int iac_image_grid(iac_image_grid_t *grid,
+                   const iac_image_frame_t *frame,
+                   const unsigned int rows,
+                   const unsigned int cols)
+{
+
+    if (!rows || !cols
+        || rows > IAC_IMAGE_TILES_MAX
+        || cols > IAC_IMAGE_TILES_MAX
+        || rows * cols > IAC_IMAGE_TILES_MAX) {
+        fprintf(stderr,
+                "Grid must have between 1 and %u tiles!\n",
+                IAC_IMAGE_TILES_MAX);
+        return IAC_FAILURE;
+    }
+
+    /* Calculate width and height of tile */
+    grid->rows = rows;
+    grid->cols = cols;
+    grid->width = frame->width / cols + (frame->width % cols ? 1 : 0);
+    grid->height = frame->height / rows + (frame->height % rows ? 1 : 0);
+    if ((cols - 1) * grid->width >= frame->width
+        || (rows - 1) * grid->height >= frame->height) {
+        fprintf(stderr, "Image is too small for %u tiles!\n", rows * cols);
+        return IAC_FAILURE;
+    }
+
+    return IAC_SUCCESS;
+}
+
+
+/* Grid of tiles of `width' by `height' pixels covering the frame */
+int iac_image_grid_tiles(iac_image_grid_t *grid,
+                         const iac_image_frame_t *frame,
+                         const size_t width,
+                         const size_t height)
+{
+    size_t rows, cols;
+
+    if (!width || !height) {
+        fprintf(stderr, "Tile size must be positive!\n");
+        return IAC_FAILURE;
+    }
+    cols = frame->width / width + (frame->width % width ? 1 : 0);
+    rows = frame->height / height + (frame->height % height ? 1 : 0);
+    if (rows > IAC_IMAGE_TILES_MAX
+        || cols > IAC_IMAGE_TILES_MAX
+        || rows * cols > IAC_IMAGE_TILES_MAX) {
+        fprintf(stderr,
+                "Tiles of %zux%zu exceed %u in image!\n",
+                width,
+                height,
+                IAC_IMAGE_TILES_MAX);
+        return IAC_FAILURE;
+    }
+    grid->rows = (unsigned int) rows;
+    grid->cols = (unsigned int) cols;
+    grid->width = width;
+    grid->height = height;
+
+    return IAC_SUCCESS;
+}
+
+
+iac_image_view_t *iac_image_grid_views(const iac_image_frame_t *frame,
+                                       const iac_image_grid_t *grid)
+{
+    iac_image_view_t *views, *view;
+    unsigned int i, j;
+
+    views = malloc(sizeof(iac_image_view_t) * iac_image_grid_count(grid));
+    if (!views) {
+        perror("Unable to allocate tiles");
+        return NULL;
+    }
+
+    /* Describe tiles as windows into the frame, clipped at the edges */
+    for (i = 0; i < grid->rows; i++) {
+        for (j = 0; j < grid->cols; j++) {
+            view = &views[j + i * grid->cols];
+            view->data = frame->data
+                + i * grid->height * frame->stride
+                + j * grid->width * IAC_IMAGE_CHANNELS;
+            view->width = grid->width;
+            if ((j + 1) * grid->width > frame->width)
+                view->width = frame->width - j * grid->width;
+            view->height = grid->height;
+            if ((i + 1) * grid->height > frame->height)
+                view->height = frame->height - i * grid->height;
+            view->stride = frame->stride;
+        }
+    }
+
+    return views;
+}
+
+
+/*
+ * Release the pages of a band of tiles of a mapped frame once all its
+ * tiles are encoded, and prefetch the band after the next one, so that
+ * tiling the frame band by band keeps about two bands of it resident.
+ * Pages shared with the next band are kept.  Frames read into buffers of
+ * their own are left alone.
+ */
+void iac_image_band_done(const iac_image_frame_t *frame,
+                         const iac_image_grid_t *grid,
+                         const unsigned int band)
+{
+    const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    uint8_t *map = frame->map;
+    size_t start, end;
+
+    if (!map)
+        return;
+
+    start = band * grid->height * frame->stride;
+    end = (band + 1) * grid->height * frame->stride;
+    start -= start % page;
+    if (end < frame->map_size)
+        end -= end % page;
+    else
+        end = frame->map_size;
+    if (end > start)
+        madvise(map + start, end - start, MADV_DONTNEED);
+
+    if (band + 2 < grid->rows) {
+        start = (band + 2) * grid->height * frame->stride;
+        end = (band + 3) * grid->height * frame->stride;
+        if (end > frame->map_size)
+            end = frame->map_size;
+        start -= start % page;
+        madvise(map + start, end - start, MADV_WILLNEED);
+    }
+
+}
+
+
+iac_image_view_t *iac_image_views(const iac_image_frame_t *frame,
+                                  const unsigned int divs)
+{
+    iac_image_grid_t grid;
+
+    if (iac_image_grid(&grid, frame, divs, divs) == IAC_FAILURE)
+        return NULL;
+
+    return iac_image_grid_views(frame, &grid);
+}
+
+
+/*
+ * Downscale frame by averaging boxes of `scale' by `scale' pixels, into a
+ * new frame owning its buffer.
+ */
+int iac_image_thumbnail(iac_image_frame_t *thumb,
+                        const iac_image_frame_t *frame,
+                        const unsigned int scale)
+{
+    uint32_t *sums;
+    const unsigned char *src;
+    unsigned char *dst;
+    size_t x, y, r, c, k, row;
+
+    memset(thumb, 0, sizeof(*thumb));
+    thumb->width = frame->width / scale;
+    thumb->height = frame->height / scale;
+    if (!thumb->width || !thumb->height) {
+        fprintf(stderr, "Image is too small for thumbnail!\n");
+        return IAC_FAILURE;
+    }
+    thumb->stride = thumb->width * IAC_IMAGE_CHANNELS;
+
+    row = thumb->stride;
+    thumb->buf = malloc(row * thumb->height);
+    sums = malloc(row * sizeof(*sums));
+    if (!thumb->buf || !sums) {
+        perror("Unable to allocate thumbnail");
+        free(sums);
+        iac_image_frame_free(thumb);
+        return IAC_FAILURE;
+    }
+
+    IAC_TRACE_ENTER("image_thumbnail");
+    dst = thumb->buf;
+    for (y = 0; y < thumb->height; y++, dst += row) {
+        memset(sums, 0, row * sizeof(*sums));
+        for (r = 0; r < scale; r++) {
+            src = frame->data + (y * scale + r) * frame->stride;
+            for (x = 0; x < thumb->width; x++)
+                for (c = 0; c < scale * IAC_IMAGE_CHANNELS; c++)
+                    sums[x * IAC_IMAGE_CHANNELS + c % IAC_IMAGE_CHANNELS]
+                        += *src++;
+        }
+        for (k = 0; k < row; k++)
+            dst[k] = (unsigned char) (sums[k] / (scale * scale));
+    }
+    IAC_TRACE_LEAVE("image_thumbnail");
+    free(sums);
+    thumb->data = thumb->buf;
+
+    return IAC_SUCCESS;
+}
+
+
+/*
+ * Estimate detail of a tile as the gradient energy of its green channel,
+ * sampled on a sparse grid.  Uniform tiles score zero.
+ */
+uint64_t iac_image_view_detail(const iac_image_view_t *view)
+{
+    const unsigned int step = IAC_IMAGE_DETAIL_STEP;
+    const unsigned char *p;
+    uint64_t detail = 0;
+    size_t x, y;
+    int g;
+
+    for (y = 0; y + step < view->height; y += step) {
+        p = view->data + y * view->stride + 1;
+        for (x = 0; x + step < view->width; x += step) {
+            g = p[x * IAC_IMAGE_CHANNELS];
+            detail += (uint64_t) abs(p[(x + step) * IAC_IMAGE_CHANNELS] - g);
+            detail += (uint64_t) abs(p[x * IAC_IMAGE_CHANNELS
+                                       + step * view->stride] - g);
+        }
+    }
+
+    return detail;
+}
+
+
+/*
+ * Detail of the whole frame, sampled as by iac_image_view_detail(), summed
+ * into cells of `cell' by `cell' pixels in raster order.  The detail of a
+ * tile made of whole cells is the sum of its cells.
+ */
+void iac_image_frame_detail(const iac_image_frame_t *frame,
+                            const size_t cell,
+                            uint64_t *cells)
+{
+    const unsigned int step = IAC_IMAGE_DETAIL_STEP;
+    const size_t cols = (frame->width + cell - 1) / cell;
+    const size_t rows = (frame->height + cell - 1) / cell;
+    const unsigned char *p;
+    uint64_t *row;
+    size_t x, y;
+    int g;
+
+    memset(cells, 0, rows * cols * sizeof(*cells));
+    for (y = 0; y + step < frame->height; y += step) {
+        p = frame->data + y * frame->stride + 1;
+        row = cells + y / cell * cols;
+        for (x = 0; x + step < frame->width; x += step) {
+            g = p[x * IAC_IMAGE_CHANNELS];
+            row[x / cell] +=
+                (uint64_t) abs(p[(x + step) * IAC_IMAGE_CHANNELS] - g)
+                + (uint64_t) abs(p[x * IAC_IMAGE_CHANNELS
+                                   + step * frame->stride] - g);
+        }
+    }
+
+}
+
+
+/*
+ * Per channel minimum, maximum, mean and variance of a tile in a single
+ * pass.  Rows are summed in chunks into 32-bit accumulators without any
+ * dependency between pixels, so that the compiler can vectorize the loop
+ * over the interleaved channels.
+ */
+void iac_image_view_stats(const iac_image_view_t *view,
+                          iac_image_stats_t *stats)
+{
+    const size_t chunk = IAC_IMAGE_STATS_CHUNK;
+    const unsigned char *p;
+    uint64_t sum[IAC_IMAGE_CHANNELS] = { 0 };
+    uint64_t squares[IAC_IMAGE_CHANNELS] = { 0 };
+    uint32_t s0, s1, s2, q0, q1, q2;
+    uint8_t min0 = UINT8_MAX, min1 = UINT8_MAX, min2 = UINT8_MAX;
+    uint8_t max0 = 0, max1 = 0, max2 = 0;
+    size_t n = view->width * view->height, x, y, i, end;
+    double mean;
+    unsigned int c;
+
+    memset(stats, 0, sizeof(*stats));
+    if (!n)
+        return;
+
+    for (y = 0; y < view->height; y++) {
+        p = view->data + y * view->stride;
+        for (x = 0; x < view->width; x = end) {
+            end = x + chunk < view->width ? x + chunk : view->width;
+            s0 = s1 = s2 = 0;
+            q0 = q1 = q2 = 0;
+            for (i = x; i < end; i++) {
+                s0 += p[3 * i];
+                s1 += p[3 * i + 1];
+                s2 += p[3 * i + 2];
+                q0 += (uint32_t) p[3 * i] * p[3 * i];
+                q1 += (uint32_t) p[3 * i + 1] * p[3 * i + 1];
+                q2 += (uint32_t) p[3 * i + 2] * p[3 * i + 2];
+                min0 = p[3 * i] < min0 ? p[3 * i] : min0;
+                min1 = p[3 * i + 1] < min1 ? p[3 * i + 1] : min1;
+                min2 = p[3 * i + 2] < min2 ? p[3 * i + 2] : min2;
+                max0 = p[3 * i] > max0 ? p[3 * i] : max0;
+                max1 = p[3 * i + 1] > max1 ? p[3 * i + 1] : max1;
+                max2 = p[3 * i + 2] > max2 ? p[3 * i + 2] : max2;
+            }
+            sum[0] += s0;
+            sum[1] += s1;
+            sum[2] += s2;
+            squares[0] += q0;
+            squares[1] += q1;
+            squares[2] += q2;
+        }
+    }
+
+    stats->min[0] = min0;
+    stats->min[1] = min1;
+    stats->min[2] = min2;
+    stats->max[0] = max0;
+    stats->max[1] = max1;
+    stats->max[2] = max2;
+    for (c = 0; c < IAC_IMAGE_CHANNELS; c++) {
+        mean = (double) sum[c] / (double) n;
+        stats->mean[c] = (uint8_t) (mean + 0.5);
+        stats->variance[c] = (uint32_t) ((double) squares[c] / (double) n
+                                         - mean * mean + 0.5);
+    }
+
+}
+
+
+static int iac_image_rank_compare(const void *a, const void *b)
+{
+    const iac_image_rank_t *x = a, *y = b;
+
+    if (x->detail != y->detail)
+        return x->detail < y->detail ? 1 : -1;
+
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+
+/* Fill order with indices of views by descending detail */
+int iac_image_views_rank(const iac_image_view_t *views,
+                         const unsigned int count,
+                         unsigned int *order)
+{
+    iac_image_rank_t *ranks;
+    unsigned int k;
+
+    ranks = malloc(count * sizeof(*ranks));
+    if (!ranks) {
+        perror("Unable to allocate tile ranks");
+        return IAC_FAILURE;
+    }
+
+    IAC_TRACE_ENTER("image_rank");
+    for (k = 0; k < count; k++) {
+        ranks[k].detail = iac_image_view_detail(&views[k]);
+        ranks[k].index = k;
+    }
+    qsort(ranks, count, sizeof(*ranks), iac_image_rank_compare);
+    for (k = 0; k < count; k++)
+        order[k] = ranks[k].index;
+    IAC_TRACE_LEAVE("image_rank");
+    free(ranks);
+
+    return IAC_SUCCESS;
+}
+
+
+MagickWand *iac_image_view_wand(const iac_image_view_t *view)
+{
+    MagickWand *wand;
+    unsigned char *pixels;
+    size_t row, size, y;
+    iac_image_read_params_t params = {
+        view->width,
+        view->height,
+        IAC_IMAGE_FORMAT,
+        IAC_IMAGE_DEPTH,
+    };
+
+    /* Tile rows are contiguous only for full width tiles */
+    row = view->width * IAC_IMAGE_CHANNELS;
+    size = row * view->height;
+    if (row == view->stride)
+        return iac_image_read_blob(&params, view->data, size);
+
+    /* Gather tile rows */
+    pixels = malloc(size);
+    if (!pixels) {
+        perror("Unable to allocate tile");
+        return NULL;
+    }
+    for (y = 0; y < view->height; y++)
+        memcpy(pixels + y * row, view->data + y * view->stride, row);
+
+    wand = iac_image_read_blob(&params, pixels, size);
+    free(pixels);
+
+    return wand;
+}
+
+
+unsigned char *iac_image_view_get_blob(const iac_image_view_t *view,
+                                       const int quality,
+                                       size_t *data_size)
+{
+    MagickWand *wand;
+    unsigned char *blob;
+
+    wand = iac_image_view_wand(view);
+    if (!wand)
+        return NULL;
+    if (MagickSetImageCompressionQuality(wand, (size_t) quality)
+        == MagickFalse) {
+        iac_image_exception(wand);
+        iac_image_destroy(wand);
+        return NULL;
+    }
+    blob = iac_image_get_blob(wand, data_size);
+    iac_image_destroy(wand);
+
+    return blob;
+}
@@ -25,6 +25,40 @@ typedef struct iac_image_read_params_t {
     size_t depth;
 } iac_image_read_params_t;
 
+typedef struct iac_image_frame_t {
+    const unsigned char *data;
+    size_t width;
+    size_t height;
+    size_t stride;
+    unsigned char *buf;
+    void *map;
+    size_t map_size;
+} iac_image_frame_t;
+
+typedef struct iac_image_view_t {
+    const unsigned char *data;
+    size_t width;
+    size_t height;
+    size_t stride;
+} iac_image_view_t;
+
+/* Tiles of `width' by `height' pixels, clipped at the frame edges */
+typedef struct iac_image_grid_t {
+    unsigned int rows;
+    unsigned int cols;
+    size_t width;
+    size_t height;
+} iac_image_grid_t;
+
+#define iac_image_grid_count(grid) ((grid)->rows * (grid)->cols)
+
+typedef struct iac_image_stats_t {
+    uint8_t min[IAC_IMAGE_CHANNELS];
+    uint8_t max[IAC_IMAGE_CHANNELS];
+    uint8_t mean[IAC_IMAGE_CHANNELS];
+    uint32_t variance[IAC_IMAGE_CHANNELS];
+} iac_image_stats_t;
+
 void iac_image_exception(const MagickWand *);
 void iac_image_init(void);
 void iac_image_term(void);
@@ -37,5 +71,39 @@ MagickWand *iac_image_read_blob(const iac_image_read_params_t *,
 MagickWand *iac_image_read_file(const iac_image_read_params_t *,
                                 const char *);
 unsigned char *iac_image_get_blob(MagickWand *, size_t *);
+int iac_image_frame_file(iac_image_frame_t *,
+                         const iac_image_read_params_t *,
+                         const char *);
+void iac_image_frame_free(iac_image_frame_t *);
+int iac_image_grid(iac_image_grid_t *,
+                   const iac_image_frame_t *,
+                   const unsigned int,
+                   const unsigned int);
+int iac_image_grid_tiles(iac_image_grid_t *,
+                         const iac_image_frame_t *,
+                         const size_t,
+                         const size_t);
+iac_image_view_t *iac_image_grid_views(const iac_image_frame_t *,
+                                       const iac_image_grid_t *);
+void iac_image_band_done(const iac_image_frame_t *,
+                         const iac_image_grid_t *,
+                         const unsigned int);
+iac_image_view_t *iac_image_views(const iac_image_frame_t *,
+                                  const unsigned int);
+int iac_image_thumbnail(iac_image_frame_t *,
+                        const iac_image_frame_t *,
+                        const unsigned int);
+uint64_t iac_image_view_detail(const iac_image_view_t *);
+void iac_image_frame_detail(const iac_image_frame_t *,
+                            const size_t,
+                            uint64_t *);
+void iac_image_view_stats(const iac_image_view_t *, iac_image_stats_t *);
+int iac_image_views_rank(const iac_image_view_t *,
+                         const unsigned int,
+                         unsigned int *);
+MagickWand *iac_image_view_wand(const iac_image_view_t *);
+unsigned char *iac_image_view_get_blob(const iac_image_view_t *,
+                                       const int,
+                                       size_t *);
 
 #endif
@@ -0,0 +1,410 @@
+/*
+ * Copyright (C) 2016 Libre Space Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <wand/magick_wand.h>
+#include "iac.h"
+#include "image.h"
+#include "utils.h"
+#include "journal.h"
+
+/*
+ * Resumable transfer journal.  The frame being sent is saved raw next to
+ * the journal and every encoded tile is stored before its first block
+ * is sent, so that an interrupted transfer resumes from the block where
+ * it stopped without capturing or encoding again.
+ *
+ * The journal is a shared mapping updated with ordered stores and only
+ * scheduled for writeback, with no sync per block.  Saved frame and tiles
+ * are checked against their checksums when loaded instead, and anything
+ * that did not reach storage is done again.
+ */
+
+#define iac_journal_store_u32(p, v) \
+        __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static int iac_journal_write(const char *,
+                             const unsigned char *,
+                             const size_t,
+                             const size_t,
+                             const size_t);
+static unsigned char *iac_journal_read(const char *, const size_t);
+static void iac_journal_sync(iac_journal_t *);
+
+int iac_journal_open(iac_journal_t *journal, const char *dir)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    void *map;
+
+    snprintf(path, PATH_MAX, "%s/journal", dir);
+    journal->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (journal->fd == -1) {
+        perror("Unable to open journal");
+        return IAC_FAILURE;
+    }
+    if (fstat(journal->fd, &st) == -1
+        || ((size_t) st.st_size < sizeof(iac_journal_state_t)
+            && ftruncate(journal->fd,
+                         (off_t) sizeof(iac_journal_state_t)) == -1)) {
+        perror("Unable to size journal");
+        close(journal->fd);
+        return IAC_FAILURE;
+    }
+    map = mmap(NULL,
+               sizeof(iac_journal_state_t),
+               PROT_READ | PROT_WRITE,
+               MAP_SHARED,
+               journal->fd,
+               0);
+    if (map == MAP_FAILED) {
+        perror("Unable to map journal");
+        close(journal->fd);
+        return IAC_FAILURE;
+    }
+    journal->state = map;
+    journal->dir = strdup(dir);
+
+    /* Start over a journal of another version */
+    if (journal->state->magic != IAC_JOURNAL_MAGIC
+        || journal->state->version != IAC_JOURNAL_VERSION) {
+        memset(journal->state, 0, sizeof(*journal->state));
+        journal->state->magic = IAC_JOURNAL_MAGIC;
+        journal->state->version = IAC_JOURNAL_VERSION;
+        iac_journal_sync(journal);
+    }
+
+    return IAC_SUCCESS;
+}
+
+
+void iac_journal_close(iac_journal_t *journal)
+{
+
+    if (!journal->state)
+        return;
+    msync(journal->state, sizeof(*journal->state), MS_SYNC);
+    munmap(journal->state, sizeof(*journal->state));
+    close(journal->fd);
+    free(journal->dir);
+    journal->state = NULL;
+
+}
+
+
+/* Schedule writeback of the journal without waiting for it */
+static void iac_journal_sync(iac_journal_t *journal)
+{
+
+    msync(journal->state, sizeof(*journal->state), MS_ASYNC);
+
+}
+
+
+/* Write `rows' of `row' bytes, `stride' bytes apart, to file */
+static int iac_journal_write(const char *path,
+                             const unsigned char *data,
+                             const size_t row,
+                             const size_t rows,
+                             const size_t stride)
+{
+    size_t y;
+    int fd;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("Unable to open journal file");
+        return IAC_FAILURE;
+    }
+    for (y = 0; y < rows; y++) {
+        if (write(fd, data + y * stride, row) != (ssize_t) row) {
+            perror("Unable to write journal file");
+            close(fd);
+            return IAC_FAILURE;
+        }
+    }
+    close(fd);
+
+    return IAC_SUCCESS;
+}
+
+
+static unsigned char *iac_journal_read(const char *path, const size_t size)
+{
+    unsigned char *data;
+    ssize_t n;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("Unable to open journal file");
+        return NULL;
+    }
+    data = malloc(size ? size : 1);
+    if (!data) {
+        perror("Unable to allocate journal file");
+        close(fd);
+        return NULL;
+    }
+    n = read(fd, data, size);
+    close(fd);
+    if (n != (ssize_t) size) {
+        fprintf(stderr, "Journal file %s is truncated!\n", path);
+        free(data);
+        return NULL;
+    }
+
+    return data;
+}
+
+
+/* Load frame of an interrupted transfer */
+int iac_journal_frame(iac_journal_t *journal, iac_image_frame_t *frame)
+{
+    const iac_journal_state_t *state = journal->state;
+    char path[PATH_MAX];
+    size_t size;
+
+    if (state->state != IAC_JOURNAL_ACTIVE)
+        return IAC_FAILURE;
+
+    memset(frame, 0, sizeof(*frame));
+    snprintf(path, PATH_MAX, "%s/frame.raw", journal->dir);
+    size = (size_t) state->width * state->height * IAC_IMAGE_CHANNELS;
+    frame->buf = iac_journal_read(path, size);
+    if (!frame->buf)
+        return IAC_FAILURE;
+    if (iac_crc32c(frame->buf, size) != state->crc) {
+        fprintf(stderr, "Journal frame %u is corrupted!\n", state->frame);
+        free(frame->buf);
+        frame->buf = NULL;
+        return IAC_FAILURE;
+    }
+    frame->data = frame->buf;
+    frame->width = state->width;
+    frame->height = state->height;
+    frame->stride = state->width * IAC_IMAGE_CHANNELS;
+
+    return IAC_SUCCESS;
+}
+
+
+/* Grid the journaled frame was cut with */
+void iac_journal_grid(const iac_journal_t *journal, iac_image_grid_t *grid)
+{
+    const iac_journal_state_t *state = journal->state;
+
+    grid->rows = state->rows;
+    grid->cols = state->cols;
+    grid->width = state->tile_width;
+    grid->height = state->tile_height;
+}
+
+
+/* Save frame and record its grid and tiles in transfer order */
+int iac_journal_begin(iac_journal_t *journal,
+                      const iac_image_frame_t *frame,
+                      const iac_image_grid_t *grid,
+                      const unsigned int *tiles,
+                      const unsigned int count)
+{
+    iac_journal_state_t *state = journal->state;
+    const size_t row = frame->width * IAC_IMAGE_CHANNELS;
+    char path[PATH_MAX];
+    uint32_t crc = 0;
+    unsigned int k;
+    size_t y;
+    int ret;
+
+    if (count > IAC_JOURNAL_TILES) {
+        fprintf(stderr, "Too many tiles to journal!\n");
+        return IAC_FAILURE;
+    }
+    iac_journal_store_u32(&state->state, IAC_JOURNAL_IDLE);
+
+    /* Frame is saved packed, whatever its stride */
+    snprintf(path, PATH_MAX, "%s/frame.raw", journal->dir);
+    if (frame->stride == row)
+        ret = iac_journal_write(path,
+                                frame->data,
+                                row * frame->height,
+                                1,
+                                0);
+    else
+        ret = iac_journal_write(path,
+                                frame->data,
+                                row,
+                                frame->height,
+                                frame->stride);
+    if (ret == IAC_FAILURE)
+        return IAC_FAILURE;
+    for (y = 0; y < frame->height; y++)
+        crc = iac_crc32c_update(crc, frame->data + y * frame->stride, row);
+
+    state->frame++;
+    state->width = (uint32_t) frame->width;
+    state->height = (uint32_t) frame->height;
+    state->rows = grid->rows;
+    state->cols = grid->cols;
+    state->tile_width = (uint32_t) grid->width;
+    state->tile_height = (uint32_t) grid->height;
+    state->crc = crc;
+    state->count = count;
+    state->position = 0;
+    memset(state->tiles, 0, sizeof(state->tiles));
+    for (k = 0; k < count; k++)
+        state->tiles[k].tile = tiles[k];
+    iac_journal_store_u32(&state->state, IAC_JOURNAL_ACTIVE);
+    iac_journal_sync(journal);
+
+    return IAC_SUCCESS;
+}
+
+
+/* Check that the journal holds the same grid and tiles in the same order */
+int iac_journal_match(const iac_journal_t *journal,
+                      const iac_image_grid_t *grid,
+                      const unsigned int *tiles,
+                      const unsigned int count)
+{
+    const iac_journal_state_t *state = journal->state;
+    unsigned int k;
+
+    if (state->state != IAC_JOURNAL_ACTIVE
+        || state->count != count
+        || state->rows != grid->rows
+        || state->cols != grid->cols
+        || state->tile_width != grid->width
+        || state->tile_height != grid->height)
+        return IAC_FAILURE;
+    for (k = 0; k < count; k++)
+        if (state->tiles[k].tile != tiles[k])
+            return IAC_FAILURE;
+
+    return IAC_SUCCESS;
+}
+
+
+/*
+ * Store encoded tile at position.  The tile is published only once its
+ * blob is written, and checked against the checksum when loaded.
+ */
+int iac_journal_store(iac_journal_t *journal,
+                      const unsigned int position,
+                      const unsigned char *blob,
+                      const size_t size)
+{
+    iac_journal_tile_t *entry = &journal->state->tiles[position];
+    char path[PATH_MAX];
+
+    iac_journal_store_u32(&entry->size, 0);
+    snprintf(path,
+             PATH_MAX,
+             "%s/tile-%u.%s",
+             journal->dir,
+             entry->tile,
+             IAC_IMAGE_BLOB_FORMAT);
+    if (iac_journal_write(path, blob, size, 1, size) == IAC_FAILURE)
+        return IAC_FAILURE;
+    iac_journal_store_u32(&entry->crc, iac_crc32c(blob, size));
+    iac_journal_store_u32(&entry->size, (uint32_t) size);
+
+    return IAC_SUCCESS;
+}
+
+
+/* Load stored tile at position, or NULL if it was never stored intact */
+unsigned char *iac_journal_load(const iac_journal_t *journal,
+                                const unsigned int position,
+                                size_t *size)
+{
+    const iac_journal_tile_t *entry = &journal->state->tiles[position];
+    char path[PATH_MAX];
+    unsigned char *blob;
+
+    if (!entry->size)
+        return NULL;
+    snprintf(path,
+             PATH_MAX,
+             "%s/tile-%u.%s",
+             journal->dir,
+             entry->tile,
+             IAC_IMAGE_BLOB_FORMAT);
+    blob = iac_journal_read(path, entry->size);
+    if (!blob)
+        return NULL;
+    if (iac_crc32c(blob, entry->size) != entry->crc) {
+        fprintf(stderr, "Journal tile %u is corrupted!\n", entry->tile);
+        free(blob);
+        return NULL;
+    }
+    *size = entry->size;
+
+    return blob;
+}
+
+
+/* Start sending tile at position, of which `acked' blocks are done */
+void iac_journal_start(iac_journal_t *journal,
+                       const unsigned int position,
+                       const size_t blocks,
+                       const size_t acked)
+{
+    iac_journal_tile_t *entry;
+
+    if (!journal->state)
+        return;
+    entry = &journal->state->tiles[position];
+    iac_journal_store_u32(&entry->acked, (uint32_t) acked);
+    iac_journal_store_u32(&entry->blocks, (uint32_t) blocks);
+    iac_journal_store_u32(&journal->state->position, position);
+
+}
+
+
+/* Record leading blocks of the current tile acknowledged by the OBC */
+void iac_journal_acked(iac_journal_t *journal, const size_t acked)
+{
+    iac_journal_tile_t *entry;
+
+    if (!journal->state)
+        return;
+    entry = &journal->state->tiles[journal->state->position];
+    iac_journal_store_u32(&entry->acked, (uint32_t) acked);
+    if (acked >= entry->blocks)
+        iac_journal_sync(journal);
+
+}
+
+
+void iac_journal_end(iac_journal_t *journal)
+{
+
+    if (!journal->state)
+        return;
+    iac_journal_store_u32(&journal->state->state, IAC_JOURNAL_IDLE);
+    iac_journal_sync(journal);
+
+}
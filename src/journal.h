@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2016 Libre Space Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __JOURNAL_H
+#define __JOURNAL_H
+
+#define IAC_JOURNAL_MAGIC               0x4a434149
+#define IAC_JOURNAL_VERSION             2
+#define IAC_JOURNAL_TILES               (IAC_IMAGE_TILES_MAX + 2)
+
+/* State of a frame in the journal */
+#define IAC_JOURNAL_IDLE                0
+#define IAC_JOURNAL_ACTIVE              1
+
+typedef struct iac_journal_tile_t {
+    uint32_t tile;
+    uint32_t blocks;
+    uint32_t acked;
+    uint32_t size;
+    uint32_t crc;
+} iac_journal_tile_t;
+
+/*
+ * Journal as mapped from file.  The grid the frame was cut with is kept
+ * so that a resumed transfer tiles it alike.  Each tile of the frame is
+ * recorded in transfer order with its number of blocks, the number of
+ * leading blocks acknowledged by the OBC, and the size and checksum of
+ * its stored blob.
+ */
+typedef struct iac_journal_state_t {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t state;
+    uint32_t frame;
+    uint32_t width;
+    uint32_t height;
+    uint32_t rows;
+    uint32_t cols;
+    uint32_t tile_width;
+    uint32_t tile_height;
+    uint32_t crc;
+    uint32_t count;
+    uint32_t position;
+    iac_journal_tile_t tiles[IAC_JOURNAL_TILES];
+} iac_journal_state_t;
+
+typedef struct iac_journal_t {
+    char *dir;
+    int fd;
+    iac_journal_state_t *state;
+} iac_journal_t;
+
+int iac_journal_open(iac_journal_t *, const char *);
+void iac_journal_close(iac_journal_t *);
+int iac_journal_frame(iac_journal_t *, iac_image_frame_t *);
+void iac_journal_grid(const iac_journal_t *, iac_image_grid_t *);
+int iac_journal_begin(iac_journal_t *,
+                      const iac_image_frame_t *,
+                      const iac_image_grid_t *,
+                      const unsigned int *,
+                      const unsigned int);
+int iac_journal_match(const iac_journal_t *,
+                      const iac_image_grid_t *,
+                      const unsigned int *,
+                      const unsigned int);
+int iac_journal_store(iac_journal_t *,
+                      const unsigned int,
+                      const unsigned char *,
+                      const size_t);
+unsigned char *iac_journal_load(const iac_journal_t *,
+                                const unsigned int,
+                                size_t *);
+void iac_journal_start(iac_journal_t *,
+                       const unsigned int,
+                       const size_t,
+                       const size_t);
+void iac_journal_acked(iac_journal_t *, const size_t);
+void iac_journal_end(iac_journal_t *);
+
+#endif
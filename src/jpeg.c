@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2016 Libre Space Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+#include <wand/magick_wand.h>
+#include "iac.h"
+#include "image.h"
+#include "jpeg.h"
+#include "trace.h"
+
+typedef struct iac_jpeg_error_t {
+    struct jpeg_error_mgr mgr;
+    jmp_buf env;
+} iac_jpeg_error_t;
+
+static void iac_jpeg_error_exit(j_common_ptr);
+
+static void iac_jpeg_error_exit(j_common_ptr cinfo)
+{
+    iac_jpeg_error_t *error = (iac_jpeg_error_t *) cinfo->err;
+
+    (*cinfo->err->output_message)(cinfo);
+    longjmp(error->env, 1);
+}
+
+
+/*
+ * Compress tile rows straight from the frame.  libjpeg-turbo reads BGR
+ * natively and uses its SIMD colour conversion and DCT.
+ */
+unsigned char *iac_jpeg_encode(const iac_image_view_t *view,
+                               const int quality,
+                               size_t *data_size)
+{
+    struct jpeg_compress_struct cinfo;
+    iac_jpeg_error_t error;
+    unsigned char *blob = NULL;
+    unsigned long size = 0;
+    JSAMPROW row;
+    int i;
+
+    IAC_TRACE_ENTER("jpeg_encode");
+    cinfo.err = jpeg_std_error(&error.mgr);
+    error.mgr.error_exit = iac_jpeg_error_exit;
+    if (setjmp(error.env)) {
+        jpeg_destroy_compress(&cinfo);
+        free(blob);
+        IAC_TRACE_LEAVE("jpeg_encode");
+        return NULL;
+    }
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &blob, &size);
+
+    cinfo.image_width = (JDIMENSION) view->width;
+    cinfo.image_height = (JDIMENSION) view->height;
+    cinfo.input_components = IAC_IMAGE_CHANNELS;
+    cinfo.in_color_space = JCS_EXT_BGR;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    cinfo.optimize_coding = TRUE;
+
+    /* No chroma subsampling at high quality, as ImageMagick does */
+    if (quality >= 90)
+        for (i = 0; i < cinfo.num_components; i++) {
+            cinfo.comp_info[i].h_samp_factor = 1;
+            cinfo.comp_info[i].v_samp_factor = 1;
+        }
+
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        /* libjpeg does not write to input rows */
+        row = (JSAMPROW) (uintptr_t)
+            (view->data + cinfo.next_scanline * view->stride);
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    IAC_TRACE_LEAVE("jpeg_encode");
+
+    *data_size = (size_t) size;
+
+    return blob;
+}
+
+
+void iac_jpeg_free(unsigned char *blob)
+{
+
+    free(blob);
+
+}
@@ -15,33 +15,530 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <sys/types.h>
+#include <arpa/inet.h>
 #include "iac.h"
 #include "utils.h"
 #include "obc.h"
 
+static uint8_t *iac_obc_checksum(const int,
+                                 const uint8_t *,
+                                 const size_t,
+                                 uint8_t *);
+static uint8_t *iac_obc_tile_encode(const int, uint8_t *, const uint16_t);
+static size_t iac_obc_tile_decode(const int, const uint8_t *, uint16_t *);
+static int iac_obc_packets_reserve(iac_obc_packets_t *, const size_t);
+static void iac_obc_header_encode(iac_obc_packets_t *,
+                                  const uint16_t,
+                                  const uint16_t,
+                                  const uint8_t *);
+
+size_t iac_obc_checksum_size(const int checksum)
+{
+
+    switch (checksum & ~IAC_OBC_WIDE) {
+    case IAC_OBC_CHECKSUM_CRC16:
+        return sizeof(uint16_t);
+    case IAC_OBC_CHECKSUM_CRC32C:
+        return sizeof(uint32_t);
+    default:
+        return sizeof(uint8_t);
+    }
+}
+
+
+size_t iac_obc_packet_size(const int checksum)
+{
+
+    return IAC_OBC_BLOCK_SIZE + 2 + iac_obc_tile_size(checksum)
+        + iac_obc_checksum_size(checksum);
+}
+
+
+size_t iac_obc_status_size(const int checksum)
+{
+
+    return IAC_OBC_WINDOW_MAX / 8 + 3 + iac_obc_tile_size(checksum)
+        + iac_obc_checksum_size(checksum);
+}
+
+
+/* Pack tile id in one or two bytes */
+static uint8_t *iac_obc_tile_encode(const int checksum,
+                                    uint8_t *buf,
+                                    const uint16_t tile)
+{
+
+    if (iac_obc_wide(checksum))
+        return iac_pack_short(buf, tile);
+    return iac_pack(buf, (uint8_t) tile);
+}
+
+
+/* Unpack tile id, returning its size */
+static size_t iac_obc_tile_decode(const int checksum,
+                                  const uint8_t *buf,
+                                  uint16_t *tile)
+{
+    uint16_t value;
+
+    if (iac_obc_wide(checksum)) {
+        memcpy(&value, buf, sizeof(value));
+        *tile = ntohs(value);
+        return sizeof(value);
+    }
+    *tile = buf[0] < IAC_OBC_TILES_NARROW ? buf[0] : 0xff00 | buf[0];
+
+    return 1;
+}
+
+
+/* Pack checksum of `size' bytes of data */
+static uint8_t *iac_obc_checksum(const int checksum,
+                                 const uint8_t *data,
+                                 const size_t size,
+                                 uint8_t *buf)
+{
+
+    switch (checksum & ~IAC_OBC_WIDE) {
+    case IAC_OBC_CHECKSUM_CRC16:
+        return iac_pack_short(buf, iac_crc16(data, size));
+    case IAC_OBC_CHECKSUM_CRC32C:
+        return iac_pack_long(buf, iac_crc32c(data, size));
+    default:
+        return iac_pack(buf, iac_lrc(data, size));
+    }
+}
+
+
 iac_obc_packet_t iac_obc_packet(const iac_obc_block_t *block)
 {
     iac_obc_packet_t packet;
 
-    packet.buf = NULL;
     packet.size = 0;
-    packet.buf = iac_serialize(packet.buf, &packet.size, block->tile);
-    packet.buf = iac_serialize_short(packet.buf, &packet.size, block->index);
-    packet.buf = iac_serialize_data(packet.buf,
-                                    &packet.size,
-                                    block->data,
-                                    block->data_size);
-    if (block->data_size < IAC_OBC_BLOCK_SIZE)
-        packet.buf = iac_serialize_pad(packet.buf,
-                                       &packet.size,
-                                       IAC_OBC_BLOCK_PADDING,
-                                       IAC_OBC_BLOCK_SIZE - block->data_size);
-    packet.buf = iac_serialize(packet.buf,
-                               &packet.size,
-                               iac_lrc(packet.buf, packet.size));
+    packet.buf = malloc(IAC_OBC_PACKET_SIZE);
+    if (packet.buf)
+        packet.size = iac_obc_packet_encode(block,
+                                            IAC_OBC_CHECKSUM_LRC,
+                                            packet.buf);
 
     return packet;
 }
+
+
+size_t iac_obc_packet_encode(const iac_obc_block_t *block,
+                             const int checksum,
+                             uint8_t *buf)
+{
+    uint8_t *p = buf;
+
+    p = iac_obc_tile_encode(checksum, p, block->tile);
+    p = iac_pack_short(p, block->index);
+    p = iac_pack_data(p, block->data, block->data_size);
+    if (block->data_size < IAC_OBC_BLOCK_SIZE)
+        p = iac_pack_pad(p,
+                         IAC_OBC_BLOCK_PADDING,
+                         IAC_OBC_BLOCK_SIZE - block->data_size);
+    p = iac_obc_checksum(checksum, buf, (size_t) (p - buf), p);
+
+    return (size_t) (p - buf);
+}
+
+
+/*
+ * Decode packet as received by the OBC.  Block data points into the
+ * packet and includes any padding.
+ */
+int iac_obc_packet_decode(iac_obc_block_t *block,
+                          const uint8_t *buf,
+                          const int checksum)
+{
+    uint16_t index;
+    uint8_t trailer[IAC_OBC_CHECKSUM_SIZE_MAX];
+    size_t size, trailer_size, k;
+
+    trailer_size = iac_obc_checksum_size(checksum);
+    size = iac_obc_packet_size(checksum) - trailer_size;
+    iac_obc_checksum(checksum, buf, size, trailer);
+    if (memcmp(trailer, buf + size, trailer_size))
+        return IAC_FAILURE;
+
+    k = iac_obc_tile_decode(checksum, buf, &block->tile);
+    memcpy(&index, buf + k, sizeof(index));
+    block->index = ntohs(index);
+    block->data = buf + k + 2;
+    block->data_size = IAC_OBC_BLOCK_SIZE;
+
+    return IAC_SUCCESS;
+}
+
+
+void iac_obc_packets_init(iac_obc_packets_t *packets, const int checksum)
+{
+
+    packets->buf = NULL;
+    packets->count = 0;
+    packets->capacity = 0;
+    packets->size = iac_obc_packet_size(checksum);
+    packets->checksum = checksum;
+
+}
+
+
+/* Grow packet buffer, reusing it across tiles */
+static int iac_obc_packets_reserve(iac_obc_packets_t *packets,
+                                   const size_t count)
+{
+    uint8_t *buf;
+
+    if (count > packets->capacity) {
+        buf = realloc(packets->buf, count * packets->size);
+        if (!buf) {
+            perror("Unable to allocate packets");
+            return IAC_FAILURE;
+        }
+        packets->buf = buf;
+        packets->capacity = count;
+    }
+    packets->count = count;
+
+    return IAC_SUCCESS;
+}
+
+
+/*
+ * Block 0 holds number of tile blocks and protocol version, followed by
+ * the fill colour of a uniform tile.
+ */
+static void iac_obc_header_encode(iac_obc_packets_t *packets,
+                                  const uint16_t tile,
+                                  const uint16_t blocks,
+                                  const uint8_t *colour)
+{
+    iac_obc_block_t block;
+    uint8_t header[2 * sizeof(uint16_t) + IAC_IMAGE_CHANNELS];
+    uint8_t *p = header;
+
+    p = iac_pack_short(p, blocks);
+    if (packets->checksum != IAC_OBC_CHECKSUM_LRC)
+        p = iac_pack(iac_pack(p,
+                              iac_obc_wide(packets->checksum) ?
+                              IAC_OBC_VERSION_WIDE : IAC_OBC_VERSION),
+                     (uint8_t) (packets->checksum & ~IAC_OBC_WIDE));
+    if (colour)
+        p = iac_pack_data(p, colour, IAC_IMAGE_CHANNELS);
+
+    block.tile = tile;
+    block.index = 0;
+    block.data = header;
+    block.data_size = (size_t) (p - header);
+    iac_obc_packet_encode(&block,
+                          packets->checksum,
+                          iac_obc_packets_at(packets, 0));
+
+}
+
+
+int iac_obc_tile_packets(iac_obc_packets_t *packets,
+                         const uint16_t tile,
+                         const uint8_t *blob,
+                         const size_t size)
+{
+    iac_obc_block_t block;
+    size_t k, blocks;
+
+    blocks = (size + IAC_OBC_BLOCK_SIZE - 1) / IAC_OBC_BLOCK_SIZE;
+    if (blocks > IAC_OBC_TILE_BLOCKS_MAX) {
+        fprintf(stderr, "Tile %u is too large to packetize!\n", tile);
+        return IAC_FAILURE;
+    }
+
+    if (iac_obc_packets_reserve(packets, blocks + 1) == IAC_FAILURE)
+        return IAC_FAILURE;
+    iac_obc_header_encode(packets, tile, (uint16_t) blocks, NULL);
+
+    /* Tile blocks */
+    block.tile = tile;
+    for (k = 1; k <= blocks; k++) {
+        block.index = (uint16_t) k;
+        block.data = blob + (k - 1) * IAC_OBC_BLOCK_SIZE;
+        if (k == blocks && size % IAC_OBC_BLOCK_SIZE)
+            block.data_size = size % IAC_OBC_BLOCK_SIZE;
+        else
+            block.data_size = IAC_OBC_BLOCK_SIZE;
+        iac_obc_packet_encode(&block,
+                              packets->checksum,
+                              iac_obc_packets_at(packets, k));
+    }
+
+    return IAC_SUCCESS;
+}
+
+
+/*
+ * A uniform tile has no blocks but block 0, which carries its fill colour
+ * in place of the encoded tile.
+ */
+int iac_obc_uniform_packets(iac_obc_packets_t *packets,
+                            const uint16_t tile,
+                            const uint8_t *colour)
+{
+
+    if (iac_obc_packets_reserve(packets, 1) == IAC_FAILURE)
+        return IAC_FAILURE;
+    iac_obc_header_encode(packets, tile, 0, colour);
+
+    return IAC_SUCCESS;
+}
+
+
+void iac_obc_packets_free(iac_obc_packets_t *packets)
+{
+
+    free(packets->buf);
+    iac_obc_packets_init(packets, packets->checksum);
+
+}
+
+
+size_t iac_obc_poll_encode(const uint16_t tile,
+                           const uint16_t base,
+                           const uint16_t count,
+                           const int checksum,
+                           uint8_t *buf)
+{
+    iac_obc_block_t block;
+    uint8_t data[2 * sizeof(uint16_t)];
+
+    iac_pack_short(iac_pack_short(data, base), count);
+    block.tile = tile;
+    block.index = IAC_OBC_BLOCK_POLL;
+    block.data = data;
+    block.data_size = sizeof(data);
+
+    return iac_obc_packet_encode(&block, checksum, buf);
+}
+
+
+int iac_obc_status_decode(iac_obc_status_t *status,
+                          const uint8_t *buf,
+                          const int checksum)
+{
+    uint16_t base;
+    uint8_t trailer[IAC_OBC_CHECKSUM_SIZE_MAX];
+    size_t size, trailer_size, k;
+
+    /* OBC not ready */
+    if (buf[0] != IAC_OBC_BLOCK_ACK)
+        return IAC_FAILURE;
+
+    /* Status corrupted */
+    trailer_size = iac_obc_checksum_size(checksum);
+    size = iac_obc_status_size(checksum) - trailer_size;
+    iac_obc_checksum(checksum, buf, size, trailer);
+    if (memcmp(trailer, buf + size, trailer_size))
+        return IAC_FAILURE;
+
+    k = 1 + iac_obc_tile_decode(checksum, buf + 1, &status->tile);
+    memcpy(&base, buf + k, sizeof(base));
+    status->base = ntohs(base);
+    memcpy(status->bitmap, buf + k + 2, sizeof(status->bitmap));
+
+    return IAC_SUCCESS;
+}
+
+
+/* Encode status as answered by the OBC */
+size_t iac_obc_status_encode(const iac_obc_status_t *status,
+                             const int checksum,
+                             uint8_t *buf)
+{
+    uint8_t *p = buf;
+
+    p = iac_pack(p, IAC_OBC_BLOCK_ACK);
+    p = iac_obc_tile_encode(checksum, p, status->tile);
+    p = iac_pack_short(p, status->base);
+    p = iac_pack_data(p, status->bitmap, sizeof(status->bitmap));
+    p = iac_obc_checksum(checksum, buf, (size_t) (p - buf), p);
+
+    return (size_t) (p - buf);
+}
+
+
+size_t iac_obc_request_poll_encode(const uint16_t frame,
+                                   const int checksum,
+                                   uint8_t *buf)
+{
+    iac_obc_block_t block;
+    uint8_t data[sizeof(uint16_t)];
+
+    iac_pack_short(data, frame);
+    block.tile = 0;
+    block.index = IAC_OBC_BLOCK_REQUEST;
+    block.data = data;
+    block.data_size = sizeof(data);
+
+    return iac_obc_packet_encode(&block, checksum, buf);
+}
+
+
+int iac_obc_request_decode(iac_obc_request_t *request,
+                           const uint8_t *buf,
+                           const int checksum)
+{
+    uint16_t value;
+    uint8_t trailer[IAC_OBC_CHECKSUM_SIZE_MAX];
+    size_t size, trailer_size;
+    unsigned int k;
+    const uint8_t *p = buf + 3;
+
+    /* OBC not ready */
+    if (buf[0] != IAC_OBC_REQUEST)
+        return IAC_FAILURE;
+
+    /* Request corrupted */
+    trailer_size = iac_obc_checksum_size(checksum);
+    size = iac_obc_status_size(checksum) - trailer_size;
+    iac_obc_checksum(checksum, buf, size, trailer);
+    if (memcmp(trailer, buf + size, trailer_size))
+        return IAC_FAILURE;
+
+    memcpy(&value, buf + 1, sizeof(value));
+    request->frame = ntohs(value);
+    p += iac_obc_tile_decode(checksum, p, &request->tile);
+    request->count = *p++;
+    if (request->count > IAC_OBC_REQUEST_RANGES)
+        return IAC_FAILURE;
+    for (k = 0; k < request->count; k++, p += 4) {
+        memcpy(&value, p, sizeof(value));
+        request->ranges[k].base = ntohs(value);
+        memcpy(&value, p + 2, sizeof(value));
+        request->ranges[k].count = ntohs(value);
+    }
+
+    return IAC_SUCCESS;
+}
+
+
+/* Encode request as sent by the OBC, padded to the size of a status */
+size_t iac_obc_request_encode(const iac_obc_request_t *request,
+                              const int checksum,
+                              uint8_t *buf)
+{
+    uint8_t *p = buf;
+    unsigned int k;
+
+    p = iac_pack(p, IAC_OBC_REQUEST);
+    p = iac_pack_short(p, request->frame);
+    p = iac_obc_tile_encode(checksum, p, request->tile);
+    p = iac_pack(p, request->count);
+    for (k = 0; k < request->count; k++) {
+        p = iac_pack_short(p, request->ranges[k].base);
+        p = iac_pack_short(p, request->ranges[k].count);
+    }
+    p = iac_pack_pad(p,
+                     0,
+                     iac_obc_status_size(checksum)
+                     - iac_obc_checksum_size(checksum)
+                     - (size_t) (p - buf));
+    p = iac_obc_checksum(checksum, buf, (size_t) (p - buf), p);
+
+    return (size_t) (p - buf);
+}
+
+
+void iac_obc_ack_init(iac_obc_ack_t *ack, const iac_obc_ack_params_t *params)
+{
+
+    memset(ack, 0, sizeof(*ack));
+    ack->params = *params;
+    ack->frame_start = iac_time_usec();
+
+}
+
+
+/* Start waiting for a new block, first polling after learned turnaround */
+void iac_obc_ack_start(iac_obc_ack_t *ack)
+{
+
+    ack->delay = ack->turnaround;
+    ack->waited = 0;
+    ack->block_retries = 0;
+    ack->block_start = iac_time_usec();
+
+}
+
+
+/* Sleep before next poll and return the time slept in microseconds */
+unsigned int iac_obc_ack_wait(iac_obc_ack_t *ack)
+{
+
+    if (ack->delay)
+        usleep(ack->delay);
+    ack->waited += ack->delay;
+
+    return ack->delay;
+}
+
+
+int iac_obc_ack_result(iac_obc_ack_t *ack, const int acked)
+{
+    uint64_t now;
+
+    if (acked) {
+        /*
+         * Learn OBC turnaround from the time waited for the block.
+         * Decay when the first poll succeeds to find a faster OBC.
+         */
+        if (ack->block_retries)
+            ack->turnaround = (7 * ack->turnaround + ack->waited) / 8;
+        else
+            ack->turnaround -= ack->turnaround / 8;
+        return IAC_SUCCESS;
+    }
+
+    ack->block_retries++;
+    ack->frame_retries++;
+
+    /* Back off exponentially up to ceiling, sleeping at least 1 us */
+    if (ack->delay < ack->params.min_usleep)
+        ack->delay = ack->params.min_usleep;
+    else
+        ack->delay = ack->delay ? ack->delay * 2 : 1;
+    if (ack->delay > ack->params.max_usleep)
+        ack->delay = ack->params.max_usleep;
+
+    /* Check retry and time budgets */
+    if (ack->params.block_retries
+        && ack->block_retries > ack->params.block_retries) {
+        fprintf(stderr, "OBC did not acknowledge block after %u retries!\n",
+                ack->params.block_retries);
+        return IAC_FAILURE;
+    }
+    if (ack->params.frame_retries
+        && ack->frame_retries > ack->params.frame_retries) {
+        fprintf(stderr, "OBC did not acknowledge frame after %u retries!\n",
+                ack->params.frame_retries);
+        return IAC_FAILURE;
+    }
+    now = iac_time_usec();
+    if (ack->params.block_timeout
+        && now - ack->block_start > ack->params.block_timeout * 1000ULL) {
+        fprintf(stderr, "OBC did not acknowledge block within %u ms!\n",
+                ack->params.block_timeout);
+        return IAC_FAILURE;
+    }
+    if (ack->params.frame_timeout
+        && now - ack->frame_start > ack->params.frame_timeout * 1000ULL) {
+        fprintf(stderr, "OBC did not acknowledge frame within %u ms!\n",
+                ack->params.frame_timeout);
+        return IAC_FAILURE;
+    }
+
+    return IAC_SUCCESS;
+}
@@ -18,10 +18,69 @@
 #ifndef __OBC_H
 #define __OBC_H
 
+/*
+ * Packet trailer checksums.  Protocol version 1 uses LRC only.  From
+ * version 2 block 0 of a tile carries the protocol version and checksum
+ * after the number of blocks, and all blocks of the tile use it.
+ */
+#define IAC_OBC_VERSION                 2
+#define IAC_OBC_CHECKSUM_LRC            0
+#define IAC_OBC_CHECKSUM_CRC16          1
+#define IAC_OBC_CHECKSUM_CRC32C         2
+#define IAC_OBC_CHECKSUM_SIZE_MAX       4
+
+/*
+ * Tile ids below IAC_OBC_TILES_NARROW, and the manifest and thumbnail as
+ * their low byte, take a byte in blocks, polls, statuses and requests.
+ * Grids of more tiles need protocol version 3, where tile ids take two
+ * bytes.  It is selected by IAC_OBC_WIDE in the checksum, which with
+ * the checksum sets the size of packets, and needs a CRC checksum so
+ * that the OBC can tell it by size.
+ */
+#define IAC_OBC_VERSION_WIDE            3
+#define IAC_OBC_WIDE                    0x10
+#define IAC_OBC_TILES_NARROW            0xfe
+#define IAC_OBC_TILE_SIZE_MAX           2
+
+#define iac_obc_wide(checksum)          ((checksum) & IAC_OBC_WIDE)
+#define iac_obc_tile_size(checksum)     (iac_obc_wide(checksum) ? 2u : 1u)
+
+/* Tile, index, data and LRC */
+#define IAC_OBC_PACKET_SIZE             (IAC_OBC_BLOCK_SIZE + 4)
+#define IAC_OBC_PACKET_SIZE_MAX         (IAC_OBC_BLOCK_SIZE + 2 \
+                                         + IAC_OBC_TILE_SIZE_MAX \
+                                         + IAC_OBC_CHECKSUM_SIZE_MAX)
+
+/*
+ * In windowed mode a poll block, with this index and the window base
+ * and length as data, follows each window of blocks.  The OBC answers
+ * in a separate status transfer with the received bitmap of the window.
+ */
+#define IAC_OBC_BLOCK_POLL              0xffff
+
+/* ACK, tile, base, bitmap and checksum */
+#define IAC_OBC_STATUS_SIZE_MAX         (IAC_OBC_WINDOW_MAX / 8 + 3 \
+                                         + IAC_OBC_TILE_SIZE_MAX \
+                                         + IAC_OBC_CHECKSUM_SIZE_MAX)
+
+/*
+ * After a frame the IAC polls for retransmission requests with a block
+ * of this index, holding the number of the frame just sent.  The OBC
+ * answers in a transfer of status size, naming a frame, a tile and
+ * ranges of its blocks to send again, or no ranges if it needs none.
+ */
+#define IAC_OBC_BLOCK_REQUEST           0xfffe
+
+/* Blocks of a tile after block 0, below the indices of poll and request */
+#define IAC_OBC_TILE_BLOCKS_MAX         (IAC_OBC_BLOCK_REQUEST - 1)
+
+/* Request marker, frame, tile and number of ranges, then the ranges */
+#define IAC_OBC_REQUEST_RANGES          ((IAC_OBC_WINDOW_MAX / 8 - 1) / 4)
+
 typedef struct iac_obc_block_t {
-    uint8_t tile;
+    uint16_t tile;
     uint16_t index;
-    uint8_t *data;
+    const uint8_t *data;
     size_t data_size;
 } iac_obc_block_t;
 
@@ -30,6 +89,89 @@ typedef struct iac_obc_packet_t {
     size_t size;
 } iac_obc_packet_t;
 
+typedef struct iac_obc_packets_t {
+    uint8_t *buf;
+    size_t count;
+    size_t capacity;
+    size_t size;
+    int checksum;
+} iac_obc_packets_t;
+
+typedef struct iac_obc_status_t {
+    uint16_t tile;
+    uint16_t base;
+    uint8_t bitmap[IAC_OBC_WINDOW_MAX / 8];
+} iac_obc_status_t;
+
+typedef struct iac_obc_range_t {
+    uint16_t base;
+    uint16_t count;
+} iac_obc_range_t;
+
+typedef struct iac_obc_request_t {
+    uint16_t frame;
+    uint16_t tile;
+    uint8_t count;
+    iac_obc_range_t ranges[IAC_OBC_REQUEST_RANGES];
+} iac_obc_request_t;
+
+typedef struct iac_obc_ack_params_t {
+    unsigned int min_usleep;
+    unsigned int max_usleep;
+    unsigned int block_retries;
+    unsigned int frame_retries;
+    unsigned int block_timeout;
+    unsigned int frame_timeout;
+} iac_obc_ack_params_t;
+
+typedef struct iac_obc_ack_t {
+    iac_obc_ack_params_t params;
+    unsigned int turnaround;
+    unsigned int delay;
+    unsigned int waited;
+    unsigned int block_retries;
+    unsigned int frame_retries;
+    uint64_t block_start;
+    uint64_t frame_start;
+} iac_obc_ack_t;
+
+#define iac_obc_packets_at(packets, k) \
+        ((packets)->buf + (k) * (packets)->size)
+
+size_t iac_obc_checksum_size(const int);
+size_t iac_obc_packet_size(const int);
+size_t iac_obc_status_size(const int);
 iac_obc_packet_t iac_obc_packet(const iac_obc_block_t *);
+size_t iac_obc_packet_encode(const iac_obc_block_t *, const int, uint8_t *);
+int iac_obc_packet_decode(iac_obc_block_t *, const uint8_t *, const int);
+void iac_obc_packets_init(iac_obc_packets_t *, const int);
+int iac_obc_tile_packets(iac_obc_packets_t *,
+                         const uint16_t,
+                         const uint8_t *,
+                         const size_t);
+int iac_obc_uniform_packets(iac_obc_packets_t *,
+                            const uint16_t,
+                            const uint8_t *);
+void iac_obc_packets_free(iac_obc_packets_t *);
+size_t iac_obc_poll_encode(const uint16_t,
+                           const uint16_t,
+                           const uint16_t,
+                           const int,
+                           uint8_t *);
+int iac_obc_status_decode(iac_obc_status_t *, const uint8_t *, const int);
+size_t iac_obc_status_encode(const iac_obc_status_t *,
+                             const int,
+                             uint8_t *);
+#define iac_obc_status_acked(status, k) \
+        ((status)->bitmap[(k) / 8] & (1 << ((k) % 8)))
+size_t iac_obc_request_poll_encode(const uint16_t, const int, uint8_t *);
+int iac_obc_request_decode(iac_obc_request_t *, const uint8_t *, const int);
+size_t iac_obc_request_encode(const iac_obc_request_t *,
+                              const int,
+                              uint8_t *);
+void iac_obc_ack_init(iac_obc_ack_t *, const iac_obc_ack_params_t *);
+void iac_obc_ack_start(iac_obc_ack_t *);
+unsigned int iac_obc_ack_wait(iac_obc_ack_t *);
+int iac_obc_ack_result(iac_obc_ack_t *, const int);
 
 #endif
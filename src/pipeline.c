@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2016 Libre Space Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "iac.h"
+#include "pipeline.h"
+
+#define IAC_PIPELINE_EMPTY              0
+#define IAC_PIPELINE_READY              1
+#define IAC_PIPELINE_FAILED             2
+
+static void *iac_pipeline_worker(void *);
+
+/*
+ * Workers take tiles in order and encode at most `depth' tiles ahead of
+ * the consumer.  Tile `n' always lands in slot `n % depth'.
+ */
+static void *iac_pipeline_worker(void *arg)
+{
+    iac_pipeline_t *pipeline = arg;
+    iac_pipeline_slot_t *slot;
+    unsigned char *blob;
+    unsigned int tile;
+    size_t size;
+
+    for (;;) {
+        pthread_mutex_lock(&pipeline->lock);
+        while (!pipeline->stopped
+               && pipeline->next < pipeline->params.tiles
+               && pipeline->next >= pipeline->head + pipeline->params.depth)
+            pthread_cond_wait(&pipeline->consumed, &pipeline->lock);
+        if (pipeline->stopped || pipeline->next >= pipeline->params.tiles) {
+            pthread_mutex_unlock(&pipeline->lock);
+            break;
+        }
+        tile = pipeline->next++;
+        pthread_mutex_unlock(&pipeline->lock);
+
+        /* Encode tile */
+        IAC_VERBOSE("Encoding tile %u...\n", tile);
+        size = 0;
+        blob = pipeline->params.encode(pipeline->params.data, tile, &size);
+
+        pthread_mutex_lock(&pipeline->lock);
+        slot = &pipeline->slots[tile % pipeline->params.depth];
+        slot->blob = blob;
+        slot->size = size;
+        slot->state = blob ? IAC_PIPELINE_READY : IAC_PIPELINE_FAILED;
+        pthread_cond_broadcast(&pipeline->produced);
+        pthread_mutex_unlock(&pipeline->lock);
+    }
+
+    return NULL;
+}
+
+
+int iac_pipeline_start(iac_pipeline_t *pipeline,
+                       const iac_pipeline_params_t *params)
+{
+    unsigned int i;
+
+    memset(pipeline, 0, sizeof(*pipeline));
+    pipeline->params = *params;
+    if (!pipeline->params.workers)
+        pipeline->params.workers = 1;
+    if (!pipeline->params.depth)
+        pipeline->params.depth = 1;
+
+    pipeline->slots = calloc(pipeline->params.depth,
+                             sizeof(iac_pipeline_slot_t));
+    pipeline->threads = calloc(pipeline->params.workers, sizeof(pthread_t));
+    if (!pipeline->slots || !pipeline->threads) {
+        perror("Unable to allocate pipeline");
+        free(pipeline->slots);
+        free(pipeline->threads);
+        return IAC_FAILURE;
+    }
+    pthread_mutex_init(&pipeline->lock, NULL);
+    pthread_cond_init(&pipeline->produced, NULL);
+    pthread_cond_init(&pipeline->consumed, NULL);
+
+    /* Start encoder workers */
+    for (i = 0; i < pipeline->params.workers; i++) {
+        if (pthread_create(&pipeline->threads[i],
+                           NULL,
+                           iac_pipeline_worker,
+                           pipeline)) {
+            fprintf(stderr, "Unable to start pipeline worker!\n");
+            iac_pipeline_stop(pipeline);
+            return IAC_FAILURE;
+        }
+        pipeline->threads_count++;
+    }
+
+    return IAC_SUCCESS;
+}
+
+
+unsigned char *iac_pipeline_get(iac_pipeline_t *pipeline, size_t *size)
+{
+    iac_pipeline_slot_t *slot;
+    unsigned char *blob = NULL;
+
+    pthread_mutex_lock(&pipeline->lock);
+    slot = &pipeline->slots[pipeline->head % pipeline->params.depth];
+    while (slot->state == IAC_PIPELINE_EMPTY)
+        pthread_cond_wait(&pipeline->produced, &pipeline->lock);
+    if (slot->state == IAC_PIPELINE_READY) {
+        blob = slot->blob;
+        *size = slot->size;
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+
+    return blob;
+}
+
+
+void iac_pipeline_put(iac_pipeline_t *pipeline)
+{
+    iac_pipeline_slot_t *slot;
+
+    pthread_mutex_lock(&pipeline->lock);
+    slot = &pipeline->slots[pipeline->head % pipeline->params.depth];
+    if (slot->blob)
+        pipeline->params.release(pipeline->params.data, slot->blob);
+    memset(slot, 0, sizeof(*slot));
+    pipeline->head++;
+    pthread_cond_broadcast(&pipeline->consumed);
+    pthread_mutex_unlock(&pipeline->lock);
+
+}
+
+
+/* Move on from the current tile, leaving its blob to the consumer */
+void iac_pipeline_take(iac_pipeline_t *pipeline)
+{
+    iac_pipeline_slot_t *slot;
+
+    pthread_mutex_lock(&pipeline->lock);
+    slot = &pipeline->slots[pipeline->head % pipeline->params.depth];
+    memset(slot, 0, sizeof(*slot));
+    pipeline->head++;
+    pthread_cond_broadcast(&pipeline->consumed);
+    pthread_mutex_unlock(&pipeline->lock);
+
+}
+
+
+void iac_pipeline_stop(iac_pipeline_t *pipeline)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->stopped = 1;
+    pthread_cond_broadcast(&pipeline->consumed);
+    pthread_mutex_unlock(&pipeline->lock);
+
+    for (i = 0; i < pipeline->threads_count; i++)
+        pthread_join(pipeline->threads[i], NULL);
+
+    /* Release tiles that were never consumed */
+    for (i = 0; i < pipeline->params.depth; i++)
+        if (pipeline->slots[i].blob)
+            pipeline->params.release(pipeline->params.data,
+                                     pipeline->slots[i].blob);
+
+    pthread_cond_destroy(&pipeline->consumed);
+    pthread_cond_destroy(&pipeline->produced);
+    pthread_mutex_destroy(&pipeline->lock);
+    free(pipeline->threads);
+    free(pipeline->slots);
+    pipeline->threads = NULL;
+    pipeline->slots = NULL;
+
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2016 Libre Space Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __PIPELINE_H
+#define __PIPELINE_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+typedef unsigned char *(*iac_pipeline_encode_t)(void *,
+                                                const unsigned int,
+                                                size_t *);
+typedef void (*iac_pipeline_release_t)(void *, unsigned char *);
+
+typedef struct iac_pipeline_params_t {
+    unsigned int tiles;
+    unsigned int workers;
+    unsigned int depth;
+    iac_pipeline_encode_t encode;
+    iac_pipeline_release_t release;
+    void *data;
+} iac_pipeline_params_t;
+
+typedef struct iac_pipeline_slot_t {
+    unsigned char *blob;
+    size_t size;
+    int state;
+} iac_pipeline_slot_t;
+
+typedef struct iac_pipeline_t {
+    iac_pipeline_params_t params;
+    pthread_t *threads;
+    unsigned int threads_count;
+    pthread_mutex_t lock;
+    pthread_cond_t produced;
+    pthread_cond_t consumed;
+    iac_pipeline_slot_t *slots;
+    unsigned int next;
+    unsigned int head;
+    int stopped;
+} iac_pipeline_t;
+
+int iac_pipeline_start(iac_pipeline_t *, const iac_pipeline_params_t *);
+unsigned char *iac_pipeline_get(iac_pipeline_t *, size_t *);
+void iac_pipeline_put(iac_pipeline_t *);
+void iac_pipeline_take(iac_pipeline_t *);
+void iac_pipeline_stop(iac_pipeline_t *);
+
+#endif
@@ -0,0 +1,342 @@
+/*
+ * Copyright (C) 2016 Libre Space Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <wand/magick_wand.h>
+#include "iac.h"
+#include "image.h"
+#include "rate.h"
+
+/*
+ * Tile size model, fitted to libjpeg-turbo output with optimized coding:
+ *
+ *   size = header + (pixel * pixels + detail * detail) * scale * curve(q)
+ *
+ * Detail is the sampled gradient energy of iac_image_view_detail().  The
+ * curve gives size relative to quality 85 at steps of 5, including the
+ * jump where chroma subsampling is turned off at quality 90.  Scale
+ * starts at 1 and learns the content and encoder from each tile encoded.
+ */
+#define IAC_RATE_HEADER                 600.0
+#define IAC_RATE_PIXEL                  0.0144
+#define IAC_RATE_DETAIL                 0.0869
+#define IAC_RATE_CURVE_STEP             5
+
+static const double iac_rate_curve[] = {
+    0.040, 0.071, 0.139, 0.200, 0.251, 0.295, 0.331, 0.371, 0.409, 0.443,
+    0.479, 0.509, 0.548, 0.600, 0.658, 0.727, 0.841, 1.000, 1.545, 2.409,
+    6.900,
+};
+
+static double iac_rate_curve_at(const int);
+static int iac_rate_fit(const iac_rate_t *,
+                        const double,
+                        const double,
+                        const int,
+                        const size_t);
+
+void iac_rate_init(iac_rate_t *rate,
+                   const int min_quality,
+                   const int max_quality)
+{
+
+    memset(rate, 0, sizeof(*rate));
+    pthread_mutex_init(&rate->lock, NULL);
+    rate->min_quality = min_quality;
+    rate->max_quality = max_quality;
+    rate->scale = 1.0;
+
+}
+
+
+void iac_rate_destroy(iac_rate_t *rate)
+{
+
+    pthread_mutex_destroy(&rate->lock);
+
+}
+
+
+/* Interpolate relative size at quality */
+static double iac_rate_curve_at(const int quality)
+{
+    int k = quality / IAC_RATE_CURVE_STEP;
+    double f;
+
+    if (quality <= 0)
+        return iac_rate_curve[0];
+    if (quality >= 100)
+        return iac_rate_curve[100 / IAC_RATE_CURVE_STEP];
+    f = (double) (quality % IAC_RATE_CURVE_STEP) / IAC_RATE_CURVE_STEP;
+
+    return iac_rate_curve[k] + f * (iac_rate_curve[k + 1] - iac_rate_curve[k]);
+}
+
+
+/* Size weight of a tile, from its area and detail */
+double iac_rate_weight(const iac_image_view_t *view)
+{
+
+    return IAC_RATE_PIXEL * (double) (view->width * view->height)
+        + IAC_RATE_DETAIL * (double) iac_image_view_detail(view);
+}
+
+
+/*
+ * Share frame budget among tiles.  Each tile gets a header and the rest
+ * is shared by weight, so that all tiles land at about the same quality.
+ */
+void iac_rate_share(const double *weight,
+                    const unsigned int count,
+                    const size_t budget,
+                    size_t *budgets)
+{
+    double total = 0, rest;
+    unsigned int k;
+
+    for (k = 0; k < count; k++)
+        total += weight[k];
+    rest = (double) budget - count * IAC_RATE_HEADER;
+    if (rest < 0)
+        rest = 0;
+    for (k = 0; k < count; k++)
+        budgets[k] = (size_t) (IAC_RATE_HEADER
+                               + (total > 0 ? rest * weight[k] / total : 0));
+
+}
+
+
+size_t iac_rate_predict(const double weight,
+                        const double scale,
+                        const int quality)
+{
+
+    return (size_t) (IAC_RATE_HEADER
+                     + weight * scale * iac_rate_curve_at(quality));
+}
+
+
+/* Highest quality predicted to fit in the margin of the budget */
+static int iac_rate_fit(const iac_rate_t *rate,
+                        const double weight,
+                        const double scale,
+                        const int max_quality,
+                        const size_t budget)
+{
+    size_t target = budget * IAC_RATE_MARGIN / 100;
+    int quality;
+
+    for (quality = max_quality; quality > rate->min_quality; quality--)
+        if (iac_rate_predict(weight, scale, quality) <= target)
+            break;
+
+    return quality;
+}
+
+
+/* Quality to encode a tile of given weight at first */
+int iac_rate_quality(iac_rate_t *rate,
+                     const double weight,
+                     const size_t budget)
+{
+    double scale;
+
+    pthread_mutex_lock(&rate->lock);
+    scale = rate->scale;
+    pthread_mutex_unlock(&rate->lock);
+
+    return iac_rate_fit(rate, weight, scale, rate->max_quality, budget);
+}
+
+
+/*
+ * Learn from an encoded tile.  Returns the scale that predicts its size,
+ * and moves the shared scale towards it.
+ */
+double iac_rate_observe(iac_rate_t *rate,
+                        const double weight,
+                        const int quality,
+                        const size_t size)
+{
+    double scale, model = weight * iac_rate_curve_at(quality);
+
+    pthread_mutex_lock(&rate->lock);
+    if ((double) size > IAC_RATE_HEADER && model > 0) {
+        scale = ((double) size - IAC_RATE_HEADER) / model;
+        rate->scale += (scale - rate->scale) / 4;
+    }
+    else
+        scale = rate->scale;
+    pthread_mutex_unlock(&rate->lock);
+
+    return scale;
+}
+
+
+/*
+ * Quality of the single corrective encode, or 0 if the tile is kept.
+ * A tile over budget is encoded again lower, and one well under budget
+ * higher, both using the scale learnt from the tile itself.
+ */
+int iac_rate_correct(const iac_rate_t *rate,
+                     const double weight,
+                     const double scale,
+                     const int quality,
+                     const size_t size,
+                     const size_t budget)
+{
+    int corrected;
+
+    if (size > budget) {
+        if (quality <= rate->min_quality)
+            return 0;
+        return iac_rate_fit(rate, weight, scale, quality - 1, budget);
+    }
+    if (size < budget * IAC_RATE_SLACK / 100
+        && quality < rate->max_quality) {
+        corrected = iac_rate_fit(rate,
+                                 weight,
+                                 scale,
+                                 rate->max_quality,
+                                 budget);
+        return corrected > quality ? corrected : 0;
+    }
+
+    return 0;
+}
+
+
+void iac_rate_result(iac_rate_t *rate,
+                     const size_t size,
+                     const size_t budget,
+                     const int reencoded)
+{
+
+    pthread_mutex_lock(&rate->lock);
+    rate->stats.tiles++;
+    if (reencoded)
+        rate->stats.reencodes++;
+    if (size > budget)
+        rate->stats.overruns++;
+    rate->stats.bytes += size;
+    rate->stats.budget += budget;
+    pthread_mutex_unlock(&rate->lock);
+
+}
+
+
+/*
+ * Choose a grid for the frame whose tiles, predicted at `quality', land
+ * nearest to whole blocks, so that the least of the link is spent on the
+ * padding of their last blocks.  Tiles are whole cells of the frame, at
+ * most twice as long as wide, and number from half to twice `tiles'.
+ * The weight of any such tile comes from prefix sums of cell weights.
+ */
+int iac_rate_grid(iac_rate_t *rate,
+                  const iac_image_frame_t *frame,
+                  const int quality,
+                  const unsigned int tiles,
+                  iac_image_grid_t *grid)
+{
+    const size_t cell = IAC_IMAGE_GRID_CELL;
+    const size_t cols = (frame->width + cell - 1) / cell;
+    const size_t rows = (frame->height + cell - 1) / cell;
+    const size_t stride = cols + 1;
+    uint64_t *detail;
+    double *sums, weight, scale, waste, sent, best = -1;
+    size_t i, j, tw, th, r, c, r1, c1, count, pixels, size, blocks;
+
+    detail = malloc(rows * cols * sizeof(*detail));
+    sums = calloc((rows + 1) * stride, sizeof(*sums));
+    if (!detail || !sums) {
+        perror("Unable to allocate grid weights");
+        free(detail);
+        free(sums);
+        return IAC_FAILURE;
+    }
+
+    iac_image_frame_detail(frame, cell, detail);
+    for (i = 0; i < rows; i++) {
+        for (j = 0; j < cols; j++) {
+            pixels = ((j + 1) * cell > frame->width ?
+                      frame->width - j * cell : cell)
+                * ((i + 1) * cell > frame->height ?
+                   frame->height - i * cell : cell);
+            weight = IAC_RATE_PIXEL * (double) pixels
+                + IAC_RATE_DETAIL * (double) detail[i * cols + j];
+            sums[(i + 1) * stride + j + 1] = weight
+                + sums[i * stride + j + 1]
+                + sums[(i + 1) * stride + j]
+                - sums[i * stride + j];
+        }
+    }
+    free(detail);
+
+    pthread_mutex_lock(&rate->lock);
+    scale = rate->scale;
+    pthread_mutex_unlock(&rate->lock);
+
+    for (th = 1; th <= rows; th++) {
+        for (tw = (th + 1) / 2; tw <= cols && tw <= 2 * th; tw++) {
+            r = (rows + th - 1) / th;
+            c = (cols + tw - 1) / tw;
+            count = r * c;
+            if (count < tiles / 2
+                || count > 2 * tiles
+                || count > IAC_IMAGE_TILES_MAX)
+                continue;
+
+            waste = 0;
+            sent = 0;
+            for (i = 0; i < rows; i += th) {
+                r1 = i + th < rows ? i + th : rows;
+                for (j = 0; j < cols; j += tw) {
+                    c1 = j + tw < cols ? j + tw : cols;
+                    weight = sums[r1 * stride + c1]
+                        - sums[i * stride + c1]
+                        - sums[r1 * stride + j]
+                        + sums[i * stride + j];
+                    size = iac_rate_predict(weight, scale, quality);
+                    blocks = (size + IAC_OBC_BLOCK_SIZE - 1)
+                        / IAC_OBC_BLOCK_SIZE;
+                    waste += (double) (blocks * IAC_OBC_BLOCK_SIZE - size);
+                    sent += (double) (blocks * IAC_OBC_BLOCK_SIZE);
+                }
+            }
+            waste /= sent;
+            if (best < 0 || waste < best) {
+                best = waste;
+                grid->rows = (unsigned int) r;
+                grid->cols = (unsigned int) c;
+                grid->width = tw * cell;
+                grid->height = th * cell;
+            }
+        }
+    }
+    free(sums);
+
+    if (best < 0) {
+        fprintf(stderr, "Image is too small for %u tiles!\n", tiles);
+        return IAC_FAILURE;
+    }
+
+    return IAC_SUCCESS;
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2016 Libre Space Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __RATE_H
+#define __RATE_H
+
+typedef struct iac_rate_stats_t {
+    unsigned long tiles;
+    unsigned long reencodes;
+    unsigned long overruns;
+    size_t bytes;
+    size_t budget;
+} iac_rate_stats_t;
+
+typedef struct iac_rate_t {
+    pthread_mutex_t lock;
+    int min_quality;
+    int max_quality;
+    double scale;
+    iac_rate_stats_t stats;
+} iac_rate_t;
+
+void iac_rate_init(iac_rate_t *, const int, const int);
+void iac_rate_destroy(iac_rate_t *);
+double iac_rate_weight(const iac_image_view_t *);
+void iac_rate_share(const double *,
+                    const unsigned int,
+                    const size_t,
+                    size_t *);
+size_t iac_rate_predict(const double, const double, const int);
+int iac_rate_quality(iac_rate_t *, const double, const size_t);
+double iac_rate_observe(iac_rate_t *,
+                        const double,
+                        const int,
+                        const size_t);
+int iac_rate_correct(const iac_rate_t *,
+                     const double,
+                     const double,
+                     const int,
+                     const size_t,
+                     const size_t);
+void iac_rate_result(iac_rate_t *, const size_t, const size_t, const int);
+int iac_rate_grid(iac_rate_t *,
+                  const iac_image_frame_t *,
+                  const int,
+                  const unsigned int,
+                  iac_image_grid_t *);
+
+#endif
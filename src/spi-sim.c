@@ -0,0 +1,934 @@
+/*
+ * Copyright (C) 2016 Libre Space Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "iac.h"
+#include "spi.h"
+#include "obc.h"
+#include "utils.h"
+
+/*
+ * Simulated OBC behind the SPI interface.  A device named
+ * "sim[:key=value,...]" connects to an OBC model served by a thread, or
+ * by a child process with fork=1, over a socket pair.  Each SPI message
+ * is sent as one datagram and answered with the bytes the OBC shifts out.
+ *
+ * The model clocks transfers at the bit rate, so calls block as long as
+ * on the real link.  It takes `turnaround' microseconds to process each
+ * block and buffers at most `queue' of them, so a legacy OBC (queue=1)
+ * acknowledges a block only once it is done with the previous one.
+ * Blocks may be dropped or corrupted and the OBC may go busy for a
+ * while, with the given percent probabilities.  Accepted blocks are
+ * checked and reassembled into tiles, which are written to directory
+ * `out' if set, and a report is printed when the device is closed.
+ *
+ * Each request=TILE:FIRST-LAST option makes the OBC lose those blocks of
+ * a received tile and ask for them again when polled for requests.
+ */
+#define IAC_SPI_SIM_REQUESTS    8
+
+typedef struct iac_spi_sim_params_t {
+    unsigned int rate;
+    unsigned int turnaround;
+    unsigned int queue;
+    double drop;
+    double corrupt;
+    double busy;
+    unsigned int busy_time;
+    uint32_t seed;
+    char *out;
+    int fork;
+    iac_obc_request_t requests[IAC_SPI_SIM_REQUESTS];
+    unsigned int request_count;
+} iac_spi_sim_params_t;
+
+typedef struct iac_spi_sim_tile_t {
+    uint8_t *data;
+    uint8_t *received;
+    size_t capacity;
+    size_t blocks;
+    size_t count;
+    size_t last;
+    int header;
+    int done;
+} iac_spi_sim_tile_t;
+
+typedef struct iac_spi_sim_stats_t {
+    unsigned long messages;
+    unsigned long blocks;
+    unsigned long accepted;
+    unsigned long dropped;
+    unsigned long corrupted;
+    unsigned long rejected;
+    unsigned long undetected;
+    unsigned long busy;
+    unsigned long not_ready;
+    unsigned long duplicate;
+    unsigned long reordered;
+    unsigned long invalid;
+    unsigned long polls;
+    unsigned long status_reads;
+    unsigned long status_sent;
+    unsigned long requests;
+    unsigned int tiles;
+    unsigned int uniform;
+    size_t bytes;
+} iac_spi_sim_stats_t;
+
+typedef struct iac_spi_sim_t {
+    iac_spi_sim_params_t params;
+    int fd;
+    uint32_t rng;
+    uint64_t start;
+    uint64_t end;
+    uint64_t done_at;
+    uint64_t busy_until;
+    iac_obc_status_t status;
+    uint16_t status_count;
+    int status_checksum;
+    int status_valid;
+    uint64_t status_at;
+    uint16_t request_frame;
+    int request_valid;
+    uint64_t request_at;
+    unsigned int requested;
+    iac_spi_sim_tile_t *tiles[UINT16_MAX + 1];
+    iac_spi_sim_stats_t stats;
+} iac_spi_sim_t;
+
+/* SPI message header, followed by `count' buffers of `size' bytes */
+typedef struct iac_spi_sim_msg_t {
+    uint32_t count;
+    uint32_t size;
+    uint32_t delay;
+} iac_spi_sim_msg_t;
+
+#define IAC_SPI_SIM_MSG_MAX     (sizeof(iac_spi_sim_msg_t) \
+                                 + IAC_SPI_BATCH_MAX * IAC_OBC_PACKET_SIZE_MAX)
+
+/* Host end of the simulated device */
+static struct {
+    int fd;
+    int forked;
+    pid_t pid;
+    pthread_t thread;
+} iac_spi_sim_host = { -1, 0, 0, 0 };
+
+static int iac_spi_sim_options(iac_spi_sim_params_t *, const char *);
+static uint32_t iac_spi_sim_random(iac_spi_sim_t *);
+static int iac_spi_sim_chance(iac_spi_sim_t *, const double);
+static int iac_spi_sim_checksum(const size_t, size_t (*)(const int));
+static void iac_spi_sim_corrupt(iac_spi_sim_t *, uint8_t *, const size_t);
+static void iac_spi_sim_tile(iac_spi_sim_t *,
+                             const iac_obc_block_t *,
+                             const int);
+static void iac_spi_sim_poll(iac_spi_sim_t *,
+                             const iac_obc_block_t *,
+                             const int);
+static void iac_spi_sim_poll_request(iac_spi_sim_t *,
+                                     const iac_obc_block_t *,
+                                     const int);
+static void iac_spi_sim_block(iac_spi_sim_t *,
+                              const uint8_t *,
+                              uint8_t *,
+                              const size_t,
+                              const uint64_t);
+static void iac_spi_sim_status(iac_spi_sim_t *,
+                               uint8_t *,
+                               const size_t,
+                               const uint64_t);
+static void iac_spi_sim_request(iac_spi_sim_t *,
+                                uint8_t *,
+                                const size_t,
+                                const uint64_t);
+static void iac_spi_sim_write(const iac_spi_sim_t *,
+                              const unsigned int,
+                              const uint8_t *,
+                              const size_t,
+                              const char *);
+static void iac_spi_sim_report(const iac_spi_sim_t *);
+static void iac_spi_sim_free(iac_spi_sim_t *);
+static void *iac_spi_sim_serve(void *);
+
+static int iac_spi_sim_options(iac_spi_sim_params_t *params,
+                               const char *options)
+{
+    char *opts, *opt, *value, *save;
+    iac_obc_request_t *request;
+    unsigned int tile, first, last;
+    int ret = IAC_SUCCESS;
+
+    opts = strdup(options);
+    if (!opts) {
+        perror("Unable to parse SPI simulator options");
+        return IAC_FAILURE;
+    }
+
+    for (opt = strtok_r(opts, ",", &save);
+         opt;
+         opt = strtok_r(NULL, ",", &save)) {
+        value = strchr(opt, '=');
+        if (!value) {
+            fprintf(stderr, "Invalid SPI simulator option '%s'!\n", opt);
+            ret = IAC_FAILURE;
+            break;
+        }
+        *value++ = '\0';
+        if (!strcmp(opt, "rate")) {
+            params->rate = (unsigned int) atoi(value);
+        }
+        else if (!strcmp(opt, "turnaround")) {
+            params->turnaround = (unsigned int) atoi(value);
+        }
+        else if (!strcmp(opt, "queue")) {
+            params->queue = (unsigned int) atoi(value);
+        }
+        else if (!strcmp(opt, "drop")) {
+            params->drop = atof(value);
+        }
+        else if (!strcmp(opt, "corrupt")) {
+            params->corrupt = atof(value);
+        }
+        else if (!strcmp(opt, "busy")) {
+            params->busy = atof(value);
+        }
+        else if (!strcmp(opt, "busy-time")) {
+            params->busy_time = (unsigned int) atoi(value);
+        }
+        else if (!strcmp(opt, "seed")) {
+            params->seed = (uint32_t) strtoul(value, NULL, 0);
+        }
+        else if (!strcmp(opt, "out")) {
+            free(params->out);
+            params->out = strdup(value);
+        }
+        else if (!strcmp(opt, "fork")) {
+            params->fork = atoi(value);
+        }
+        else if (!strcmp(opt, "request")) {
+            if (params->request_count == IAC_SPI_SIM_REQUESTS
+                || sscanf(value, "%u:%u-%u", &tile, &first, &last) != 3
+                || tile > UINT16_MAX
+                || last < first
+                || last > UINT16_MAX) {
+                fprintf(stderr, "Invalid SPI simulator request '%s'!\n",
+                        value);
+                ret = IAC_FAILURE;
+                break;
+            }
+            request = &params->requests[params->request_count++];
+            request->tile = (uint16_t) tile;
+            request->count = 1;
+            request->ranges[0].base = (uint16_t) first;
+            request->ranges[0].count = (uint16_t) (last - first + 1);
+        }
+        else {
+            fprintf(stderr, "Unknown SPI simulator option '%s'!\n", opt);
+            ret = IAC_FAILURE;
+            break;
+        }
+    }
+    free(opts);
+
+    return ret;
+}
+
+
+int iac_spi_sim_init(const char *options,
+                     const iac_spi_init_params_t *init_params)
+{
+    iac_spi_sim_t *sim;
+    int fds[2];
+
+    if (iac_spi_sim_host.fd != -1) {
+        fprintf(stderr, "SPI simulator is already open!\n");
+        return -1;
+    }
+
+    sim = calloc(1, sizeof(*sim));
+    if (!sim) {
+        perror("Unable to allocate SPI simulator");
+        return -1;
+    }
+    sim->params.rate = init_params->max_speed_hz;
+    sim->params.turnaround = IAC_OBC_BLOCK_USLEEP / 10;
+    sim->params.queue = 1;
+    sim->params.busy_time = 100;
+    sim->params.seed = 1;
+    if (options
+        && iac_spi_sim_options(&sim->params, options) == IAC_FAILURE) {
+        iac_spi_sim_free(sim);
+        return -1;
+    }
+    if (!sim->params.queue)
+        sim->params.queue = 1;
+    sim->rng = sim->params.seed ? sim->params.seed : 1;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) == -1) {
+        perror("Unable to create SPI simulator socket");
+        iac_spi_sim_free(sim);
+        return -1;
+    }
+    sim->fd = fds[1];
+
+    IAC_VERBOSE("Starting simulated OBC at %u bit/s...\n",
+                sim->params.rate);
+    iac_spi_sim_host.forked = sim->params.fork;
+    if (sim->params.fork) {
+        iac_spi_sim_host.pid = fork();
+        if (iac_spi_sim_host.pid == -1) {
+            perror("Unable to fork SPI simulator");
+            goto fail;
+        }
+        if (!iac_spi_sim_host.pid) {
+            close(fds[0]);
+            iac_spi_sim_serve(sim);
+            _exit(EXIT_SUCCESS);
+        }
+        close(fds[1]);
+        iac_spi_sim_free(sim);
+    }
+    else {
+        if (pthread_create(&iac_spi_sim_host.thread,
+                           NULL,
+                           iac_spi_sim_serve,
+                           sim)) {
+            fprintf(stderr, "Unable to start SPI simulator thread!\n");
+            goto fail;
+        }
+    }
+    iac_spi_sim_host.fd = fds[0];
+
+    return fds[0];
+
+fail:
+    close(fds[0]);
+    close(fds[1]);
+    iac_spi_sim_free(sim);
+    return -1;
+}
+
+
+int iac_spi_sim_match(const int fd)
+{
+
+    return fd != -1 && fd == iac_spi_sim_host.fd;
+
+}
+
+
+int iac_spi_sim_transfer(const int fd,
+                         const uint8_t *tx_buf,
+                         uint8_t *rx_buf,
+                         const uint32_t buf_siz,
+                         const unsigned int count,
+                         const uint16_t delay_usecs)
+{
+    uint8_t msg[IAC_SPI_SIM_MSG_MAX];
+    iac_spi_sim_msg_t header;
+    size_t size = (size_t) buf_siz * count;
+    ssize_t n;
+
+    if (sizeof(header) + size > sizeof(msg)) {
+        fprintf(stderr, "SPI message is too large for simulator!\n");
+        return IAC_FAILURE;
+    }
+    header.count = count;
+    header.size = buf_siz;
+    header.delay = delay_usecs;
+    memcpy(msg, &header, sizeof(header));
+    memcpy(msg + sizeof(header), tx_buf, size);
+
+    if (send(fd, msg, sizeof(header) + size, 0) == -1) {
+        perror("Unable to send to SPI simulator");
+        return IAC_FAILURE;
+    }
+    n = recv(fd, rx_buf, size, 0);
+    if (n != (ssize_t) size) {
+        if (n == -1)
+            perror("Unable to receive from SPI simulator");
+        else
+            fprintf(stderr, "Short response from SPI simulator!\n");
+        return IAC_FAILURE;
+    }
+
+    return IAC_SUCCESS;
+}
+
+
+int iac_spi_sim_close(const int fd)
+{
+    int status;
+
+    /* Closing the socket ends the simulator, which prints its report */
+    close(fd);
+    if (iac_spi_sim_host.forked)
+        waitpid(iac_spi_sim_host.pid, &status, 0);
+    else
+        pthread_join(iac_spi_sim_host.thread, NULL);
+    iac_spi_sim_host.fd = -1;
+
+    return IAC_SUCCESS;
+}
+
+
+/* xorshift32, deterministic given the seed */
+static uint32_t iac_spi_sim_random(iac_spi_sim_t *sim)
+{
+
+    sim->rng ^= sim->rng << 13;
+    sim->rng ^= sim->rng >> 17;
+    sim->rng ^= sim->rng << 5;
+    return sim->rng;
+
+}
+
+
+static int iac_spi_sim_chance(iac_spi_sim_t *sim, const double percent)
+{
+
+    if (percent <= 0)
+        return 0;
+    return iac_spi_sim_random(sim) % 1000000 < percent * 10000;
+
+}
+
+
+/* Find checksum and width of tile ids by the size of a packet or status */
+static int iac_spi_sim_checksum(const size_t size,
+                                size_t (*size_of)(const int))
+{
+    static const int checksums[] = {
+        IAC_OBC_CHECKSUM_LRC,
+        IAC_OBC_CHECKSUM_CRC16,
+        IAC_OBC_CHECKSUM_CRC32C,
+        IAC_OBC_CHECKSUM_CRC16 | IAC_OBC_WIDE,
+        IAC_OBC_CHECKSUM_CRC32C | IAC_OBC_WIDE,
+    };
+    unsigned int k;
+
+    for (k = 0; k < sizeof(checksums) / sizeof(checksums[0]); k++)
+        if (size_of(checksums[k]) == size)
+            return checksums[k];
+
+    return -1;
+}
+
+
+/* Flip a few bits, which may happen to cancel out in a weak checksum */
+static void iac_spi_sim_corrupt(iac_spi_sim_t *sim,
+                                uint8_t *buf,
+                                const size_t size)
+{
+    unsigned int i, bits;
+    uint32_t r;
+
+    bits = 1 + iac_spi_sim_random(sim) % 3;
+    for (i = 0; i < bits; i++) {
+        r = iac_spi_sim_random(sim);
+        buf[(r >> 3) % size] ^= (uint8_t) (1 << (r & 7));
+    }
+
+}
+
+
+/* Store tile block, verifying its order and the tile header */
+static void iac_spi_sim_tile(iac_spi_sim_t *sim,
+                             const iac_obc_block_t *block,
+                             const int checksum)
+{
+    iac_spi_sim_tile_t *tile = sim->tiles[block->tile];
+    size_t k = block->index, capacity, size;
+    uint8_t *data, *received;
+    uint16_t blocks;
+
+    if (!tile) {
+        tile = calloc(1, sizeof(*tile));
+        if (!tile) {
+            perror("Unable to allocate simulated tile");
+            return;
+        }
+        sim->tiles[block->tile] = tile;
+    }
+
+    /* Block 0 of a completed tile starts it over, as in the next frame */
+    if (tile->done && !k) {
+        memset(tile->received, 0, tile->capacity);
+        tile->count = 0;
+        tile->header = 0;
+        tile->done = 0;
+    }
+    if (tile->done) {
+        sim->stats.duplicate++;
+        return;
+    }
+    if (tile->header && k > tile->blocks) {
+        sim->stats.invalid++;
+        return;
+    }
+
+    if (k >= tile->capacity) {
+        capacity = tile->capacity ? tile->capacity : 64;
+        while (capacity <= k)
+            capacity *= 2;
+        data = realloc(tile->data, capacity * IAC_OBC_BLOCK_SIZE);
+        if (data)
+            tile->data = data;
+        received = realloc(tile->received, capacity);
+        if (received)
+            tile->received = received;
+        if (!data || !received) {
+            perror("Unable to allocate simulated tile");
+            return;
+        }
+        memset(tile->received + tile->capacity,
+               0,
+               capacity - tile->capacity);
+        tile->capacity = capacity;
+    }
+    if (tile->received[k]) {
+        sim->stats.duplicate++;
+        return;
+    }
+    if (tile->count && k != tile->last + 1)
+        sim->stats.reordered++;
+    tile->last = k;
+    tile->received[k] = 1;
+    tile->count++;
+    memcpy(tile->data + k * IAC_OBC_BLOCK_SIZE,
+           block->data,
+           IAC_OBC_BLOCK_SIZE);
+
+    /* Block 0 holds number of blocks and, from version 2, the checksum */
+    if (!k) {
+        memcpy(&blocks, block->data, sizeof(blocks));
+        tile->blocks = ntohs(blocks);
+        tile->header = 1;
+        if (checksum != IAC_OBC_CHECKSUM_LRC
+            && (block->data[2] != (iac_obc_wide(checksum) ?
+                                   IAC_OBC_VERSION_WIDE : IAC_OBC_VERSION)
+                || block->data[3] != (checksum & ~IAC_OBC_WIDE)))
+            sim->stats.invalid++;
+    }
+    if (!tile->header || tile->count != tile->blocks + 1)
+        return;
+
+    tile->done = 1;
+    sim->stats.tiles++;
+
+    /* Uniform tile, block 0 carries its fill colour after the header */
+    if (!tile->blocks) {
+        sim->stats.uniform++;
+        if (sim->params.out)
+            iac_spi_sim_write(sim,
+                              block->tile,
+                              tile->data
+                              + (checksum != IAC_OBC_CHECKSUM_LRC ? 4 : 2),
+                              IAC_IMAGE_CHANNELS,
+                              "BGR");
+        return;
+    }
+
+    /* Tile complete, strip padding of its last block but the manifest's */
+    size = tile->blocks * IAC_OBC_BLOCK_SIZE;
+    while (size
+           && block->tile != IAC_OBC_TILE_MANIFEST
+           && tile->data[IAC_OBC_BLOCK_SIZE + size - 1]
+           == IAC_OBC_BLOCK_PADDING)
+        size--;
+    sim->stats.bytes += size;
+    if (sim->params.out)
+        iac_spi_sim_write(sim,
+                          block->tile,
+                          tile->data + IAC_OBC_BLOCK_SIZE,
+                          size,
+                          block->tile == IAC_OBC_TILE_MANIFEST ?
+                          "manifest" : IAC_IMAGE_BLOB_FORMAT);
+
+}
+
+
+static void iac_spi_sim_poll(iac_spi_sim_t *sim,
+                             const iac_obc_block_t *block,
+                             const int checksum)
+{
+    uint16_t base, count;
+
+    memcpy(&base, block->data, sizeof(base));
+    memcpy(&count, block->data + sizeof(base), sizeof(count));
+    base = ntohs(base);
+    count = ntohs(count);
+    sim->stats.polls++;
+    if (count > IAC_OBC_WINDOW_MAX) {
+        sim->stats.invalid++;
+        return;
+    }
+
+    /* A repeated poll does not delay the pending status */
+    sim->request_valid = 0;
+    if (sim->status_valid
+        && sim->status.tile == block->tile
+        && sim->status.base == base
+        && sim->status_count == count)
+        return;
+    sim->status.tile = block->tile;
+    sim->status.base = base;
+    sim->status_count = count;
+    sim->status_checksum = checksum;
+    sim->status_valid = 1;
+    sim->status_at = sim->done_at;
+
+}
+
+
+static void iac_spi_sim_poll_request(iac_spi_sim_t *sim,
+                                     const iac_obc_block_t *block,
+                                     const int checksum)
+{
+    uint16_t frame;
+
+    memcpy(&frame, block->data, sizeof(frame));
+    sim->status_valid = 0;
+    sim->status_checksum = checksum;
+    sim->request_frame = ntohs(frame);
+    sim->request_valid = 1;
+    sim->request_at = sim->done_at;
+
+}
+
+
+static void iac_spi_sim_block(iac_spi_sim_t *sim,
+                              const uint8_t *tx,
+                              uint8_t *rx,
+                              const size_t size,
+                              const uint64_t t)
+{
+    uint8_t buf[IAC_OBC_PACKET_SIZE_MAX];
+    iac_obc_block_t block;
+    uint64_t pending, turnaround = sim->params.turnaround;
+    int checksum, corrupted = 0;
+
+    checksum = iac_spi_sim_checksum(size, iac_obc_packet_size);
+    sim->stats.blocks++;
+    if (t < sim->busy_until) {
+        sim->stats.busy++;
+        return;
+    }
+    if (iac_spi_sim_chance(sim, sim->params.drop)) {
+        sim->stats.dropped++;
+        return;
+    }
+
+    /* Still processing earlier blocks and no room to buffer this one */
+    if (turnaround && sim->done_at > t) {
+        pending = (sim->done_at - t + turnaround - 1) / turnaround;
+        if (pending >= sim->params.queue) {
+            sim->stats.not_ready++;
+            return;
+        }
+    }
+
+    memcpy(buf, tx, size);
+    if (iac_spi_sim_chance(sim, sim->params.corrupt)) {
+        iac_spi_sim_corrupt(sim, buf, size);
+        sim->stats.corrupted++;
+        corrupted = 1;
+    }
+    if (iac_obc_packet_decode(&block, buf, checksum) == IAC_FAILURE) {
+        if (corrupted)
+            sim->stats.rejected++;
+        else
+            sim->stats.invalid++;
+        return;
+    }
+    if (corrupted)
+        sim->stats.undetected++;
+
+    sim->done_at = (sim->done_at > t ? sim->done_at : t) + turnaround;
+    sim->stats.accepted++;
+    rx[0] = IAC_OBC_BLOCK_ACK;
+
+    if (block.index == IAC_OBC_BLOCK_POLL)
+        iac_spi_sim_poll(sim, &block, checksum);
+    else if (block.index == IAC_OBC_BLOCK_REQUEST)
+        iac_spi_sim_poll_request(sim, &block, checksum);
+    else
+        iac_spi_sim_tile(sim, &block, checksum);
+
+}
+
+
+/* Answer status read with received bitmap of the polled window */
+static void iac_spi_sim_status(iac_spi_sim_t *sim,
+                               uint8_t *rx,
+                               const size_t size,
+                               const uint64_t t)
+{
+    const iac_spi_sim_tile_t *tile;
+    unsigned int k;
+
+    if (sim->request_valid) {
+        iac_spi_sim_request(sim, rx, size, t);
+        return;
+    }
+
+    sim->stats.status_reads++;
+    if (!sim->status_valid
+        || iac_spi_sim_checksum(size, iac_obc_status_size)
+        != sim->status_checksum
+        || t < sim->status_at
+        || t < sim->busy_until)
+        return;
+
+    tile = sim->tiles[sim->status.tile];
+    memset(sim->status.bitmap, 0, sizeof(sim->status.bitmap));
+    for (k = 0; tile && k < sim->status_count; k++) {
+        if (tile->done
+            || (sim->status.base + k < tile->capacity
+                && tile->received[sim->status.base + k]))
+            sim->status.bitmap[k / 8] |= (uint8_t) (1 << (k % 8));
+    }
+    iac_obc_status_encode(&sim->status, sim->status_checksum, rx);
+    if (iac_spi_sim_chance(sim, sim->params.corrupt)) {
+        iac_spi_sim_corrupt(sim, rx, size);
+        sim->stats.corrupted++;
+    }
+    sim->stats.status_sent++;
+
+}
+
+
+/*
+ * Answer request read with the next configured request for the polled
+ * frame, dropping the blocks it names so that they are received again.
+ */
+static void iac_spi_sim_request(iac_spi_sim_t *sim,
+                                uint8_t *rx,
+                                const size_t size,
+                                const uint64_t t)
+{
+    iac_obc_request_t request;
+    iac_spi_sim_tile_t *tile;
+    size_t k, last;
+
+    if (iac_spi_sim_checksum(size, iac_obc_status_size)
+        != sim->status_checksum
+        || t < sim->request_at
+        || t < sim->busy_until)
+        return;
+
+    memset(&request, 0, sizeof(request));
+    if (sim->requested < sim->params.request_count) {
+        request = sim->params.requests[sim->requested++];
+        tile = sim->tiles[request.tile];
+        last = (size_t) request.ranges[0].base + request.ranges[0].count;
+        for (k = request.ranges[0].base;
+             tile && k < last && k < tile->capacity;
+             k++) {
+            if (!tile->received[k])
+                continue;
+            tile->received[k] = 0;
+            memset(tile->data + k * IAC_OBC_BLOCK_SIZE,
+                   0,
+                   IAC_OBC_BLOCK_SIZE);
+            tile->count--;
+            if (tile->done) {
+                tile->done = 0;
+                sim->stats.tiles--;
+            }
+        }
+        sim->stats.requests++;
+    }
+    request.frame = sim->request_frame;
+    iac_obc_request_encode(&request, sim->status_checksum, rx);
+    sim->request_valid = 0;
+
+}
+
+
+static void iac_spi_sim_write(const iac_spi_sim_t *sim,
+                              const unsigned int tile,
+                              const uint8_t *data,
+                              const size_t size,
+                              const char *format)
+{
+    char path[PATH_MAX];
+    FILE *fp;
+
+    snprintf(path,
+             PATH_MAX,
+             "%s/obc-%u.%s",
+             sim->params.out,
+             tile,
+             format);
+    fp = fopen(path, "wb");
+    if (!fp) {
+        perror("Unable to write simulated tile");
+        return;
+    }
+    if (fwrite(data, 1, size, fp) != size)
+        perror("Unable to write simulated tile");
+    fclose(fp);
+
+}
+
+
+static void iac_spi_sim_report(const iac_spi_sim_t *sim)
+{
+    const iac_spi_sim_stats_t *stats = &sim->stats;
+    double elapsed = (double) (sim->end - sim->start) / 1000000;
+    unsigned int k, incomplete = 0;
+
+    for (k = 0; k <= UINT16_MAX; k++)
+        if (sim->tiles[k] && !sim->tiles[k]->done)
+            incomplete++;
+
+    fprintf(stderr,
+            "OBC simulator: %u tiles (%u uniform), %zu bytes in %.3f s "
+            "(%.1f kbit/s)\n",
+            stats->tiles,
+            stats->uniform,
+            stats->bytes,
+            elapsed,
+            elapsed > 0 ? (double) stats->bytes * 8 / elapsed / 1000 : 0);
+    fprintf(stderr,
+            "OBC simulator: %lu messages, %lu blocks, %lu accepted, "
+            "%lu dropped, %lu busy, %lu not ready\n",
+            stats->messages,
+            stats->blocks,
+            stats->accepted,
+            stats->dropped,
+            stats->busy,
+            stats->not_ready);
+    fprintf(stderr,
+            "OBC simulator: %lu corrupted, %lu rejected, %lu undetected, "
+            "%lu duplicate, %lu reordered, %lu invalid\n",
+            stats->corrupted,
+            stats->rejected,
+            stats->undetected,
+            stats->duplicate,
+            stats->reordered,
+            stats->invalid);
+    if (stats->polls || stats->status_reads)
+        fprintf(stderr,
+                "OBC simulator: %lu polls, %lu of %lu status reads "
+                "answered\n",
+                stats->polls,
+                stats->status_sent,
+                stats->status_reads);
+    if (stats->requests)
+        fprintf(stderr,
+                "OBC simulator: %lu retransmission requests\n",
+                stats->requests);
+    if (incomplete)
+        fprintf(stderr, "OBC simulator: %u incomplete tiles!\n", incomplete);
+
+}
+
+
+static void iac_spi_sim_free(iac_spi_sim_t *sim)
+{
+    unsigned int k;
+
+    for (k = 0; k <= UINT16_MAX; k++) {
+        if (sim->tiles[k]) {
+            free(sim->tiles[k]->data);
+            free(sim->tiles[k]->received);
+            free(sim->tiles[k]);
+        }
+    }
+    free(sim->params.out);
+    free(sim);
+
+}
+
+
+static void *iac_spi_sim_serve(void *data)
+{
+    iac_spi_sim_t *sim = data;
+    uint8_t msg[IAC_SPI_SIM_MSG_MAX];
+    uint8_t rx[IAC_SPI_SIM_MSG_MAX];
+    iac_spi_sim_msg_t header;
+    const uint8_t *tx;
+    uint64_t now, t, clock;
+    unsigned int i;
+    size_t size;
+    ssize_t n;
+
+    while ((n = recv(sim->fd, msg, sizeof(msg), 0)) > 0) {
+        if ((size_t) n < sizeof(header))
+            break;
+        memcpy(&header, msg, sizeof(header));
+        size = (size_t) header.count * header.size;
+        if (sizeof(header) + size != (size_t) n)
+            break;
+        tx = msg + sizeof(header);
+        memset(rx, 0, size);
+
+        now = iac_time_usec();
+        if (!sim->start)
+            sim->start = now;
+        sim->stats.messages++;
+        if (iac_spi_sim_chance(sim, sim->params.busy))
+            sim->busy_until = now + sim->params.busy_time * 1000ULL;
+
+        /* Each buffer is handled once it is clocked in */
+        clock = sim->params.rate ?
+            (uint64_t) header.size * 8 * 1000000 / sim->params.rate : 0;
+        for (i = 0, t = now; i < header.count; i++) {
+            t += clock;
+            if (iac_spi_sim_checksum(header.size, iac_obc_packet_size) != -1)
+                iac_spi_sim_block(sim,
+                                  tx + i * header.size,
+                                  rx + i * header.size,
+                                  header.size,
+                                  t);
+            else if (iac_spi_sim_checksum(header.size,
+                                          iac_obc_status_size) != -1)
+                iac_spi_sim_status(sim, rx + i * header.size, header.size, t);
+            else
+                sim->stats.invalid++;
+            t += header.delay;
+        }
+
+        /* Return once the whole message would have been clocked */
+        now = iac_time_usec();
+        if (t > now)
+            usleep((useconds_t) (t - now));
+        sim->end = t > now ? t : now;
+        if (send(sim->fd, rx, size, 0) == -1)
+            break;
+    }
+
+    iac_spi_sim_report(sim);
+    close(sim->fd);
+    iac_spi_sim_free(sim);
+
+    return NULL;
+}
@@ -19,6 +19,7 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
@@ -26,12 +27,20 @@
 #include <linux/spi/spidev.h>
 #include "iac.h"
 #include "spi.h"
+#include "trace.h"
 
 
 int iac_spi_init(const char *device, const iac_spi_init_params_t *params)
 {
+    size_t len = strlen(IAC_SPI_SIM_DEVICE);
     int fd;
 
+    /* Simulated OBC, "sim[:options]" */
+    if (!strncmp(device, IAC_SPI_SIM_DEVICE, len)
+        && (device[len] == ':' || !device[len]))
+        return iac_spi_sim_init(device[len] ? device + len + 1 : NULL,
+                                params);
+
     IAC_VERBOSE("Opening SPI device...\n");
     /* Open SPI device */
     fd = open(device, O_RDWR);
@@ -68,6 +77,14 @@ int iac_spi_init(const char *device, const iac_spi_init_params_t *params)
 int iac_spi_transfer(const int fd, uint8_t *buf, const uint32_t buf_siz)
 {
     struct spi_ioc_transfer transfer;
+    int ret = IAC_SUCCESS;
+
+    IAC_TRACE_ENTER("spi_transfer");
+    if (iac_spi_sim_match(fd)) {
+        ret = iac_spi_sim_transfer(fd, buf, buf, buf_siz, 1, 0);
+        IAC_TRACE_LEAVE("spi_transfer");
+        return ret;
+    }
 
     memset(&transfer, 0, sizeof(transfer));
 
@@ -78,6 +95,78 @@ int iac_spi_transfer(const int fd, uint8_t *buf, const uint32_t buf_siz)
     IAC_VERBOSE("Transferring SPI buffer with size %u...\n", buf_siz);
     if (ioctl(fd, SPI_IOC_MESSAGE(1), &transfer) == -1) {
         perror("Unable to write ioctl");
+        ret = IAC_FAILURE;
+    }
+    IAC_TRACE_LEAVE("spi_transfer");
+
+    return ret;
+}
+
+
+/*
+ * Clock `count' buffers of equal size in a single SPI message.  Chip
+ * select is released between buffers and held off for `delay_usecs'
+ * after each one, giving the OBC time to respond.
+ */
+int iac_spi_transfer_batch(const int fd,
+                           const uint8_t *tx_buf,
+                           uint8_t *rx_buf,
+                           const uint32_t buf_siz,
+                           const unsigned int count,
+                           const uint16_t delay_usecs)
+{
+    struct spi_ioc_transfer transfers[IAC_SPI_BATCH_MAX];
+    unsigned int i;
+    int ret = IAC_SUCCESS;
+
+    /* spidev takes an empty message as a no-op, leaving rx_buf stale */
+    if (!count || count > IAC_SPI_BATCH_MAX) {
+        fprintf(stderr,
+                "SPI buffers in batch must be between 1 and %u!\n",
+                IAC_SPI_BATCH_MAX);
+        return IAC_FAILURE;
+    }
+    IAC_TRACE_BEGIN_ARG("spi_batch", count);
+    if (iac_spi_sim_match(fd)) {
+        ret = iac_spi_sim_transfer(fd,
+                                   tx_buf,
+                                   rx_buf,
+                                   buf_siz,
+                                   count,
+                                   delay_usecs);
+        IAC_TRACE_LEAVE("spi_batch");
+        return ret;
+    }
+
+    memset(transfers, 0, sizeof(transfers[0]) * count);
+    for (i = 0; i < count; i++) {
+        transfers[i].tx_buf = (__u64) (uintptr_t) (tx_buf + i * buf_siz);
+        transfers[i].rx_buf = (__u64) (uintptr_t) (rx_buf + i * buf_siz);
+        transfers[i].len = buf_siz;
+        transfers[i].delay_usecs = delay_usecs;
+        transfers[i].cs_change = i < count - 1;
+    }
+
+    IAC_VERBOSE("Transferring %u SPI buffers with size %u...\n",
+                count,
+                buf_siz);
+    if (ioctl(fd, SPI_IOC_MESSAGE(count), transfers) == -1) {
+        perror("Unable to write ioctl");
+        ret = IAC_FAILURE;
+    }
+    IAC_TRACE_LEAVE("spi_batch");
+
+    return ret;
+}
+
+
+int iac_spi_close(const int fd)
+{
+
+    if (iac_spi_sim_match(fd))
+        return iac_spi_sim_close(fd);
+    if (close(fd) == -1) {
+        perror("Unable to close SPI device");
         return IAC_FAILURE;
     }
 
@@ -24,3 +24,19 @@ typedef struct iac_spi_init_params_t {
 
 int iac_spi_init(const char *, const iac_spi_init_params_t *);
 int iac_spi_transfer(const int fd, uint8_t *, const uint32_t);
+int iac_spi_transfer_batch(const int,
+                           const uint8_t *,
+                           uint8_t *,
+                           const uint32_t,
+                           const unsigned int,
+                           const uint16_t);
+int iac_spi_close(const int);
+int iac_spi_sim_init(const char *, const iac_spi_init_params_t *);
+int iac_spi_sim_match(const int);
+int iac_spi_sim_transfer(const int,
+                         const uint8_t *,
+                         uint8_t *,
+                         const uint32_t,
+                         const unsigned int,
+                         const uint16_t);
+int iac_spi_sim_close(const int);
@@ -0,0 +1,261 @@
+/*
+ * Copyright (C) 2016 Libre Space Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "iac.h"
+#include "utils.h"
+#include "spool.h"
+
+/*
+ * Spool of the encoded tiles of a frame in a single file.  Blobs are
+ * appended after the index, which is written empty when the spool is
+ * created and filled in when it is closed.  The spool is synced only
+ * on close, once for the blobs and the index and once more for the
+ * count of tiles, so that a spool cut short by a crash or power loss
+ * still opens, empty.  Readers map the whole file and serve tiles
+ * straight from the mapping, checking the CRC of each one.
+ */
+
+static int iac_spool_write(iac_spool_t *, const void *, size_t, off_t);
+static int iac_spool_sync(iac_spool_t *);
+
+static int iac_spool_write(iac_spool_t *spool,
+                           const void *buf,
+                           size_t size,
+                           off_t offset)
+{
+
+    if (pwrite(spool->fd, buf, size, offset) != (ssize_t) size) {
+        perror("Unable to write spool");
+        return IAC_FAILURE;
+    }
+
+    return IAC_SUCCESS;
+}
+
+
+static int iac_spool_sync(iac_spool_t *spool)
+{
+
+    if (fdatasync(spool->fd) == -1) {
+        perror("Unable to sync spool");
+        return IAC_FAILURE;
+    }
+
+    return IAC_SUCCESS;
+}
+
+
+int iac_spool_create(iac_spool_t *spool,
+                     const char *path,
+                     const uint32_t frame)
+{
+    iac_spool_header_t *header = &spool->header;
+
+    memset(spool, 0, sizeof(*spool));
+    spool->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (spool->fd == -1) {
+        perror("Unable to create spool");
+        return IAC_FAILURE;
+    }
+    spool->end = sizeof(spool->header);
+
+    /* Empty index, valid on its own */
+    header->magic = IAC_SPOOL_MAGIC;
+    header->version = IAC_SPOOL_VERSION;
+    header->frame = frame;
+    if (iac_spool_write(spool,
+                        header,
+                        sizeof(*header),
+                        0) == IAC_FAILURE) {
+        close(spool->fd);
+        return IAC_FAILURE;
+    }
+
+    return IAC_SUCCESS;
+}
+
+
+int iac_spool_append(iac_spool_t *spool,
+                     const unsigned int tile,
+                     const unsigned char *blob,
+                     const size_t size)
+{
+    iac_spool_entry_t *entry;
+    uint32_t count = spool->header.count;
+
+    if (count >= IAC_SPOOL_TILES || size > UINT32_MAX) {
+        fprintf(stderr, "Tile %u does not fit in spool!\n", tile);
+        return IAC_FAILURE;
+    }
+
+    entry = &spool->header.index[count];
+    entry->offset = spool->end;
+    entry->size = (uint32_t) size;
+    entry->tile = tile;
+    entry->crc = iac_crc32c(blob, size);
+
+    /* Entry is written with the index on close */
+    if (iac_spool_write(spool,
+                        blob,
+                        size,
+                        (off_t) spool->end) == IAC_FAILURE)
+        return IAC_FAILURE;
+    spool->header.count = count + 1;
+    spool->end += size;
+
+    return IAC_SUCCESS;
+}
+
+
+int iac_spool_close(iac_spool_t *spool)
+{
+    const iac_spool_header_t *header = &spool->header;
+    int ret = IAC_SUCCESS;
+
+    /* Sync blobs and index before the count which makes them valid */
+    if (iac_spool_write(spool,
+                        header->index,
+                        header->count * sizeof(header->index[0]),
+                        (off_t) offsetof(iac_spool_header_t, index))
+        == IAC_FAILURE
+        || iac_spool_sync(spool) == IAC_FAILURE
+        || iac_spool_write(spool,
+                           &header->count,
+                           sizeof(header->count),
+                           (off_t) offsetof(iac_spool_header_t, count))
+           == IAC_FAILURE
+        || iac_spool_sync(spool) == IAC_FAILURE)
+        ret = IAC_FAILURE;
+    if (close(spool->fd) == -1) {
+        perror("Unable to close spool");
+        ret = IAC_FAILURE;
+    }
+
+    return ret;
+}
+
+
+int iac_spool_map(iac_spool_t *spool, const char *path)
+{
+    const iac_spool_header_t *header;
+    struct stat st;
+    unsigned int k;
+    void *map;
+
+    memset(spool, 0, sizeof(*spool));
+    spool->fd = open(path, O_RDONLY);
+    if (spool->fd == -1) {
+        perror("Unable to open spool");
+        return IAC_FAILURE;
+    }
+    if (fstat(spool->fd, &st) == -1) {
+        perror("Unable to stat spool");
+        close(spool->fd);
+        return IAC_FAILURE;
+    }
+    if ((size_t) st.st_size < sizeof(*header)) {
+        fprintf(stderr, "Spool %s is truncated!\n", path);
+        close(spool->fd);
+        return IAC_FAILURE;
+    }
+    map = mmap(NULL,
+               (size_t) st.st_size,
+               PROT_READ,
+               MAP_SHARED,
+               spool->fd,
+               0);
+    if (map == MAP_FAILED) {
+        perror("Unable to map spool");
+        close(spool->fd);
+        return IAC_FAILURE;
+    }
+    spool->map = map;
+    spool->map_size = (size_t) st.st_size;
+
+    /* Check index before serving any tile from it */
+    header = iac_spool_index(spool);
+    if (header->magic != IAC_SPOOL_MAGIC
+        || header->version != IAC_SPOOL_VERSION
+        || header->count > IAC_SPOOL_TILES) {
+        fprintf(stderr, "Spool %s is invalid!\n", path);
+        iac_spool_unmap(spool);
+        return IAC_FAILURE;
+    }
+    for (k = 0; k < header->count; k++) {
+        if (header->index[k].offset > spool->map_size
+            || header->index[k].size
+            > spool->map_size - header->index[k].offset) {
+            fprintf(stderr, "Spool %s is truncated!\n", path);
+            iac_spool_unmap(spool);
+            return IAC_FAILURE;
+        }
+    }
+
+    return IAC_SUCCESS;
+}
+
+
+const iac_spool_header_t *iac_spool_index(const iac_spool_t *spool)
+{
+
+    return (const iac_spool_header_t *) (const void *) spool->map;
+}
+
+
+/* Blob of tile in the mapped spool, or NULL if missing or corrupted */
+const uint8_t *iac_spool_tile(const iac_spool_t *spool,
+                              const unsigned int tile,
+                              size_t *size)
+{
+    const iac_spool_header_t *header = iac_spool_index(spool);
+    const iac_spool_entry_t *entry;
+    unsigned int k;
+
+    for (k = 0; k < header->count; k++) {
+        entry = &header->index[k];
+        if (entry->tile != tile)
+            continue;
+        if (iac_crc32c(spool->map + entry->offset, entry->size)
+            != entry->crc) {
+            fprintf(stderr, "Tile %u of spool is corrupted!\n", tile);
+            return NULL;
+        }
+        *size = entry->size;
+        return spool->map + entry->offset;
+    }
+
+    return NULL;
+}
+
+
+void iac_spool_unmap(iac_spool_t *spool)
+{
+
+    munmap((void *) (uintptr_t) spool->map, spool->map_size);
+    close(spool->fd);
+    spool->map = NULL;
+
+}
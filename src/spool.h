@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2016 Libre Space Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SPOOL_H
+#define __SPOOL_H
+
+#define IAC_SPOOL_MAGIC                 0x53434149
+#define IAC_SPOOL_VERSION               2
+#define IAC_SPOOL_TILES                 (IAC_IMAGE_TILES_MAX + 2)
+
+typedef struct iac_spool_entry_t {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t tile;
+    uint32_t crc;
+    uint32_t reserved;
+} iac_spool_entry_t;
+
+/*
+ * Spool file header, in native byte order.  The index has a fixed size
+ * and is followed by the tile blobs in the order they were appended.
+ */
+typedef struct iac_spool_header_t {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t frame;
+    uint32_t count;
+    iac_spool_entry_t index[IAC_SPOOL_TILES];
+} iac_spool_header_t;
+
+typedef struct iac_spool_t {
+    int fd;
+    uint64_t end;
+    iac_spool_header_t header;
+    const uint8_t *map;
+    size_t map_size;
+} iac_spool_t;
+
+int iac_spool_create(iac_spool_t *, const char *, const uint32_t);
+int iac_spool_append(iac_spool_t *,
+                     const unsigned int,
+                     const unsigned char *,
+                     const size_t);
+int iac_spool_close(iac_spool_t *);
+int iac_spool_map(iac_spool_t *, const char *);
+const iac_spool_header_t *iac_spool_index(const iac_spool_t *);
+const uint8_t *iac_spool_tile(const iac_spool_t *,
+                              const unsigned int,
+                              size_t *);
+void iac_spool_unmap(iac_spool_t *);
+
+#endif
@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2016 Libre Space Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "iac.h"
+#include "trace.h"
+
+int iac_trace_enabled = 0;
+
+/*
+ * Rings of all threads, pushed without locking.  A ring is taken back
+ * when its thread exits and reused by the next thread needing one, so
+ * that threads started per frame do not add a ring each.
+ */
+static iac_trace_ring_t *iac_trace_rings = NULL;
+static unsigned int iac_trace_tids = 0;
+static __thread iac_trace_ring_t *iac_trace_ring = NULL;
+static pthread_key_t iac_trace_key;
+static const char *iac_trace_path = NULL;
+
+static iac_trace_ring_t *iac_trace_ring_new(void);
+static void iac_trace_ring_put(void *);
+static void iac_trace_exit(void);
+static void iac_trace_dump_csv(FILE *);
+static void iac_trace_dump_json(FILE *);
+
+/* Enable tracing, dumping events to file at exit */
+int iac_trace_start(const char *path)
+{
+
+    iac_trace_path = path;
+    if (pthread_key_create(&iac_trace_key, iac_trace_ring_put)) {
+        fprintf(stderr, "Unable to create trace key!\n");
+        return IAC_FAILURE;
+    }
+    if (atexit(iac_trace_exit)) {
+        fprintf(stderr, "Unable to register trace dump!\n");
+        return IAC_FAILURE;
+    }
+    iac_trace_enabled = 1;
+
+    return IAC_SUCCESS;
+}
+
+
+/*
+ * Take a ring left by a thread which exited, keeping its events and id,
+ * or add a new one.
+ */
+static iac_trace_ring_t *iac_trace_ring_new(void)
+{
+    iac_trace_ring_t *ring;
+    int busy;
+
+    for (ring = __atomic_load_n(&iac_trace_rings, __ATOMIC_ACQUIRE);
+         ring;
+         ring = ring->next) {
+        busy = 0;
+        if (__atomic_compare_exchange_n(&ring->busy,
+                                        &busy,
+                                        1,
+                                        0,
+                                        __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (!ring) {
+        ring = calloc(1, sizeof(*ring));
+        if (!ring)
+            return NULL;
+        ring->events = malloc(IAC_TRACE_EVENTS * sizeof(*ring->events));
+        if (!ring->events) {
+            free(ring);
+            return NULL;
+        }
+        ring->tid = __atomic_add_fetch(&iac_trace_tids,
+                                       1,
+                                       __ATOMIC_RELAXED);
+        ring->busy = 1;
+
+        ring->next = __atomic_load_n(&iac_trace_rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&iac_trace_rings,
+                                            &ring->next,
+                                            ring,
+                                            1,
+                                            __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED))
+            ;
+    }
+    pthread_setspecific(iac_trace_key, ring);
+    iac_trace_ring = ring;
+
+    return ring;
+}
+
+
+/* Give ring back at exit of its thread */
+static void iac_trace_ring_put(void *ring)
+{
+
+    __atomic_store_n(&((iac_trace_ring_t *) ring)->busy,
+                     0,
+                     __ATOMIC_RELEASE);
+
+}
+
+
+/*
+ * Record event in the ring of the calling thread, overwriting the oldest
+ * events once it is full.
+ */
+void iac_trace_event(const char *name,
+                     const char phase,
+                     const unsigned int arg)
+{
+    iac_trace_ring_t *ring = iac_trace_ring;
+    iac_trace_event_t *event;
+    struct timespec ts;
+
+    if (!ring) {
+        ring = iac_trace_ring_new();
+        if (!ring)
+            return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    event = &ring->events[ring->head % IAC_TRACE_EVENTS];
+    event->ts = (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+    event->name = name;
+    event->arg = arg;
+    event->phase = phase;
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+
+}
+
+
+static void iac_trace_exit(void)
+{
+
+    iac_trace_enabled = 0;
+    iac_trace_dump(iac_trace_path);
+
+}
+
+
+static void iac_trace_dump_csv(FILE *fp)
+{
+    const iac_trace_ring_t *ring;
+    const iac_trace_event_t *event;
+    uint64_t k, head;
+
+    fprintf(fp, "tid,name,phase,arg,ts_ns\n");
+    for (ring = __atomic_load_n(&iac_trace_rings, __ATOMIC_ACQUIRE);
+         ring;
+         ring = ring->next) {
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        k = head > IAC_TRACE_EVENTS ? head - IAC_TRACE_EVENTS : 0;
+        for (; k < head; k++) {
+            event = &ring->events[k % IAC_TRACE_EVENTS];
+            fprintf(fp,
+                    "%u,%s,%c,%u,%llu\n",
+                    ring->tid,
+                    event->name,
+                    event->phase,
+                    event->arg,
+                    (unsigned long long) event->ts);
+        }
+    }
+
+}
+
+
+/* Chrome trace event format, as loaded by chrome://tracing or Perfetto */
+static void iac_trace_dump_json(FILE *fp)
+{
+    const iac_trace_ring_t *ring;
+    const iac_trace_event_t *event;
+    uint64_t k, head;
+    int first = 1;
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (ring = __atomic_load_n(&iac_trace_rings, __ATOMIC_ACQUIRE);
+         ring;
+         ring = ring->next) {
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        k = head > IAC_TRACE_EVENTS ? head - IAC_TRACE_EVENTS : 0;
+        for (; k < head; k++) {
+            event = &ring->events[k % IAC_TRACE_EVENTS];
+            fprintf(fp,
+                    "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,"
+                    "\"pid\":%d,\"tid\":%u,\"args\":{\"arg\":%u}}",
+                    first ? "" : ",",
+                    event->name,
+                    event->phase,
+                    (double) event->ts / 1000,
+                    (int) getpid(),
+                    ring->tid,
+                    event->arg);
+            first = 0;
+        }
+    }
+    fprintf(fp, "\n]}\n");
+
+}
+
+
+/* Dump events as CSV if path ends in .csv, as Chrome trace otherwise */
+int iac_trace_dump(const char *path)
+{
+    size_t len = strlen(path);
+    FILE *fp;
+
+    fp = fopen(path, "w");
+    if (!fp) {
+        perror("Unable to open trace file");
+        return IAC_FAILURE;
+    }
+    if (len > 4 && !strcmp(path + len - 4, ".csv"))
+        iac_trace_dump_csv(fp);
+    else
+        iac_trace_dump_json(fp);
+    if (fclose(fp)) {
+        perror("Unable to write trace file");
+        return IAC_FAILURE;
+    }
+
+    return IAC_SUCCESS;
+}
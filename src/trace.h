@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2016 Libre Space Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#define IAC_TRACE_BEGIN                 'B'
+#define IAC_TRACE_END                   'E'
+
+typedef struct iac_trace_event_t {
+    uint64_t ts;
+    const char *name;
+    unsigned int arg;
+    char phase;
+} iac_trace_event_t;
+
+typedef struct iac_trace_ring_t {
+    iac_trace_event_t *events;
+    uint64_t head;
+    unsigned int tid;
+    int busy;
+    struct iac_trace_ring_t *next;
+} iac_trace_ring_t;
+
+/*
+ * Trace points cost a test of a global flag when tracing is not enabled
+ * at run time, and nothing when built without IAC_HAVE_TRACE.  Names
+ * must be string literals, as only their pointers are recorded.
+ */
+#ifdef IAC_HAVE_TRACE
+#define IAC_TRACE_BEGIN_ARG(name, arg)  do { \
+        if (iac_trace_enabled) \
+            iac_trace_event((name), IAC_TRACE_BEGIN, (arg)); \
+    } while (0)
+#define IAC_TRACE_ENTER(name)           IAC_TRACE_BEGIN_ARG(name, 0)
+#define IAC_TRACE_LEAVE(name)           do { \
+        if (iac_trace_enabled) \
+            iac_trace_event((name), IAC_TRACE_END, 0); \
+    } while (0)
+#else
+#define IAC_TRACE_BEGIN_ARG(name, arg)
+#define IAC_TRACE_ENTER(name)
+#define IAC_TRACE_LEAVE(name)
+#endif
+
+extern int iac_trace_enabled;
+
+int iac_trace_start(const char *);
+void iac_trace_event(const char *, const char, const unsigned int);
+int iac_trace_dump(const char *);
+
+#endif
@@ -18,10 +18,57 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
+#if defined(__SSE4_2__) && defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
 #include "utils.h"
 
+#define IAC_CRC16_POLY                  0x1021
+#define IAC_CRC32C_POLY                 0x82f63b78
+
+static uint16_t crc16_table[8][256];
+static uint32_t crc32c_table[8][256];
+
+static void iac_crc_init(void) __attribute__((constructor));
+
+/*
+ * Slicing-by-8 tables, entry k of table n being the CRC of byte k
+ * followed by n zero bytes.
+ */
+static void iac_crc_init(void)
+{
+    uint16_t crc16;
+    uint32_t crc32;
+    unsigned int i, j;
+
+    for (i = 0; i < 256; i++) {
+        crc16 = (uint16_t) (i << 8);
+        crc32 = i;
+        for (j = 0; j < 8; j++) {
+            crc16 = (uint16_t) (crc16 & 0x8000 ?
+                                (crc16 << 1) ^ IAC_CRC16_POLY : crc16 << 1);
+            crc32 = crc32 & 1 ? (crc32 >> 1) ^ IAC_CRC32C_POLY : crc32 >> 1;
+        }
+        crc16_table[0][i] = crc16;
+        crc32c_table[0][i] = crc32;
+    }
+    for (i = 0; i < 256; i++) {
+        for (j = 1; j < 8; j++) {
+            crc16 = crc16_table[j - 1][i];
+            crc16_table[j][i] = (uint16_t) ((crc16 << 8)
+                                            ^ crc16_table[0][crc16 >> 8]);
+            crc32 = crc32c_table[j - 1][i];
+            crc32c_table[j][i] = (crc32 >> 8) ^ crc32c_table[0][crc32 & 0xff];
+        }
+    }
+
+}
+
 uint8_t *iac_serialize(uint8_t *buf,
                        size_t *buf_size,
                        const uint8_t data)
@@ -91,6 +138,53 @@ uint8_t *iac_serialize_data(uint8_t *buf,
 }
 
 
+uint8_t *iac_pack(uint8_t *buf, const uint8_t data)
+{
+
+    *buf = data;
+
+    return buf + sizeof(data);
+}
+
+
+uint8_t *iac_pack_short(uint8_t *buf, uint16_t data)
+{
+
+    data = htons(data);
+    memcpy(buf, &data, sizeof(data));
+
+    return buf + sizeof(data);
+}
+
+
+uint8_t *iac_pack_long(uint8_t *buf, uint32_t data)
+{
+
+    data = htonl(data);
+    memcpy(buf, &data, sizeof(data));
+
+    return buf + sizeof(data);
+}
+
+
+uint8_t *iac_pack_pad(uint8_t *buf, const uint8_t data, const size_t size)
+{
+
+    memset(buf, data, size);
+
+    return buf + size;
+}
+
+
+uint8_t *iac_pack_data(uint8_t *buf, const uint8_t *data, const size_t size)
+{
+
+    memcpy(buf, data, size);
+
+    return buf + size;
+}
+
+
 uint8_t iac_lrc(const uint8_t *buf, const size_t size)
 {
     uint8_t lrc = 0;
@@ -102,3 +196,91 @@ uint8_t iac_lrc(const uint8_t *buf, const size_t size)
 
     return lrc;
 }
+
+
+/* CRC-16/CCITT-FALSE */
+uint16_t iac_crc16(const uint8_t *buf, const size_t size)
+{
+    uint16_t crc = 0xffff;
+    size_t i = 0;
+
+    for (; i + 8 <= size; i += 8) {
+        crc ^= (uint16_t) (buf[i] << 8 | buf[i + 1]);
+        crc = crc16_table[7][crc >> 8]
+            ^ crc16_table[6][crc & 0xff]
+            ^ crc16_table[5][buf[i + 2]]
+            ^ crc16_table[4][buf[i + 3]]
+            ^ crc16_table[3][buf[i + 4]]
+            ^ crc16_table[2][buf[i + 5]]
+            ^ crc16_table[1][buf[i + 6]]
+            ^ crc16_table[0][buf[i + 7]];
+    }
+    for (; i < size; i++)
+        crc = (uint16_t) ((crc << 8) ^ crc16_table[0][(crc >> 8) ^ buf[i]]);
+
+    return crc;
+}
+
+
+/* CRC-32C (Castagnoli), in hardware where the target has it */
+uint32_t iac_crc32c(const uint8_t *buf, const size_t size)
+{
+
+    return iac_crc32c_update(0, buf, size);
+}
+
+
+/* Continue CRC-32C of preceding data over more data */
+uint32_t iac_crc32c_update(const uint32_t previous,
+                           const uint8_t *buf,
+                           const size_t size)
+{
+    uint32_t crc = ~previous;
+#if (defined(__SSE4_2__) && defined(__x86_64__)) \
+    || defined(__ARM_FEATURE_CRC32)
+    uint64_t data;
+#endif
+    size_t i = 0;
+
+#if (defined(__SSE4_2__) && defined(__x86_64__)) \
+    || defined(__ARM_FEATURE_CRC32)
+    for (; i + 8 <= size; i += 8) {
+        memcpy(&data, buf + i, sizeof(data));
+#if defined(__SSE4_2__)
+        crc = (uint32_t) _mm_crc32_u64(crc, data);
+#else
+        crc = __crc32cd(crc, data);
+#endif
+    }
+#else
+    /* Only 32-bit words, which is all a 32-bit target has registers for */
+    for (; i + 8 <= size; i += 8) {
+        crc ^= (uint32_t) buf[i]
+            | (uint32_t) buf[i + 1] << 8
+            | (uint32_t) buf[i + 2] << 16
+            | (uint32_t) buf[i + 3] << 24;
+        crc = crc32c_table[7][crc & 0xff]
+            ^ crc32c_table[6][(crc >> 8) & 0xff]
+            ^ crc32c_table[5][(crc >> 16) & 0xff]
+            ^ crc32c_table[4][crc >> 24]
+            ^ crc32c_table[3][buf[i + 4]]
+            ^ crc32c_table[2][buf[i + 5]]
+            ^ crc32c_table[1][buf[i + 6]]
+            ^ crc32c_table[0][buf[i + 7]];
+    }
+#endif
+    for (; i < size; i++)
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ buf[i]) & 0xff];
+
+    return ~crc;
+}
+
+
+uint64_t iac_time_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
@@ -35,6 +35,15 @@ uint8_t *iac_serialize_data(uint8_t *,
                             size_t *,
                             const uint8_t *,
                             const size_t);
+uint8_t *iac_pack(uint8_t *, const uint8_t);
+uint8_t *iac_pack_short(uint8_t *, const uint16_t);
+uint8_t *iac_pack_long(uint8_t *, const uint32_t);
+uint8_t *iac_pack_pad(uint8_t *, const uint8_t, const size_t);
+uint8_t *iac_pack_data(uint8_t *, const uint8_t *, const size_t);
 uint8_t iac_lrc(const uint8_t *, const size_t);
+uint16_t iac_crc16(const uint8_t *, const size_t);
+uint32_t iac_crc32c(const uint8_t *, const size_t);
+uint32_t iac_crc32c_update(const uint32_t, const uint8_t *, const size_t);
+uint64_t iac_time_usec(void);
 
 #endif
@@ -0,0 +1,442 @@
+/*
+ * Copyright (C) 2016 Libre Space Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#ifdef IAC_HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#include "iac.h"
+#include "utils.h"
+#include "writer.h"
+
+/*
+ * Tile files are opened as they are handed over, their blob written in
+ * the background and closed.  None is synced on its own: the file
+ * system holding them is synced once, when the frame is done, which
+ * commits their data and the directory entries together.  Throughput
+ * is timed from the first file handed over.
+ */
+
+static void iac_writer_done(iac_writer_t *, iac_writer_file_t *);
+static void *iac_writer_worker(void *);
+#ifdef IAC_HAVE_IO_URING
+static int iac_writer_ring_setup(iac_writer_ring_t *);
+static void iac_writer_ring_free(iac_writer_ring_t *);
+static int iac_writer_ring_submit(iac_writer_t *, const unsigned int);
+static int iac_writer_ring_reap(iac_writer_t *, const unsigned int);
+#endif
+
+/* Close a written file and hand its blob back */
+static void iac_writer_done(iac_writer_t *writer, iac_writer_file_t *file)
+{
+
+    if (close(file->fd) == -1) {
+        perror("Unable to close tile file");
+        file->failed = 1;
+    }
+    writer->release(writer->data, file->blob);
+    if (file->failed) {
+        writer->failed = 1;
+    }
+    else {
+        writer->stats.files++;
+        writer->stats.bytes += file->size;
+    }
+    file->blob = NULL;
+
+}
+
+
+/* Write queued files in order, when io_uring is missing */
+static void *iac_writer_worker(void *arg)
+{
+    iac_writer_t *writer = arg;
+    iac_writer_file_t *file;
+    size_t done;
+    ssize_t ret;
+
+    for (;;) {
+        pthread_mutex_lock(&writer->lock);
+        while (!writer->stopped && writer->head == writer->tail)
+            pthread_cond_wait(&writer->queued, &writer->lock);
+        if (writer->head == writer->tail) {
+            pthread_mutex_unlock(&writer->lock);
+            break;
+        }
+        file = &writer->files[writer->head % IAC_WRITER_DEPTH];
+        pthread_mutex_unlock(&writer->lock);
+
+        for (done = 0; done < file->size; done += (size_t) ret) {
+            ret = pwrite(file->fd,
+                         file->blob + done,
+                         file->size - done,
+                         (off_t) done);
+            if (ret <= 0) {
+                if (ret == -1)
+                    perror("Unable to write tile file");
+                else
+                    fprintf(stderr, "Tile file is full!\n");
+                file->failed = 1;
+                break;
+            }
+        }
+
+        pthread_mutex_lock(&writer->lock);
+        iac_writer_done(writer, file);
+        writer->head++;
+        pthread_cond_broadcast(&writer->written);
+        pthread_mutex_unlock(&writer->lock);
+    }
+
+    return NULL;
+}
+
+
+#ifdef IAC_HAVE_IO_URING
+/*
+ * Set up a ring for a write of every file in flight.  Kernels
+ * without IORING_OP_WRITE, told apart by the features that came with it,
+ * are left to the thread.
+ */
+static int iac_writer_ring_setup(iac_writer_ring_t *ring)
+{
+    struct io_uring_params params;
+    uint8_t *sq, *cq;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int) syscall(__NR_io_uring_setup,
+                             IAC_WRITER_DEPTH,
+                             &params);
+    if (ring->fd == -1)
+        return IAC_FAILURE;
+    if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+        close(ring->fd);
+        return IAC_FAILURE;
+    }
+
+    ring->sq_size = params.sq_off.array
+        + params.sq_entries * sizeof(unsigned int);
+    ring->cq_size = params.cq_off.cqes
+        + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_size > ring->sq_size)
+            ring->sq_size = ring->cq_size;
+        ring->cq_size = 0;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq = mmap(NULL,
+                    ring->sq_size,
+                    PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE,
+                    ring->fd,
+                    IORING_OFF_SQ_RING);
+    ring->cq = ring->cq_size ?
+        mmap(NULL,
+             ring->cq_size,
+             PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE,
+             ring->fd,
+             IORING_OFF_CQ_RING) : ring->sq;
+    ring->sqes = mmap(NULL,
+                      ring->sqes_size,
+                      PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE,
+                      ring->fd,
+                      IORING_OFF_SQES);
+    if (ring->sq == MAP_FAILED
+        || ring->cq == MAP_FAILED
+        || ring->sqes == MAP_FAILED) {
+        perror("Unable to map io_uring");
+        iac_writer_ring_free(ring);
+        return IAC_FAILURE;
+    }
+
+    sq = ring->sq;
+    cq = ring->cq;
+    ring->sq_tail = (unsigned int *) (void *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *) (void *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *) (void *) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned int *) (void *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *) (void *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *) (void *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (void *) (cq + params.cq_off.cqes);
+
+    return IAC_SUCCESS;
+}
+
+
+static void iac_writer_ring_free(iac_writer_ring_t *ring)
+{
+
+    if (ring->sqes && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_size && ring->cq && ring->cq != MAP_FAILED)
+        munmap(ring->cq, ring->cq_size);
+    if (ring->sq && ring->sq != MAP_FAILED)
+        munmap(ring->sq, ring->sq_size);
+    close(ring->fd);
+
+}
+
+
+/* Queue write of file `k' */
+static int iac_writer_ring_submit(iac_writer_t *writer, const unsigned int k)
+{
+    iac_writer_ring_t *ring = &writer->ring;
+    iac_writer_file_t *file = &writer->files[k];
+    struct io_uring_sqe *sqe;
+    unsigned int tail, index;
+
+    tail = *ring->sq_tail;
+    index = tail & *ring->sq_mask;
+    sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = file->fd;
+    sqe->addr = (uint64_t) (uintptr_t) file->blob;
+    sqe->len = (uint32_t) file->size;
+    sqe->user_data = k;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    writer->active++;
+
+    while (syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0) == -1) {
+        if (errno != EINTR) {
+            /*
+             * Nothing was consumed by the kernel, so take the entry back
+             * and fail the file, leaving no completion to wait for.
+             */
+            perror("Unable to submit tile file");
+            __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+            file->failed = 1;
+            writer->active--;
+            iac_writer_done(writer, file);
+            return IAC_FAILURE;
+        }
+    }
+
+    return IAC_SUCCESS;
+}
+
+
+/* Complete files whose write is done, waiting for `wait' */
+static int iac_writer_ring_reap(iac_writer_t *writer, const unsigned int wait)
+{
+    iac_writer_ring_t *ring = &writer->ring;
+    struct io_uring_cqe *cqe;
+    iac_writer_file_t *file;
+    unsigned int head;
+
+    if (wait
+        && syscall(__NR_io_uring_enter,
+                   ring->fd,
+                   0,
+                   wait,
+                   IORING_ENTER_GETEVENTS,
+                   NULL,
+                   0) == -1
+        && errno != EINTR) {
+        perror("Unable to wait for tile files");
+        return IAC_FAILURE;
+    }
+
+    head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        cqe = &ring->cqes[head++ & *ring->cq_mask];
+        file = &writer->files[cqe->user_data];
+        if (cqe->res < 0) {
+            errno = -cqe->res;
+            perror("Unable to write tile file");
+            file->failed = 1;
+        }
+        else if ((size_t) cqe->res != file->size) {
+            fprintf(stderr, "Tile file is short!\n");
+            file->failed = 1;
+        }
+        iac_writer_done(writer, file);
+        writer->active--;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    return IAC_SUCCESS;
+}
+#endif
+
+
+int iac_writer_open(iac_writer_t *writer,
+                    const char *dir,
+                    iac_writer_release_t release,
+                    void *data)
+{
+
+    memset(writer, 0, sizeof(*writer));
+    writer->dir = open(dir, O_RDONLY | O_DIRECTORY);
+    if (writer->dir == -1) {
+        perror("Unable to open output directory");
+        return IAC_FAILURE;
+    }
+    writer->release = release;
+    writer->data = data;
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->queued, NULL);
+    pthread_cond_init(&writer->written, NULL);
+
+#ifdef IAC_HAVE_IO_URING
+    if (iac_writer_ring_setup(&writer->ring) == IAC_SUCCESS) {
+        writer->uring = 1;
+        return IAC_SUCCESS;
+    }
+    IAC_VERBOSE("No io_uring, writing tile files from a thread...\n");
+#endif
+    if (pthread_create(&writer->thread, NULL, iac_writer_worker, writer)) {
+        fprintf(stderr, "Unable to start writer thread!\n");
+        pthread_cond_destroy(&writer->written);
+        pthread_cond_destroy(&writer->queued);
+        pthread_mutex_destroy(&writer->lock);
+        close(writer->dir);
+        return IAC_FAILURE;
+    }
+
+    return IAC_SUCCESS;
+}
+
+
+/*
+ * Create tile file `name' and write `blob' to it in the background.  The
+ * blob is handed over and released once written, even on failure.
+ */
+int iac_writer_file(iac_writer_t *writer,
+                    const char *name,
+                    unsigned char *blob,
+                    const size_t size)
+{
+    iac_writer_file_t *file;
+    unsigned int k;
+    int fd, ret;
+
+    if (!writer->start)
+        writer->start = iac_time_usec();
+    fd = openat(writer->dir, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("Unable to open tile file");
+        writer->release(writer->data, blob);
+        return IAC_FAILURE;
+    }
+
+#ifdef IAC_HAVE_IO_URING
+    if (writer->uring) {
+        while (writer->active == IAC_WRITER_DEPTH)
+            if (iac_writer_ring_reap(writer, 1) == IAC_FAILURE)
+                break;
+        for (k = 0; k < IAC_WRITER_DEPTH && writer->files[k].blob; k++)
+            ;
+        if (k == IAC_WRITER_DEPTH) {
+            close(fd);
+            writer->release(writer->data, blob);
+            return IAC_FAILURE;
+        }
+        file = &writer->files[k];
+        file->fd = fd;
+        file->blob = blob;
+        file->size = size;
+        file->failed = 0;
+        if (iac_writer_ring_submit(writer, k) == IAC_FAILURE
+            || iac_writer_ring_reap(writer, 0) == IAC_FAILURE)
+            return IAC_FAILURE;
+        return writer->failed ? IAC_FAILURE : IAC_SUCCESS;
+    }
+#endif
+
+    pthread_mutex_lock(&writer->lock);
+    while (writer->tail - writer->head == IAC_WRITER_DEPTH)
+        pthread_cond_wait(&writer->written, &writer->lock);
+    k = writer->tail % IAC_WRITER_DEPTH;
+    file = &writer->files[k];
+    file->fd = fd;
+    file->blob = blob;
+    file->size = size;
+    file->failed = 0;
+    writer->tail++;
+    pthread_cond_signal(&writer->queued);
+    ret = writer->failed ? IAC_FAILURE : IAC_SUCCESS;
+    pthread_mutex_unlock(&writer->lock);
+
+    return ret;
+}
+
+
+/* Wait for all files of the frame and sync the file system holding them */
+int iac_writer_sync(iac_writer_t *writer)
+{
+
+#ifdef IAC_HAVE_IO_URING
+    while (writer->uring && writer->active)
+        if (iac_writer_ring_reap(writer, 1) == IAC_FAILURE)
+            return IAC_FAILURE;
+#endif
+    pthread_mutex_lock(&writer->lock);
+    while (writer->head != writer->tail)
+        pthread_cond_wait(&writer->written, &writer->lock);
+    pthread_mutex_unlock(&writer->lock);
+
+    if (syncfs(writer->dir) == -1) {
+        perror("Unable to sync output directory");
+        writer->failed = 1;
+    }
+    if (writer->start)
+        writer->stats.usec = iac_time_usec() - writer->start;
+
+    return writer->failed ? IAC_FAILURE : IAC_SUCCESS;
+}
+
+
+void iac_writer_close(iac_writer_t *writer)
+{
+
+#ifdef IAC_HAVE_IO_URING
+    if (writer->uring) {
+        while (writer->active)
+            if (iac_writer_ring_reap(writer, 1) == IAC_FAILURE)
+                break;
+        iac_writer_ring_free(&writer->ring);
+    }
+#endif
+    if (!writer->uring) {
+        pthread_mutex_lock(&writer->lock);
+        writer->stopped = 1;
+        pthread_cond_signal(&writer->queued);
+        pthread_mutex_unlock(&writer->lock);
+        pthread_join(writer->thread, NULL);
+    }
+    pthread_cond_destroy(&writer->written);
+    pthread_cond_destroy(&writer->queued);
+    pthread_mutex_destroy(&writer->lock);
+    close(writer->dir);
+
+}
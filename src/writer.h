@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2016 Libre Space Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __WRITER_H
+#define __WRITER_H
+
+#include <stdint.h>
+#include <pthread.h>
+#ifdef IAC_HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+typedef void (*iac_writer_release_t)(void *, unsigned char *);
+
+/* Tile file being written, owning its blob until written */
+typedef struct iac_writer_file_t {
+    int fd;
+    unsigned char *blob;
+    size_t size;
+    int failed;
+} iac_writer_file_t;
+
+#ifdef IAC_HAVE_IO_URING
+typedef struct iac_writer_ring_t {
+    int fd;
+    void *sq;
+    size_t sq_size;
+    void *cq;
+    size_t cq_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+} iac_writer_ring_t;
+#endif
+
+typedef struct iac_writer_stats_t {
+    unsigned int files;
+    size_t bytes;
+    uint64_t usec;
+} iac_writer_stats_t;
+
+/*
+ * Writer of the tile files of a frame to a directory.  Files are written
+ * asynchronously, through io_uring where the kernel allows it or else by
+ * a thread with pwrite, up to IAC_WRITER_DEPTH at once, and synced
+ * together when the frame is done.
+ */
+typedef struct iac_writer_t {
+    int dir;
+    int uring;
+    iac_writer_release_t release;
+    void *data;
+    iac_writer_file_t files[IAC_WRITER_DEPTH];
+    unsigned int active;
+    int failed;
+#ifdef IAC_HAVE_IO_URING
+    iac_writer_ring_t ring;
+#endif
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t written;
+    unsigned int head;
+    unsigned int tail;
+    int stopped;
+    uint64_t start;
+    iac_writer_stats_t stats;
+} iac_writer_t;
+
+int iac_writer_open(iac_writer_t *,
+                    const char *,
+                    iac_writer_release_t,
+                    void *);
+int iac_writer_file(iac_writer_t *,
+                    const char *,
+                    unsigned char *,
+                    const size_t);
+int iac_writer_sync(iac_writer_t *);
+void iac_writer_close(iac_writer_t *);
+
+#endif
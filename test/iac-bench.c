@@ -0,0 +1,642 @@
+/*
+ * Copyright (C) 2016 Libre Space Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <wand/magick_wand.h>
+#include <linux/spi/spidev.h>
+#include "iac.h"
+#include "camera.h"
+#include "image.h"
+#include "obc.h"
+#include "spi.h"
+#include "utils.h"
+#ifdef IAC_HAVE_JPEG
+#include "jpeg.h"
+#endif
+
+/*
+ * End-to-end pipeline benchmark.  Frames from a camera backend, the
+ * simulator by default, are tiled, encoded, packetized and transferred
+ * to a simulated OBC, timing every stage.  Results are printed as JSON
+ * and optionally checked against a baseline, failing if the median
+ * latency or allocations of a stage regress beyond a threshold.
+ */
+#define BENCH_FRAMES                    10
+#define BENCH_THRESHOLD                 50
+#define BENCH_SLACK_USEC                50
+#define BENCH_RETRIES                   1000
+#define BENCH_CAMERA                    "sim"
+#define BENCH_SPI                       "sim:rate=0,turnaround=0,fork=1"
+
+enum {
+    STAGE_CAPTURE,
+    STAGE_READ,
+    STAGE_TILE,
+    STAGE_ENCODE,
+    STAGE_PACKET,
+    STAGE_SPI,
+    STAGE_FRAME,
+    STAGES
+};
+
+typedef struct stage_t {
+    double *samples;
+    size_t count;
+    size_t capacity;
+    unsigned long allocs;
+} stage_t;
+
+typedef struct bench_t {
+    stage_t stages[STAGES];
+    size_t tiles;
+    size_t bytes;
+    size_t bytes_min;
+    size_t bytes_max;
+    unsigned long allocs;
+} bench_t;
+
+static const char *stage_names[STAGES] = {
+    "capture",
+    "read",
+    "tile",
+    "encode",
+    "packet",
+    "spi",
+    "frame",
+};
+
+int verbose = 0;
+static unsigned long allocs;
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void *__libc_memalign(size_t, size_t);
+
+static void stage_begin(uint64_t *, unsigned long *);
+static int stage_end(stage_t *, const uint64_t, const unsigned long);
+static double stage_percentile(const double *, const size_t, const double);
+static int compare_samples(const void *, const void *);
+static int transfer(const int, const iac_obc_packets_t *, const unsigned int);
+static int bench_frame(bench_t *,
+                       const iac_cam_frame_t *,
+                       const int,
+                       const int,
+                       const unsigned int);
+static void report(const bench_t *, const iac_cam_frame_t *, const int);
+static double baseline_value(const char *, const char *, const char *);
+static int check(const bench_t *, const char *, const double);
+
+/*
+ * Count allocations of the whole process, including those of the image
+ * libraries, by interposing the allocator of the C library.
+ */
+void *malloc(size_t size)
+{
+
+    __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+
+}
+
+
+void *calloc(size_t nmemb, size_t size)
+{
+
+    __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(nmemb, size);
+
+}
+
+
+void *realloc(void *ptr, size_t size)
+{
+
+    __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+
+}
+
+
+int posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+
+    __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+    *ptr = __libc_memalign(alignment, size);
+    return *ptr ? 0 : ENOMEM;
+
+}
+
+
+static void stage_begin(uint64_t *start, unsigned long *count)
+{
+
+    *count = __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+    *start = iac_time_usec();
+
+}
+
+
+static int stage_end(stage_t *stage,
+                     const uint64_t start,
+                     const unsigned long count)
+{
+    double sample = (double) (iac_time_usec() - start);
+    double *samples;
+
+    stage->allocs += __atomic_load_n(&allocs, __ATOMIC_RELAXED) - count;
+    if (stage->count == stage->capacity) {
+        stage->capacity = stage->capacity ? 2 * stage->capacity : 256;
+        samples = realloc(stage->samples,
+                          stage->capacity * sizeof(*samples));
+        if (!samples) {
+            perror("Unable to allocate samples");
+            return IAC_FAILURE;
+        }
+        stage->samples = samples;
+    }
+    stage->samples[stage->count++] = sample;
+
+    return IAC_SUCCESS;
+}
+
+
+static int compare_samples(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+
+/* Nearest rank percentile of sorted samples */
+static double stage_percentile(const double *samples,
+                               const size_t count,
+                               const double percentile)
+{
+    size_t rank;
+
+    if (!count)
+        return 0;
+    rank = (size_t) (percentile / 100 * (double) count + 0.999999);
+    if (rank < 1)
+        rank = 1;
+    if (rank > count)
+        rank = count;
+
+    return samples[rank - 1];
+}
+
+
+/* Send tile blocks in batches, going back to the first one not acked */
+static int transfer(const int fd,
+                    const iac_obc_packets_t *packets,
+                    const unsigned int batch)
+{
+    uint8_t rx[IAC_SPI_BATCH_MAX * IAC_OBC_PACKET_SIZE_MAX];
+    size_t k = 0;
+    unsigned int i, m, retries = 0;
+
+    while (k < packets->count) {
+        m = packets->count - k < batch ?
+            (unsigned int) (packets->count - k) : batch;
+        if (iac_spi_transfer_batch(fd,
+                                   iac_obc_packets_at(packets, k),
+                                   rx,
+                                   (uint32_t) packets->size,
+                                   m,
+                                   0) == IAC_FAILURE)
+            return IAC_FAILURE;
+        for (i = 0; i < m && rx[i * packets->size] == IAC_OBC_BLOCK_ACK; i++)
+            ;
+        if (!i && ++retries > BENCH_RETRIES) {
+            fprintf(stderr, "OBC did not acknowledge block %u!\n",
+                    (unsigned int) k);
+            return IAC_FAILURE;
+        }
+        if (i)
+            retries = 0;
+        k += i;
+    }
+
+    return IAC_SUCCESS;
+}
+
+
+static int bench_frame(bench_t *bench,
+                       const iac_cam_frame_t *image,
+                       const int encoder,
+                       const int fd,
+                       const unsigned int batch)
+{
+    iac_image_read_params_t params = {
+        image->width,
+        image->height,
+        IAC_IMAGE_FORMAT,
+        IAC_IMAGE_DEPTH,
+    };
+    iac_image_frame_t frame;
+    iac_image_view_t *views = NULL;
+    MagickWand *wand = NULL;
+    MagickWand ***wands = NULL;
+    iac_obc_packets_t packets;
+    unsigned char *blob;
+    unsigned int tile;
+    unsigned long count;
+    uint64_t start;
+    size_t size;
+    int ret = IAC_FAILURE;
+
+    memset(&frame, 0, sizeof(frame));
+    frame.data = image->data;
+    frame.width = image->width;
+    frame.height = image->height;
+    frame.stride = image->width * IAC_IMAGE_CHANNELS;
+    iac_obc_packets_init(&packets, IAC_OBC_CHECKSUM_LRC);
+
+    if (encoder == IAC_ENCODER_MAGICK) {
+        stage_begin(&start, &count);
+        wand = iac_image_read_blob(&params,
+                                   frame.data,
+                                   frame.stride * frame.height);
+        if (!wand || stage_end(&bench->stages[STAGE_READ],
+                               start,
+                               count) == IAC_FAILURE)
+            goto out;
+
+        stage_begin(&start, &count);
+        wands = iac_image_tiles(wand, IAC_IMAGE_DIVS);
+        if (!wands || stage_end(&bench->stages[STAGE_TILE],
+                                start,
+                                count) == IAC_FAILURE)
+            goto out;
+    }
+    else {
+        stage_begin(&start, &count);
+        views = iac_image_views(&frame, IAC_IMAGE_DIVS);
+        if (!views || stage_end(&bench->stages[STAGE_TILE],
+                                start,
+                                count) == IAC_FAILURE)
+            goto out;
+    }
+
+    for (tile = 0; tile < IAC_IMAGE_DIVS * IAC_IMAGE_DIVS; tile++) {
+        stage_begin(&start, &count);
+#ifdef IAC_HAVE_JPEG
+        if (encoder == IAC_ENCODER_JPEG)
+            blob = iac_jpeg_encode(&views[tile],
+                                   IAC_IMAGE_BLOB_QUALITY,
+                                   &size);
+        else
+#endif
+            blob = iac_image_get_blob(wands[tile / IAC_IMAGE_DIVS]
+                                      [tile % IAC_IMAGE_DIVS],
+                                      &size);
+        if (!blob || stage_end(&bench->stages[STAGE_ENCODE],
+                               start,
+                               count) == IAC_FAILURE)
+            goto out;
+
+        bench->tiles++;
+        bench->bytes += size;
+        if (!bench->bytes_min || size < bench->bytes_min)
+            bench->bytes_min = size;
+        if (size > bench->bytes_max)
+            bench->bytes_max = size;
+
+        stage_begin(&start, &count);
+        if (iac_obc_tile_packets(&packets,
+                                 (uint8_t) tile,
+                                 blob,
+                                 size) == IAC_FAILURE
+            || stage_end(&bench->stages[STAGE_PACKET],
+                         start,
+                         count) == IAC_FAILURE)
+            goto free_blob;
+
+        stage_begin(&start, &count);
+        if (transfer(fd, &packets, batch) == IAC_FAILURE
+            || stage_end(&bench->stages[STAGE_SPI],
+                         start,
+                         count) == IAC_FAILURE)
+            goto free_blob;
+
+#ifdef IAC_HAVE_JPEG
+        if (encoder == IAC_ENCODER_JPEG)
+            iac_jpeg_free(blob);
+        else
+#endif
+            MagickRelinquishMemory(blob);
+    }
+    ret = IAC_SUCCESS;
+    goto out;
+
+free_blob:
+#ifdef IAC_HAVE_JPEG
+    if (encoder == IAC_ENCODER_JPEG)
+        iac_jpeg_free(blob);
+    else
+#endif
+        MagickRelinquishMemory(blob);
+out:
+    if (wands)
+        iac_image_tiles_destroy(wands, IAC_IMAGE_DIVS);
+    if (wand)
+        iac_image_destroy(wand);
+    free(views);
+    iac_obc_packets_free(&packets);
+
+    return ret;
+}
+
+
+static void report(const bench_t *bench,
+                   const iac_cam_frame_t *image,
+                   const int encoder)
+{
+    const stage_t *stage;
+    struct rusage usage;
+    unsigned int k;
+    int first = 1;
+
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("{\n");
+    printf("  \"encoder\": \"%s\",\n",
+           encoder == IAC_ENCODER_JPEG ? "jpeg" : "magick");
+    printf("  \"width\": %zu,\n", image->width);
+    printf("  \"height\": %zu,\n", image->height);
+    printf("  \"frames\": %zu,\n", bench->stages[STAGE_FRAME].count);
+    printf("  \"tiles\": %zu,\n", bench->tiles);
+    printf("  \"stages\": {");
+    for (k = 0; k < STAGES; k++) {
+        stage = &bench->stages[k];
+        if (!stage->count)
+            continue;
+        printf("%s\n    \"%s\": { \"count\": %zu, "
+               "\"p50_us\": %.1f, \"p95_us\": %.1f, \"p99_us\": %.1f, "
+               "\"allocs_per_op\": %.1f }",
+               first ? "" : ",",
+               stage_names[k],
+               stage->count,
+               stage_percentile(stage->samples, stage->count, 50),
+               stage_percentile(stage->samples, stage->count, 95),
+               stage_percentile(stage->samples, stage->count, 99),
+               (double) stage->allocs / (double) stage->count);
+        first = 0;
+    }
+    printf("\n  },\n");
+    printf("  \"bytes_per_tile\": { \"mean\": %.1f, \"min\": %zu, "
+           "\"max\": %zu },\n",
+           bench->tiles ? (double) bench->bytes / (double) bench->tiles : 0,
+           bench->bytes_min,
+           bench->bytes_max);
+    printf("  \"allocations\": %lu,\n", bench->allocs);
+    printf("  \"peak_rss_kb\": %ld\n", usage.ru_maxrss);
+    printf("}\n");
+
+}
+
+
+/* Find value of key within stage object of baseline JSON, -1 if absent */
+static double baseline_value(const char *json,
+                             const char *name,
+                             const char *key)
+{
+    char pattern[64];
+    const char *p, *end;
+
+    snprintf(pattern, sizeof(pattern), "\"%s\":", name);
+    p = strstr(json, pattern);
+    if (!p)
+        return -1;
+    end = strchr(p, '}');
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    p = strstr(p, pattern);
+    if (!p || (end && p > end))
+        return -1;
+
+    return strtod(p + strlen(pattern), NULL);
+}
+
+
+static int check(const bench_t *bench,
+                 const char *path,
+                 const double threshold)
+{
+    const stage_t *stage;
+    char *json;
+    FILE *fp;
+    long size;
+    double base, current, limit;
+    unsigned int k;
+    int ret = IAC_SUCCESS;
+
+    fp = fopen(path, "r");
+    if (!fp) {
+        perror("Unable to open baseline");
+        return IAC_FAILURE;
+    }
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    rewind(fp);
+    json = calloc(1, (size_t) size + 1);
+    if (!json || fread(json, 1, (size_t) size, fp) != (size_t) size) {
+        fprintf(stderr, "Unable to read baseline!\n");
+        free(json);
+        fclose(fp);
+        return IAC_FAILURE;
+    }
+    fclose(fp);
+
+    for (k = 0; k < STAGES; k++) {
+        stage = &bench->stages[k];
+        if (!stage->count)
+            continue;
+
+        base = baseline_value(json, stage_names[k], "p50_us");
+        current = stage_percentile(stage->samples, stage->count, 50);
+        limit = base * (1 + threshold / 100) + BENCH_SLACK_USEC;
+        if (base >= 0 && current > limit) {
+            fprintf(stderr,
+                    "Stage %s regressed: p50 %.1f us, baseline %.1f us\n",
+                    stage_names[k],
+                    current,
+                    base);
+            ret = IAC_FAILURE;
+        }
+
+        base = baseline_value(json, stage_names[k], "allocs_per_op");
+        current = (double) stage->allocs / (double) stage->count;
+        limit = base * (1 + threshold / 100) + 1;
+        if (base >= 0 && current > limit) {
+            fprintf(stderr,
+                    "Stage %s regressed: %.1f allocations, baseline %.1f\n",
+                    stage_names[k],
+                    current,
+                    base);
+            ret = IAC_FAILURE;
+        }
+    }
+    free(json);
+
+    return ret;
+}
+
+
+int main(int argc, char **argv)
+{
+    static struct option long_options[] = {
+        { "frames", required_argument, 0, 'n' },
+        { "camera", required_argument, 0, 'c' },
+        { "spi-device", required_argument, 0, 'D' },
+        { "encoder", required_argument, 0, 'e' },
+        { "batch", required_argument, 0, 'b' },
+        { "baseline", required_argument, 0, 'B' },
+        { "threshold", required_argument, 0, 't' },
+        { 0, 0, 0, 0 }
+    };
+    iac_spi_init_params_t spi_params = {
+        IAC_SPI_MODE,
+        IAC_SPI_BITS,
+        IAC_SPI_MAX_HZ,
+    };
+    iac_cam_init_params_t cam_params = { 0, 0, 0, 1 };
+    const char *camera = BENCH_CAMERA, *device = BENCH_SPI;
+    const char *baseline = NULL;
+    double threshold = BENCH_THRESHOLD;
+    unsigned int frames = BENCH_FRAMES, batch = 1, n;
+    int opt, fd, encoder = IAC_ENCODER_MAGICK;
+    iac_cam_t cam;
+    iac_cam_frame_t *image, last;
+    bench_t bench;
+    unsigned long count;
+    uint64_t start;
+
+    while ((opt = getopt_long(argc,
+                              argv,
+                              "n:c:D:e:b:B:t:",
+                              long_options,
+                              NULL)) != -1) {
+        switch (opt) {
+        case 'n':
+            frames = (unsigned int) atoi(optarg);
+            break;
+        case 'c':
+            camera = optarg;
+            break;
+        case 'D':
+            device = optarg;
+            break;
+        case 'e':
+            if (!strcmp(optarg, "magick")) {
+                encoder = IAC_ENCODER_MAGICK;
+            }
+#ifdef IAC_HAVE_JPEG
+            else if (!strcmp(optarg, "jpeg")) {
+                encoder = IAC_ENCODER_JPEG;
+            }
+#endif
+            else {
+                fprintf(stderr, "Unknown encoder '%s'!\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'b':
+            batch = (unsigned int) atoi(optarg);
+            break;
+        case 'B':
+            baseline = optarg;
+            break;
+        case 't':
+            threshold = atof(optarg);
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [--frames=N] [--camera=SPEC] "
+                    "[--spi-device=SPEC] [--encoder=ENCODER] [--batch=N] "
+                    "[--baseline=FILE] [--threshold=PERCENT]\n",
+                    argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (!frames || !batch || batch > IAC_SPI_BATCH_MAX) {
+        fprintf(stderr, "Invalid number of frames or batch size!\n");
+        return EXIT_FAILURE;
+    }
+
+    memset(&bench, 0, sizeof(bench));
+    iac_image_init();
+    if (iac_cam_open(&cam, camera) == IAC_FAILURE)
+        return EXIT_FAILURE;
+    if (iac_cam_init(&cam, &cam_params) == IAC_FAILURE
+        || iac_cam_stream_start(&cam, 1) == IAC_FAILURE) {
+        iac_cam_close(&cam);
+        return EXIT_FAILURE;
+    }
+    fd = iac_spi_init(device, &spi_params);
+    if (fd == -1)
+        return EXIT_FAILURE;
+
+    for (n = 0; n < frames; n++) {
+        stage_begin(&start, &count);
+        image = iac_cam_stream_get(&cam);
+        if (!image || stage_end(&bench.stages[STAGE_CAPTURE],
+                                start,
+                                count) == IAC_FAILURE)
+            return EXIT_FAILURE;
+
+        if (bench_frame(&bench, image, encoder, fd, batch) == IAC_FAILURE)
+            return EXIT_FAILURE;
+        last = *image;
+        iac_cam_stream_put(&cam, image);
+
+        /* Whole frame, from capture to the last block on the link */
+        if (stage_end(&bench.stages[STAGE_FRAME],
+                      start,
+                      count) == IAC_FAILURE)
+            return EXIT_FAILURE;
+    }
+    bench.allocs = __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+
+    iac_spi_close(fd);
+    iac_cam_stream_stop(&cam);
+    iac_cam_close(&cam);
+    iac_image_term();
+
+    for (n = 0; n < STAGES; n++)
+        qsort(bench.stages[n].samples,
+              bench.stages[n].count,
+              sizeof(double),
+              compare_samples);
+    report(&bench, &last, encoder);
+
+    if (baseline && check(&bench, baseline, threshold) == IAC_FAILURE)
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2016 Libre Space Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "iac.h"
+#include "camera.h"
+
+#define TEST_CAMERA                     "sim:width=64,height=48"
+#define TEST_BUFFERS                    3
+#define TEST_FRAMES                     20
+
+int verbose = 0;
+static int test_ring(const int);
+
+/*
+ * Hold a frame of the ring while the camera keeps filling the other
+ * slots, and check that the frame held is never written over.
+ */
+static int test_ring(const int bayer)
+{
+    iac_cam_t cam;
+    iac_cam_init_params_t params = { 0, 0, 0, TEST_BUFFERS, bayer };
+    iac_cam_frame_t *held, *frame, *busy[TEST_BUFFERS];
+    unsigned char *copy = NULL;
+    unsigned int n, i;
+    int ret = IAC_FAILURE;
+
+    if (iac_cam_open(&cam, TEST_CAMERA) == IAC_FAILURE)
+        return IAC_FAILURE;
+    if (iac_cam_init(&cam, &params) == IAC_FAILURE
+        || iac_cam_stream_start(&cam, TEST_BUFFERS) == IAC_FAILURE) {
+        iac_cam_close(&cam);
+        return IAC_FAILURE;
+    }
+
+    held = iac_cam_stream_get(&cam);
+    if (!held)
+        goto out;
+    copy = malloc(held->size);
+    if (!copy)
+        goto out;
+    memcpy(copy, held->data, held->size);
+
+    for (n = 0; n < TEST_FRAMES; n++) {
+        frame = iac_cam_stream_get(&cam);
+        if (!frame || frame->slot == held->slot) {
+            fprintf(stderr, "Frame %u took the slot held!\n", n);
+            goto out;
+        }
+        if (!memcmp(frame->data, copy, held->size)) {
+            fprintf(stderr, "Frame %u repeats the frame held!\n", n);
+            goto out;
+        }
+        iac_cam_stream_put(&cam, frame);
+        if (memcmp(held->data, copy, held->size)) {
+            fprintf(stderr, "Frame held was overwritten by frame %u!\n", n);
+            goto out;
+        }
+    }
+
+    /* With every slot busy, no frame can be taken */
+    for (i = 0; i < TEST_BUFFERS - 1; i++) {
+        busy[i] = iac_cam_stream_get(&cam);
+        if (!busy[i])
+            goto out;
+    }
+    if (iac_cam_stream_get(&cam)) {
+        fprintf(stderr, "Frame was taken from a full ring!\n");
+        goto out;
+    }
+    for (i = 0; i < TEST_BUFFERS - 1; i++)
+        iac_cam_stream_put(&cam, busy[i]);
+    if (memcmp(held->data, copy, held->size)) {
+        fprintf(stderr, "Frame held was overwritten!\n");
+        goto out;
+    }
+    iac_cam_stream_put(&cam, held);
+    ret = IAC_SUCCESS;
+
+out:
+    free(copy);
+    if (iac_cam_stream_stop(&cam) == IAC_FAILURE)
+        ret = IAC_FAILURE;
+    if (iac_cam_close(&cam) == IAC_FAILURE)
+        ret = IAC_FAILURE;
+
+    return ret;
+}
+
+
+int main(void)
+{
+
+    if (test_ring(0) == IAC_FAILURE || test_ring(1) == IAC_FAILURE) {
+        fprintf(stderr, "Camera ring test failed!\n");
+        return EXIT_FAILURE;
+    }
+    printf("Camera ring test passed\n");
+
+    return EXIT_SUCCESS;
+
+}
@@ -0,0 +1,258 @@
+/*
+ * Copyright (C) 2016 Libre Space Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "iac.h"
+#include "utils.h"
+#include "obc.h"
+
+#define BENCH_TILE_SIZE                 8192
+#define BENCH_ITERATIONS                2000
+#define BENCH_CHECKSUM_BLOCKS           1000000
+
+int verbose = 0;
+static double now(void);
+static iac_obc_packet_t legacy_packet(const iac_obc_block_t *);
+static int bench_per_block(iac_obc_packet_t (*)(const iac_obc_block_t *),
+                           const uint8_t *,
+                           const size_t,
+                           uint8_t *);
+static int bench_legacy(const uint8_t *, const size_t, uint8_t *);
+static int bench_single(const uint8_t *, const size_t, uint8_t *);
+static int bench_batch(iac_obc_packets_t *, const uint8_t *, const size_t);
+static double bench_checksum(const int, const uint8_t *);
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+
+/* Packet encoder as it was before fixed-size packets */
+static iac_obc_packet_t legacy_packet(const iac_obc_block_t *block)
+{
+    iac_obc_packet_t packet;
+
+    packet.buf = NULL;
+    packet.size = 0;
+    packet.buf = iac_serialize(packet.buf,
+                               &packet.size,
+                               (uint8_t) block->tile);
+    packet.buf = iac_serialize_short(packet.buf, &packet.size, block->index);
+    packet.buf = iac_serialize_data(packet.buf,
+                                    &packet.size,
+                                    block->data,
+                                    block->data_size);
+    if (block->data_size < IAC_OBC_BLOCK_SIZE)
+        packet.buf = iac_serialize_pad(packet.buf,
+                                       &packet.size,
+                                       IAC_OBC_BLOCK_PADDING,
+                                       IAC_OBC_BLOCK_SIZE - block->data_size);
+    packet.buf = iac_serialize(packet.buf,
+                               &packet.size,
+                               iac_lrc(packet.buf, packet.size));
+
+    return packet;
+}
+
+
+static int bench_per_block(iac_obc_packet_t (*encode)(const iac_obc_block_t *),
+                           const uint8_t *blob,
+                           const size_t size,
+                           uint8_t *out)
+{
+    iac_obc_block_t block;
+    iac_obc_packet_t packet;
+    uint16_t blocks_data;
+    size_t k, blocks;
+
+    blocks = (size + IAC_OBC_BLOCK_SIZE - 1) / IAC_OBC_BLOCK_SIZE;
+    block.tile = 0;
+    for (k = 0; k <= blocks; k++) {
+        block.index = (uint16_t) k;
+        if (k == 0) {
+            blocks_data = htons((uint16_t) blocks);
+            block.data = (const uint8_t *) &blocks_data;
+            block.data_size = sizeof(blocks_data);
+        }
+        else {
+            block.data = blob + (k - 1) * IAC_OBC_BLOCK_SIZE;
+            if (k == blocks && size % IAC_OBC_BLOCK_SIZE)
+                block.data_size = size % IAC_OBC_BLOCK_SIZE;
+            else
+                block.data_size = IAC_OBC_BLOCK_SIZE;
+        }
+        packet = encode(&block);
+        if (!packet.buf || packet.size != IAC_OBC_PACKET_SIZE)
+            return IAC_FAILURE;
+        if (out)
+            memcpy(out + k * IAC_OBC_PACKET_SIZE, packet.buf, packet.size);
+        free(packet.buf);
+    }
+
+    return (int) (blocks + 1);
+}
+
+
+static int bench_legacy(const uint8_t *blob, const size_t size, uint8_t *out)
+{
+
+    return bench_per_block(legacy_packet, blob, size, out);
+}
+
+
+static int bench_single(const uint8_t *blob, const size_t size, uint8_t *out)
+{
+
+    return bench_per_block(iac_obc_packet, blob, size, out);
+}
+
+
+static int bench_batch(iac_obc_packets_t *packets,
+                       const uint8_t *blob,
+                       const size_t size)
+{
+
+    if (iac_obc_tile_packets(packets, 0, blob, size) == IAC_FAILURE)
+        return IAC_FAILURE;
+
+    return (int) packets->count;
+}
+
+
+/* Time checksum of tile, index and data of a block */
+static double bench_checksum(const int checksum, const uint8_t *blob)
+{
+    volatile uint32_t sink = 0;
+    double start;
+    long i;
+
+    start = now();
+    for (i = 0; i < BENCH_CHECKSUM_BLOCKS; i++) {
+        switch (checksum) {
+        case IAC_OBC_CHECKSUM_CRC16:
+            sink ^= iac_crc16(blob, IAC_OBC_BLOCK_SIZE + 3);
+            break;
+        case IAC_OBC_CHECKSUM_CRC32C:
+            sink ^= iac_crc32c(blob, IAC_OBC_BLOCK_SIZE + 3);
+            break;
+        default:
+            sink ^= iac_lrc(blob, IAC_OBC_BLOCK_SIZE + 3);
+            break;
+        }
+    }
+
+    return (now() - start) * 1e9 / BENCH_CHECKSUM_BLOCKS;
+}
+
+
+int main(int argc, char **argv)
+{
+    uint8_t *blob, *legacy, *single;
+    iac_obc_packets_t packets;
+    static const char *checksums[] = { "lrc", "crc16", "crc32c" };
+    int checksum;
+    size_t size = BENCH_TILE_SIZE;
+    long iterations = BENCH_ITERATIONS;
+    long i;
+    int count = 0;
+    double start, legacy_time, single_time, batch_time;
+
+    if (argc > 1)
+        iterations = atol(argv[1]);
+    if (argc > 2)
+        size = (size_t) atol(argv[2]);
+
+    if (size < IAC_OBC_BLOCK_SIZE + 3)
+        size = IAC_OBC_BLOCK_SIZE + 3;
+    blob = malloc(size);
+    legacy = malloc((size / IAC_OBC_BLOCK_SIZE + 2) * IAC_OBC_PACKET_SIZE);
+    single = malloc((size / IAC_OBC_BLOCK_SIZE + 2) * IAC_OBC_PACKET_SIZE);
+    if (!blob || !legacy || !single)
+        return EXIT_FAILURE;
+    srand(1);
+    for (i = 0; i < (long) size; i++)
+        blob[i] = (uint8_t) rand();
+
+    /* Check that all encoders produce the same packets */
+    iac_obc_packets_init(&packets, IAC_OBC_CHECKSUM_LRC);
+    count = bench_legacy(blob, size, legacy);
+    if (count == IAC_FAILURE
+        || bench_single(blob, size, single) != count
+        || bench_batch(&packets, blob, size) != count
+        || memcmp(legacy, single, (size_t) count * IAC_OBC_PACKET_SIZE)
+        || memcmp(legacy, packets.buf, (size_t) count * IAC_OBC_PACKET_SIZE)) {
+        fprintf(stderr, "Packet encoders disagree!\n");
+        return EXIT_FAILURE;
+    }
+
+    start = now();
+    for (i = 0; i < iterations; i++)
+        bench_legacy(blob, size, NULL);
+    legacy_time = now() - start;
+
+    start = now();
+    for (i = 0; i < iterations; i++)
+        bench_single(blob, size, NULL);
+    single_time = now() - start;
+
+    start = now();
+    for (i = 0; i < iterations; i++)
+        bench_batch(&packets, blob, size);
+    batch_time = now() - start;
+
+    printf("Tile size %u bytes, %d packets, %ld iterations\n",
+           (unsigned int) size, count, iterations);
+    printf("serialize: %12.0f packets/s\n",
+           (double) count * (double) iterations / legacy_time);
+    printf("packet:    %12.0f packets/s\n",
+           (double) count * (double) iterations / single_time);
+    printf("batch:     %12.0f packets/s\n",
+           (double) count * (double) iterations / batch_time);
+    iac_obc_packets_free(&packets);
+
+    /* Cost of block trailer checksums */
+    for (checksum = IAC_OBC_CHECKSUM_LRC;
+         checksum <= IAC_OBC_CHECKSUM_CRC32C;
+         checksum++) {
+        iac_obc_packets_init(&packets, checksum);
+        start = now();
+        for (i = 0; i < iterations; i++)
+            bench_batch(&packets, blob, size);
+        batch_time = now() - start;
+        printf("%-6s %8.1f ns/block %12.0f packets/s\n",
+               checksums[checksum],
+               bench_checksum(checksum, blob),
+               (double) count * (double) iterations / batch_time);
+        iac_obc_packets_free(&packets);
+    }
+
+    free(single);
+    free(legacy);
+    free(blob);
+
+    return EXIT_SUCCESS;
+}
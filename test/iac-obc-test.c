@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2016 Libre Space Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "iac.h"
+#include "obc.h"
+
+int verbose = 0;
+static int test_tile_blocks(void);
+static int test_ack_backoff(void);
+
+/*
+ * The largest tile takes every block index below those of poll and
+ * request blocks, and a tile one byte larger is refused.
+ */
+static int test_tile_blocks(void)
+{
+    iac_obc_packets_t packets;
+    iac_obc_block_t block;
+    uint8_t *blob;
+    size_t size = (size_t) IAC_OBC_TILE_BLOCKS_MAX * IAC_OBC_BLOCK_SIZE;
+    int ret = IAC_FAILURE;
+
+    blob = calloc(1, size + 1);
+    if (!blob)
+        return IAC_FAILURE;
+    iac_obc_packets_init(&packets, IAC_OBC_CHECKSUM_CRC16);
+
+    if (iac_obc_tile_packets(&packets, 1, blob, size) == IAC_FAILURE) {
+        fprintf(stderr, "Largest tile was refused!\n");
+        goto out;
+    }
+    if (packets.count != (size_t) IAC_OBC_TILE_BLOCKS_MAX + 1
+        || iac_obc_packet_decode(&block,
+                                 iac_obc_packets_at(&packets,
+                                                    packets.count - 1),
+                                 packets.checksum) == IAC_FAILURE
+        || block.index != IAC_OBC_TILE_BLOCKS_MAX
+        || block.index >= IAC_OBC_BLOCK_REQUEST) {
+        fprintf(stderr, "Last block of largest tile is misnumbered!\n");
+        goto out;
+    }
+    if (iac_obc_tile_packets(&packets, 1, blob, size + 1) == IAC_SUCCESS) {
+        fprintf(stderr, "Tile overflowing block indices was accepted!\n");
+        goto out;
+    }
+    ret = IAC_SUCCESS;
+
+out:
+    iac_obc_packets_free(&packets);
+    free(blob);
+
+    return ret;
+}
+
+
+/* Backoff from no delay still sleeps, and grows up to its ceiling */
+static int test_ack_backoff(void)
+{
+    iac_obc_ack_params_t params;
+    iac_obc_ack_t ack;
+    unsigned int k, delay = 0;
+
+    memset(&params, 0, sizeof(params));
+    params.max_usleep = 100;
+    iac_obc_ack_init(&ack, &params);
+    iac_obc_ack_start(&ack);
+    for (k = 0; k < 10; k++) {
+        iac_obc_ack_result(&ack, 0);
+        if (!ack.delay || ack.delay < delay || ack.delay > params.max_usleep) {
+            fprintf(stderr, "Backoff %u after %u retries!\n", ack.delay, k);
+            return IAC_FAILURE;
+        }
+        delay = ack.delay;
+    }
+    if (delay != params.max_usleep) {
+        fprintf(stderr, "Backoff stopped at %u!\n", delay);
+        return IAC_FAILURE;
+    }
+
+    return IAC_SUCCESS;
+}
+
+
+int main(void)
+{
+
+    if (test_tile_blocks() == IAC_FAILURE
+        || test_ack_backoff() == IAC_FAILURE) {
+        fprintf(stderr, "OBC test failed!\n");
+        return EXIT_FAILURE;
+    }
+    printf("OBC test passed\n");
+
+    return EXIT_SUCCESS;
+
+}
@@ -27,7 +27,7 @@ int verbose = 0;
 
 int main(int argc, char **argv)
 {
-    char *device = IAC_SPI_DEFAULT_DEVICE;
+    const char *device = argc > 1 ? argv[1] : IAC_SPI_DEFAULT_DEVICE;
     iac_spi_init_params_t params = {
         IAC_SPI_MODE,
         IAC_SPI_BITS,
@@ -53,6 +53,6 @@ int main(int argc, char **argv)
     /* Print response */
     IAC_VERBOSE("Response: 0x%02x\n", blob[0]);
 
-    close(fd);
+    iac_spi_close(fd);
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,392 @@
+/*
+ * Copyright (C) 2016 Libre Space Foundation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <wand/magick_wand.h>
+#include "iac.h"
+#include "image.h"
+#include "demosaic.h"
+#ifdef IAC_HAVE_JPEG
+#include "jpeg.h"
+#endif
+
+#define BENCH_WIDTH                     2592
+#define BENCH_HEIGHT                    1944
+
+int verbose = 0;
+static const char *bench_file;
+static unsigned char *bench_raw;
+static double now(void);
+static int bench_crop(const iac_image_frame_t *);
+static int bench_view(const iac_image_frame_t *);
+#ifdef IAC_HAVE_JPEG
+static int bench_jpeg(const iac_image_frame_t *);
+#endif
+static int bench_tiles(const iac_image_frame_t *);
+static int bench_read(const iac_image_frame_t *);
+static int bench_map(const iac_image_frame_t *);
+static int bench_demosaic(const iac_image_frame_t *, const int);
+static int bench_bilinear(const iac_image_frame_t *);
+static int bench_edge(const iac_image_frame_t *);
+static int run(const char *,
+               int (*)(const iac_image_frame_t *),
+               const iac_image_frame_t *);
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+
+/* Clone and crop the whole image for every tile */
+static int bench_crop(const iac_image_frame_t *frame)
+{
+    MagickWand *wand;
+    MagickWand ***wands;
+    unsigned char *blob;
+    size_t size;
+    unsigned int i, j;
+    iac_image_read_params_t params = {
+        frame->width,
+        frame->height,
+        IAC_IMAGE_FORMAT,
+        IAC_IMAGE_DEPTH,
+    };
+
+    wand = iac_image_read_blob(&params,
+                               frame->data,
+                               frame->stride * frame->height);
+    if (!wand)
+        return IAC_FAILURE;
+    wands = iac_image_tiles(wand, IAC_IMAGE_DIVS);
+    if (!wands)
+        return IAC_FAILURE;
+    for (i = 0; i < IAC_IMAGE_DIVS; i++) {
+        for (j = 0; j < IAC_IMAGE_DIVS; j++) {
+            blob = iac_image_get_blob(wands[i][j], &size);
+            if (!blob)
+                return IAC_FAILURE;
+            MagickRelinquishMemory(blob);
+        }
+    }
+    iac_image_tiles_destroy(wands, IAC_IMAGE_DIVS);
+    iac_image_destroy(wand);
+
+    return IAC_SUCCESS;
+}
+
+
+/* Materialize each tile from a view into the frame */
+static int bench_view(const iac_image_frame_t *frame)
+{
+    iac_image_view_t *views;
+    unsigned char *blob;
+    size_t size;
+    unsigned int tile;
+
+    views = iac_image_views(frame, IAC_IMAGE_DIVS);
+    if (!views)
+        return IAC_FAILURE;
+    for (tile = 0; tile < IAC_IMAGE_DIVS * IAC_IMAGE_DIVS; tile++) {
+        blob = iac_image_view_get_blob(&views[tile],
+                                       IAC_IMAGE_BLOB_QUALITY,
+                                       &size);
+        if (!blob)
+            return IAC_FAILURE;
+        MagickRelinquishMemory(blob);
+    }
+    free(views);
+
+    return IAC_SUCCESS;
+}
+
+
+#ifdef IAC_HAVE_JPEG
+/* Compress each tile view with libjpeg-turbo */
+static int bench_jpeg(const iac_image_frame_t *frame)
+{
+    iac_image_view_t *views;
+    unsigned char *blob;
+    size_t size;
+    unsigned int tile;
+
+    views = iac_image_views(frame, IAC_IMAGE_DIVS);
+    if (!views)
+        return IAC_FAILURE;
+    for (tile = 0; tile < IAC_IMAGE_DIVS * IAC_IMAGE_DIVS; tile++) {
+        blob = iac_jpeg_encode(&views[tile], IAC_IMAGE_BLOB_QUALITY, &size);
+        if (!blob)
+            return IAC_FAILURE;
+        iac_jpeg_free(blob);
+    }
+    free(views);
+
+    return IAC_SUCCESS;
+}
+#endif
+
+
+/* Encode tiles of a frame loaded by a benchmark, as the utility does */
+static int bench_tiles(const iac_image_frame_t *frame)
+{
+
+#ifdef IAC_HAVE_JPEG
+    return bench_jpeg(frame);
+#else
+    return bench_view(frame);
+#endif
+}
+
+
+/* Read raw frame file into a buffer of its own, then tile it */
+static int bench_read(const iac_image_frame_t *frame)
+{
+    iac_image_frame_t copy = *frame;
+    unsigned char *buf;
+    size_t size, done;
+    ssize_t ret;
+    int fd, status;
+
+    size = frame->stride * frame->height;
+    fd = open(bench_file, O_RDONLY);
+    if (fd == -1) {
+        perror("Unable to open image file");
+        return IAC_FAILURE;
+    }
+    buf = malloc(size);
+    if (!buf) {
+        close(fd);
+        return IAC_FAILURE;
+    }
+    for (done = 0; done < size; done += (size_t) ret) {
+        ret = read(fd, buf + done, size - done);
+        if (ret <= 0) {
+            free(buf);
+            close(fd);
+            return IAC_FAILURE;
+        }
+    }
+    close(fd);
+    copy.data = buf;
+    status = bench_tiles(&copy);
+    free(buf);
+
+    return status;
+}
+
+
+/* Map raw frame file, then tile it from the page cache */
+static int bench_map(const iac_image_frame_t *frame)
+{
+    iac_image_frame_t mapped;
+    iac_image_read_params_t params = {
+        frame->width,
+        frame->height,
+        IAC_IMAGE_FORMAT,
+        IAC_IMAGE_DEPTH,
+    };
+    int status;
+
+    if (iac_image_frame_file(&mapped, &params, bench_file) == IAC_FAILURE)
+        return IAC_FAILURE;
+    status = bench_tiles(&mapped);
+    iac_image_frame_free(&mapped);
+
+    return status;
+}
+
+
+/* Interpolate raw Bayer frame sampled from the frame, then tile it */
+static int bench_demosaic(const iac_image_frame_t *frame, const int method)
+{
+    iac_image_frame_t copy = *frame;
+    iac_demosaic_params_t params = {
+        IAC_BAYER_RGGB,
+        method,
+        { 1, 1, 1 },
+    };
+    unsigned char *buf;
+    int status;
+
+    buf = malloc(frame->stride * frame->height);
+    if (!buf)
+        return IAC_FAILURE;
+    if (iac_demosaic(buf,
+                     bench_raw,
+                     frame->width,
+                     frame->height,
+                     &params) == IAC_FAILURE) {
+        free(buf);
+        return IAC_FAILURE;
+    }
+    copy.data = buf;
+    status = bench_tiles(&copy);
+    free(buf);
+
+    return status;
+}
+
+
+static int bench_bilinear(const iac_image_frame_t *frame)
+{
+
+    return bench_demosaic(frame, IAC_DEMOSAIC_BILINEAR);
+
+}
+
+
+static int bench_edge(const iac_image_frame_t *frame)
+{
+
+    return bench_demosaic(frame, IAC_DEMOSAIC_EDGE);
+
+}
+
+
+/* Run benchmark in a child process to measure its own peak memory */
+static int run(const char *name,
+               int (*bench)(const iac_image_frame_t *),
+               const iac_image_frame_t *frame)
+{
+    pid_t pid;
+    int status;
+    struct rusage usage;
+    double start, elapsed;
+
+    start = now();
+    pid = fork();
+    if (pid == -1) {
+        perror("Unable to fork");
+        return IAC_FAILURE;
+    }
+    if (pid == 0) {
+        iac_image_init();
+        status = bench(frame);
+        iac_image_term();
+        _exit(status == IAC_SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    if (wait4(pid, &status, 0, &usage) == -1) {
+        perror("Unable to wait for benchmark");
+        return IAC_FAILURE;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        fprintf(stderr, "Benchmark %s failed!\n", name);
+        return IAC_FAILURE;
+    }
+    elapsed = now() - start;
+    printf("%-6s %8.3f s %8.3f ms/tile %10ld KiB peak RSS\n",
+           name,
+           elapsed,
+           elapsed * 1e3 / (IAC_IMAGE_DIVS * IAC_IMAGE_DIVS),
+           usage.ru_maxrss);
+
+    return IAC_SUCCESS;
+}
+
+
+int main(int argc, char **argv)
+{
+    iac_image_frame_t frame;
+    iac_image_read_params_t params = {
+        BENCH_WIDTH,
+        BENCH_HEIGHT,
+        IAC_IMAGE_FORMAT,
+        IAC_IMAGE_DEPTH,
+    };
+    unsigned char *buf;
+    size_t i, size;
+
+    if (argc > 2) {
+        params.width = (size_t) atoi(argv[1]);
+        params.height = (size_t) atoi(argv[2]);
+    }
+
+    if (argc > 3) {
+        /* Raw BGR frame from file */
+        bench_file = argv[3];
+        if (iac_image_frame_file(&frame, &params, argv[3]) == IAC_FAILURE)
+            return EXIT_FAILURE;
+    }
+    else {
+        /* Synthetic gradient with noise */
+        memset(&frame, 0, sizeof(frame));
+        frame.width = params.width;
+        frame.height = params.height;
+        frame.stride = params.width * IAC_IMAGE_CHANNELS;
+        size = frame.stride * frame.height;
+        buf = malloc(size);
+        if (!buf)
+            return EXIT_FAILURE;
+        srand(1);
+        for (i = 0; i < size; i++)
+            buf[i] = (unsigned char) ((i % frame.stride) / 16
+                                     + (size_t) (rand() % 16));
+        frame.buf = buf;
+        frame.data = buf;
+    }
+
+    printf("Tiling %ux%u image into %u tiles\n",
+           (unsigned int) frame.width,
+           (unsigned int) frame.height,
+           IAC_IMAGE_DIVS * IAC_IMAGE_DIVS);
+    if (run("crop", bench_crop, &frame) == IAC_FAILURE
+        || run("view", bench_view, &frame) == IAC_FAILURE)
+        return EXIT_FAILURE;
+#ifdef IAC_HAVE_JPEG
+    if (run("jpeg", bench_jpeg, &frame) == IAC_FAILURE)
+        return EXIT_FAILURE;
+#endif
+
+    /* Load the file in each child, copied or mapped */
+    if (bench_file
+        && (run("read", bench_read, &frame) == IAC_FAILURE
+            || run("mmap", bench_map, &frame) == IAC_FAILURE))
+        return EXIT_FAILURE;
+
+    /* Raw Bayer frame, as captured instead of BGR */
+    bench_raw = malloc(frame.width * frame.height);
+    if (!bench_raw)
+        return EXIT_FAILURE;
+    iac_demosaic_sample(bench_raw,
+                        frame.data,
+                        frame.width,
+                        frame.height,
+                        IAC_BAYER_RGGB);
+    if (run("bayer", bench_bilinear, &frame) == IAC_FAILURE
+        || run("edge", bench_edge, &frame) == IAC_FAILURE)
+        return EXIT_FAILURE;
+    free(bench_raw);
+
+    iac_image_frame_free(&frame);
+
+    return EXIT_SUCCESS;
+}